@@ -21,6 +21,10 @@
 #include "src/reflux/audio_base.hpp"
 #include "src/reflux/audio_clip.hpp"
 #include "src/reflux/audio_slice.hpp"
+#include "src/reflux/auto_gain.hpp"
+#include "src/reflux/onset_detector.hpp"
+#include "src/reflux/prerender.hpp"
+#include "src/reflux/slice_exporter.hpp"
 #include "src/shared/components.hpp"
 #include "src/shared/make_builder.hpp"
 #include "src/shared/nvg_helpers.hpp"
@@ -156,14 +160,29 @@ struct Reflux: Module {
         INCV_PAN,
         INCV_SPEED,
         INCV_XHIFT,
+        INCV_SELECT_SIMILAR,
         INCV_TARGET_MAX
     };
     enum PlaybackPanelTarget { PLAYBACK_TARGET_CLIP, PLAYBACK_TARGET_SLICE, PLAYBACK_TARGET_MAX };
 
     // State
+    // declared first so they outlive the clips and slices that queue work on them
+    PrerenderBuilder prerenderer;
+    DisplayBufferBuilder slice_dbb;
+    DisplayBufferBuilder clip_dbb;
+    SliceTable slice_table;
+
     static const int NUM_CLIPS = 12;
     std::array<AudioClip, NUM_CLIPS> clips;
     std::vector<std::shared_ptr<AudioSlice>> slices {};
+    // deleted slices the pool queue had no room for, handed over again on the next sample
+    std::vector<std::shared_ptr<AudioSlice>> retiring_slices {};
+    // declared after the clips so a running analysis is waited out before their audio goes away
+    AutoSlicer auto_slicer;
+    SliceExporter slice_exporter;
+    PitchAnalyzer pitch_analyzer;
+    FeatureExtractor feature_extractor;
+    AutoGain auto_gain;
     std::string directory_;
 
     InCVTarget cv0_target = INCV_SELECT_CLIP, cv1_target = INCV_SELECT_SLICE, cv2_target = INCV_VOL,
@@ -177,6 +196,24 @@ struct Reflux: Module {
     std::array<double, PORT_MAX_CHANNELS> selected_clip_cv;
     std::array<double, PORT_MAX_CHANNELS> selected_slice_cv;
     PlaybackPanelTarget playback_target = PLAYBACK_TARGET_CLIP;
+    bool display_spectrogram = false;
+    float auto_slice_sensitivity = 0.5f;
+    bool snap_zero_crossings = true;
+    std::atomic<int> clear_request {-1};  // clip cleared by the load button, the audio thread owns its storage
+    std::atomic<int> grid_slice_beats {0};  // beats per slice of a pending "slice to grid", set by the menu
+    SliceExporter::Format export_format = SliceExporter::WAV;
+    bool export_playback_profile = false;
+    bool detect_key = false;
+    enum TuneRequest { TUNE_NONE = 0, TUNE_CLIP, TUNE_SLICE, TUNE_ALL_SLICES };
+    std::atomic<int> tune_request {TUNE_NONE};  // set by the menu
+    std::atomic<int> envelope_shape_request {-1};  // shape for the current slice, set by the menu
+    // slices by timbre, ranked on the pool again when slices move, features arrive or another slice is selected
+    SimilarityRanker similarity;
+    bool similarity_dirty = true;
+    std::atomic<bool> select_similar_request {false};  // set by the menu
+    int auto_gain_target = 0;  // 0 is off, else -23, -18 or -14 LUFS as in the menu
+    int auto_gain_requested = -1;  // target of the last measurement handed to the pool
+    rack::dsp::Timer analysis_timer;
 
     // ViewController
     std::map<PlaybackPanelTarget, float> playback_target_hues {
@@ -208,6 +245,8 @@ struct Reflux: Module {
         {PlaybackProfile::TunerKnobMode::Range, 0.456},
         {PlaybackProfile::TunerKnobMode::Frequency, 1.0},
         {PlaybackProfile::TunerKnobMode::Xhift, 0.2},
+        {PlaybackProfile::TunerKnobMode::Pitch, 0.63},
+        {PlaybackProfile::TunerKnobMode::Grain, 0.78},
     };
 
     std::map<InTrigMode, float> in_trig_mode_hues {
@@ -222,7 +261,8 @@ struct Reflux: Module {
         {INCV_PAN, 0.63},
         {INCV_VOL, 0.2},
         {INCV_SPEED, 0.78},
-        {INCV_XHIFT, 0.9}};
+        {INCV_XHIFT, 0.9},
+        {INCV_SELECT_SIMILAR, 0.08}};
 
     std::map<InTrigTarget, float> in_trig_target_hues {
         {INTRIG_PLAY_CLIP, 0.456},
@@ -230,12 +270,9 @@ struct Reflux: Module {
         {INTRIG_RECORD_CLIP, 0.2},
     };
 
-    DisplayBufferBuilder slice_dbb;
-    DisplayBufferBuilder clip_dbb;
-
     BooleanTrigger btntrig_slice_shiftl, btntrig_slice_shiftr, btntrig_slice_delete;
     BooleanTrigger btntrig_slice_play, btntrig_slice_pause, btntrig_slice_learn;
-    BooleanTrigger btntrig_clip_record, btntrig_clip_play, btntrig_clip_pause;
+    BooleanTrigger btntrig_clip_record, btntrig_clip_play, btntrig_clip_pause, btntrig_clip_auto_slice;
 
     StatefulButtonController<InCVTarget> sbc_global_cv0_target {PARAM_GLOBAL_CV0_TARGET, cv0_target, INCV_TARGET_MAX},
         sbc_global_cv1_target {PARAM_GLOBAL_CV1_TARGET, cv1_target, INCV_TARGET_MAX},
@@ -262,6 +299,7 @@ struct Reflux: Module {
         for (int i = 0; i < NUM_CLIPS; i++) {
             clips[i].id = i;
             clips[i].display_buffer_builder = &clip_dbb;
+            clips[i].prerenderer = &prerenderer;
         }
     }
 
@@ -291,7 +329,7 @@ struct Reflux: Module {
         }
 
         if (current_clip().can_clear) {
-            current_clip().clear();
+            clear_request = (int)selected_clip;
         } else {
             current_clip().can_clear = true;
         }
@@ -442,16 +480,372 @@ struct Reflux: Module {
         }
 
         double new_value = lerp_current_value(*value, delta, min_value, max_value, multiplier);
+        if (snap_zero_crossings)
+            new_value = snap_boundary(param_id, *value, new_value, min_value, max_value);
         *value = new_value;
     }
 
+    // clip and slice boundaries move on to the next zero crossing in the direction they are dragged
+    auto snap_boundary(ParamIds param_id, double old_value, double new_value, double min_value, double max_value)
+        -> double {
+        const AudioClip* clip = nullptr;
+        switch (param_id) {
+            case PARAM_CLIP_START:
+            case PARAM_CLIP_STOP:
+                clip = &current_clip();
+                break;
+            case PARAM_SLICE_START:
+            case PARAM_SLICE_STOP:
+                clip = &current_slice()->clip();
+                break;
+            default:
+                return new_value;
+        }
+        const int direction = new_value > old_value ? 1 : (new_value < old_value ? -1 : 0);
+        return clamp(clip->snap_to_zero_crossing(new_value, direction), min_value, max_value);
+    }
+
+    void process_clips(const ProcessArgs& args) {
+        const int cleared = clear_request.exchange(-1);
+        if (cleared >= 0 && cleared < (int)clips.size())
+            clips[cleared].clear();
+        for (auto& clip : clips) {
+            clip.update_timer(args.sampleTime);
+        }
+        process_auto_slice();
+        process_grid_slice();
+    }
+
+    // onset detection over the start / stop range of the current clip (all of it when the range is empty)
+    void start_auto_slice() {
+        AudioClip& clip = current_clip();
+        if (!clip.has_samples() || clip.is_recording || auto_slicer.is_busy())
+            return;
+
+        const auto storage = clip.storage();
+        OnsetDetector::Args args;
+        args.audio = storage;
+        args.num_channels = clip.num_channels;
+        args.frame_rate = clip.frame_rate_hz;
+        args.start = (IdxType)clip.start_head;
+        args.stop = std::min<IdxType>((IdxType)clip.stop_head, clip.stored_frames());
+        if (args.stop <= args.start) {
+            args.start = 0;
+            args.stop = clip.stored_frames();
+        }
+        args.sensitivity = auto_slice_sensitivity;
+        auto_slicer.analyze(&clip, clip.content_version, args);
+    }
+
+    // turns a finished analysis into slices between consecutive onsets, all added at once
+    void process_auto_slice() {
+        std::unique_ptr<AutoSlicer::Result> result = auto_slicer.take();
+        if (!result || result->onsets.empty())
+            return;
+
+        AudioClip* clip = nullptr;
+        for (auto& candidate : clips) {
+            if (&candidate == result->clip)
+                clip = &candidate;
+        }
+        // the clip was cleared, reloaded or recorded into while it was analyzed
+        if (!clip || clip->content_version != result->version)
+            return;
+
+        add_slices(*clip, result->start, result->stop, result->onsets);
+    }
+
+    // slices every grid_slice_beats beats over the start / stop range of the current clip, once its grid is known
+    void process_grid_slice() {
+        const int beats = grid_slice_beats;
+        if (beats == 0)
+            return;
+
+        AudioClip& clip = current_clip();
+        if (!clip.has_data() || clip.is_recording || (clip.beat_grid_known && !clip.beat_grid.valid())) {
+            grid_slice_beats = 0;
+            return;
+        }
+        if (!clip.beat_grid_known) {
+            clip.request_beat_grid();
+            return;
+        }
+
+        grid_slice_beats = 0;
+        IdxType start = (IdxType)clip.start_head;
+        IdxType stop = std::min<IdxType>((IdxType)clip.stop_head, clip.num_frames);
+        if (stop <= start) {
+            start = 0;
+            stop = clip.num_frames;
+        }
+        add_slices(clip, start, stop, clip.beat_grid.beat_frames(clip.frame_rate_hz, start, stop, beats));
+    }
+
+    // one slice between each pair of consecutive cuts in (start, stop), all added at once
+    void add_slices(AudioClip& clip, IdxType start, IdxType stop, const std::vector<IdxType>& cuts) {
+        // cuts snap back to a crossing so attacks stay whole, ones that snap onto a previous bound are dropped
+        std::vector<IdxType> bounds {start};
+        for (IdxType cut : cuts) {
+            if (snap_zero_crossings)
+                cut = (IdxType)clip.snap_to_zero_crossing_realtime(cut, -1);
+            if (cut > bounds.back() && cut < stop)
+                bounds.push_back(cut);
+        }
+        bounds.push_back(stop);
+
+        const IdxType first_new = slices.size();
+        slices.reserve(slices.size() + bounds.size() - 1);
+        clip.consumers.begin_bulk();
+        for (size_t i = 0; i + 1 < bounds.size(); i++) {
+            slices.push_back(
+                std::make_shared<AudioSlice>(clip, slice_table, bounds[i], bounds[i + 1], &slice_dbb, &prerenderer)
+            );
+        }
+        clip.consumers.end_bulk();
+        update_slices_idx();
+        selected_slice = first_new;
+    }
+
+    // ui thread, every slice to its own file in directory, written on the pool. the jobs are made here so the
+    // audio thread never formats paths or lets go of the storage they read
+    void request_export(const std::string& directory) {
+        if (slice_exporter.is_busy())
+            return;
+
+        std::vector<std::unique_ptr<SliceExporter::Job>> jobs;
+        jobs.reserve(slices.size());
+        for (const auto& slice : slices) {
+            const AudioClip& clip = slice->clip();
+            std::unique_ptr<SliceExporter::Job> job(new SliceExporter::Job());
+            const auto storage = clip.shared_storage();
+            job->get_sample = storage->getter();
+            job->source = storage;
+            job->envelope = slice->envelope;
+            job->num_channels = clip.num_channels;
+            job->frame_rate = clip.frame_rate_hz;
+            job->start = (IdxType)slice->start;
+            job->stop = std::min<IdxType>({(IdxType)slice->stop, clip.num_frames, storage->capacity()});
+            job->format = export_format;
+            const std::string filename =
+                fmt::format("slice_{:03d}.{}", slice->idx + 1, SliceExporter::extension(export_format));
+            job->path = system::join(directory, filename);
+            if (export_playback_profile)
+                job->copy_profile(slice->playback_profile);
+            jobs.push_back(std::move(job));
+        }
+        slice_exporter.start(std::move(jobs));
+    }
+
+    // A deleted slice still has to wait out its renders and display builds, so it is unhooked from its clip and
+    // the slice table here and destroyed on the pool
+    void retire_slice(std::shared_ptr<AudioSlice> slice) {
+        slice->detach();
+        if (!WorkerPool::shared().retire(slice, &retiring_slices))
+            retiring_slices.push_back(std::move(slice));
+    }
+
     void process_slices(const ProcessArgs& args) {
-        for (int i = 0; i < slices.size(); i++) {
-            slices[i]->update_timer(args.sampleTime);
+        while (!retiring_slices.empty() && WorkerPool::shared().retire(retiring_slices.back(), &retiring_slices)) {
+            retiring_slices.pop_back();
+        }
+        // the selected slice is polled for tuner edits, every other slice only while it has work left
+        if (AudioSlice* slice = current_slice())
+            slice_table.activate(slice->row());
+        slice_table.visit_active([&](SliceTable::Row row) {
+            return slice_table.owner[row]->update_timer(args.sampleTime);
+        });
+        process_analysis(args.sampleTime);
+    }
+
+    // takes finished pitch estimates and slice features, then every half second queues clips and slices whose
+    // analysis is missing or stale and refreshes the auto gain from the loudness tracks
+    void process_analysis(float delta) {
+        // results land in the slot of their clip or slice table row, freed rows still have theirs taken
+        if (pitch_analyzer.has_finished()) {
+            for (auto& clip : clips) {
+                clip.pitch_slot.take(clip.pitch);
+            }
+            PitchEstimate estimate;
+            for (SliceTable::Row row = 0; row < slice_table.pitch_slot.size(); row++) {
+                if (slice_table.pitch_slot[row].take(estimate) && slice_table.owner[row])
+                    slice_table.owner[row]->pitch = estimate;
+            }
+        }
+        if (feature_extractor.has_finished()) {
+            SliceFeatures features;
+            for (SliceTable::Row row = 0; row < slice_table.feature_slot.size(); row++) {
+                if (slice_table.feature_slot[row].take(features) && slice_table.owner[row])
+                    slice_table.owner[row]->features = features;
+            }
+            similarity_dirty = true;
+        }
+
+        process_tune_request();
+        const int shape = envelope_shape_request.exchange(-1);
+        if (shape >= 0 && current_slice())
+            current_slice()->set_envelope_shape((SliceEnvelope::Shape)shape);
+        update_similarity();
+        // waits for the ranking of the selected slice
+        if (select_similar_request && similarity.is_current()) {
+            select_similar_request = false;
+            if (AudioSlice* similar = similar_slice(similar_ranking(), 1))
+                selected_slice = similar->idx;
+        }
+
+        take_auto_gain();
+        if (analysis_timer.process(delta) < 0.5f)
+            return;
+        analysis_timer.reset();
+        update_auto_gain();
+
+        for (auto& clip : clips) {
+            request_pitch(clip, clip.pitch_slot, clip.pitch, 0, clip.num_frames);
+        }
+        for (auto& slice : slices) {
+            const AudioClip& clip = slice->clip();
+            const IdxType stop = std::min<IdxType>((IdxType)slice->stop, clip.num_frames);
+            request_pitch(clip, slice_table.pitch_slot[slice->row()], slice->pitch, (IdxType)slice->start, stop);
+            request_features(clip, *slice, (IdxType)slice->start, stop);
+        }
+    }
+
+    void request_features(const AudioClip& clip, AudioSlice& slice, IdxType start, IdxType stop) {
+        FeatureExtractor::Slot& slot = slice_table.feature_slot[slice.row()];
+        if (!clip.has_samples() || clip.is_recording || slot.is_pending()
+            || slice.features.matches(start, stop, clip.content_version))
+            return;
+
+        const auto storage = clip.storage();
+        FeatureExtractor::Request request;
+        request.audio = storage;
+        request.num_channels = clip.num_channels;
+        request.frame_rate = clip.frame_rate_hz;
+        request.start = start;
+        request.stop = stop;
+        request.version = clip.content_version;
+        feature_extractor.analyze(request, slot);
+    }
+
+    // hands copies of the slice features to the pool to be ranked by similarity to the selected slice
+    void update_similarity() {
+        AudioSlice* anchor = current_slice();
+        if (!anchor || (!similarity_dirty && anchor->row() == similarity.requested_anchor()))
+            return;
+        similarity.begin(anchor->row());
+        for (auto& slice : slices) {
+            similarity.add(slice->row(), slice->features);
+        }
+        similarity_dirty = !similarity.request();
+    }
+
+    // ranking of the slices against the selected one, nullptr while it has not arrived. every read may switch to
+    // a newer ranking, so callers read it once and keep using that one
+    auto similar_ranking() -> const SimilarityRanker::Ranked* {
+        const AudioSlice* anchor = current_slice();
+        const SimilarityRanker::Ranked& ranked = similarity.ranked();
+        return anchor && ranked.anchor == anchor->row() ? &ranked : nullptr;
+    }
+
+    // slice at rank from the most similar to the selected one, rank 0 is the selected slice. nullptr when out of
+    // range or deleted since the ranking
+    auto similar_slice(const SimilarityRanker::Ranked* ranked, size_t rank) -> AudioSlice* {
+        if (!ranked || rank >= ranked->rows.size())
+            return nullptr;
+        return slice_table.owner[ranked->rows[rank]];
+    }
+
+    // hands the clips and slices to the pool, which measures the gain that brings each to the target loudness.
+    // once turning auto gain off has reset the gains, new clips and slices start at unit gain and nothing is sent
+    void update_auto_gain() {
+        static const double targets[] = {0.0, -23.0, -18.0, -14.0};  // LUFS
+        const int target = clamp(auto_gain_target, 0, 3);
+        if (target == 0 && auto_gain_requested == 0)
+            return;
+        auto_gain.begin(targets[target]);
+        for (int i = 0; i < NUM_CLIPS; i++) {
+            const AudioClip& clip = clips[i];
+            auto_gain.add(AutoGain::range_of(clip, 0, clip.num_frames, i, true));
+        }
+        for (auto& slice : slices) {
+            const AudioClip& clip = slice->clip();
+            const IdxType stop = std::min<IdxType>((IdxType)slice->stop, clip.num_frames);
+            auto_gain.add(AutoGain::range_of(clip, (IdxType)slice->start, stop, slice->row(), false));
+        }
+        if (auto_gain.request())
+            auto_gain_requested = target;
+    }
+
+    // measured gains become the targets playback slews towards. a row taken by another slice meanwhile keeps its
+    // own until the next measurement
+    void take_auto_gain() {
+        const std::vector<AutoGain::Gain>* gains = auto_gain.take();
+        if (!gains)
+            return;
+        for (const AutoGain::Gain& gain : *gains) {
+            const AutoGain::Range& range = gain.range;
+            if (range.is_clip) {
+                clips[range.index].auto_gain_target = gain.gain;
+                continue;
+            }
+            AudioSlice* slice = range.index < slice_table.owner.size() ? slice_table.owner[range.index] : nullptr;
+            if (slice && &slice->clip() == range.clip && (IdxType)slice->start == range.start)
+                slice->set_gain_target(gain.gain);
+        }
+    }
+
+    void request_pitch(
+        const AudioClip& clip,
+        PitchAnalyzer::Slot& slot,
+        const PitchEstimate& pitch,
+        IdxType start,
+        IdxType stop
+    ) {
+        if (!clip.has_samples() || clip.is_recording || slot.is_pending()
+            || pitch.matches(start, stop, clip.content_version, detect_key))
+            return;
+
+        const auto storage = clip.storage();
+        PitchAnalyzer::Request request;
+        request.audio = storage;
+        request.num_channels = clip.num_channels;
+        request.frame_rate = clip.frame_rate_hz;
+        request.start = start;
+        request.stop = stop;
+        request.version = clip.content_version;
+        request.detect_key = detect_key;
+        pitch_analyzer.analyze(request, slot);
+    }
+
+    // seeds the tuner of the clip or slices from their estimates, unpitched ones are left alone
+    void process_tune_request() {
+        const int request = tune_request.exchange(TUNE_NONE);
+        auto tune = [](PlaybackProfile& profile, const PitchEstimate& pitch) {
+            if (!pitch.voiced())
+                return;
+            profile.freq = clamp(pitch.freq, 60.0, 10000.0);
+            profile.range = clamp(pitch.range, 0.1, 9.99);
+        };
+
+        switch (request) {
+            case TUNE_CLIP:
+                tune(current_clip().playback_profile, current_clip().pitch);
+                break;
+            case TUNE_SLICE:
+                if (AudioSlice* slice = current_slice())
+                    tune(slice->playback_profile, slice->pitch);
+                break;
+            case TUNE_ALL_SLICES:
+                for (auto& slice : slices) {
+                    tune(slice->playback_profile, slice->pitch);
+                }
+                break;
+            default:
+                break;
         }
     }
 
     void update_slices_idx() {
+        similarity_dirty = true;
         for (IdxType idx = 0; idx < slices.size(); idx++) {
             slices[idx]->idx = idx;
             slices[idx]->total = slices.size();
@@ -501,7 +895,15 @@ struct Reflux: Module {
                     selected_clip_cv[i] = select_idx_by_cv(cv0s[i], mode, NUM_CLIPS - 1);
                     break;
                 case InTrigTarget::INTRIG_PLAY_SLICE:
-                    if (slices.size() > 0) {
+                    if (cv0_target == INCV_SELECT_SIMILAR) {
+                        // the cv picks a similarity rank, 0 is the selected slice itself
+                        const SimilarityRanker::Ranked* ranked = similar_ranking();
+                        const size_t num_similar = ranked ? ranked->rows.size() : 0;
+                        AudioSlice* similar = num_similar
+                            ? similar_slice(ranked, select_idx_by_cv(cv0s[i], mode, num_similar - 1))
+                            : nullptr;
+                        selected_slice_cv[i] = similar ? (double)similar->idx : (double)selected_slice;
+                    } else if (slices.size() > 0) {
                         selected_slice_cv[i] = select_idx_by_cv(cv0s[i], mode, slices.size() - 1);
                     }
                     break;
@@ -559,12 +961,18 @@ struct Reflux: Module {
                 current_clip().toggle_playing();
             } else if (current_clip().has_data()) {
                 // make slice
-                std::shared_ptr<AudioSlice> slice = AudioSlice::create(current_clip(), &slice_dbb);
+                std::shared_ptr<AudioSlice> slice =
+                    AudioSlice::create(current_clip(), slice_table, &slice_dbb, &prerenderer);
                 slices.push_back(slice);
                 update_slices_idx();
                 selected_slice = slices.size() - 1;
             }
         }
+
+        // listen for clip auto slice button event
+        if (btntrig_clip_auto_slice.process(params[PARAM_CLIP_AUTO_SLICE].getValue() > 0.0)) {
+            start_auto_slice();
+        }
     }
 
     void process_slice_button_events(const ProcessArgs& args) {
@@ -581,14 +989,16 @@ struct Reflux: Module {
         if (btntrig_slice_pause.process(params[PARAM_SLICE_PAUSE].getValue() > 0.0)) {
             AudioSlice* slice_ptr = current_slice(); 
             if (!slice_ptr) return;
-            if (slice_ptr->is_playing) {
+            if (slice_ptr->is_playing()) {
                 slice_ptr->toggle_playing();
             }
         }
 
         // listen for slice delete button event
         if (btntrig_slice_delete.process(params[PARAM_SLICE_DELETE].getValue() > 0.0)) {
+            std::shared_ptr<AudioSlice> deleted = std::move(slices[selected_slice]);
             slices.erase(slices.begin() + selected_slice);
+            retire_slice(std::move(deleted));
             update_slices_idx();
             if (selected_slice >= 1.0) {
                 selected_slice -= 1.0;
@@ -639,8 +1049,8 @@ struct Reflux: Module {
         // listen for playback tuner switch event button
         if (btntrig_playback_tuner_switch.process(params[PARAM_PLAYBACK_TUNER_SWITCH].getValue() > 0.0)) {
             auto playback_profile = get_selected_playback_profile();
-            playback_profile->tuner.output_mode = (RealtimeMultiChannelTuner::OutputMode
-            )(((int)playback_profile->tuner.output_mode + 1) % (int)RealtimeMultiChannelTuner::OutputMode::NUM_MODES);
+            playback_profile->tuner_mode = (RealtimeMultiChannelTuner::OutputMode
+            )(((int)playback_profile->tuner_mode + 1) % (int)RealtimeMultiChannelTuner::OutputMode::NUM_MODES);
         }
 
         // listen for playback tuner mode event button
@@ -655,7 +1065,7 @@ struct Reflux: Module {
         if (light_timer.process(args.sampleTime) > rage::UI_update_time) {
             light_timer.reset();
             if (current_slice()) {
-                lights[LIGHT_SLICE_PLAY].setSmoothBrightness(current_slice()->is_playing ? .5f : 0.0f, UI_update_time);
+                lights[LIGHT_SLICE_PLAY].setSmoothBrightness(current_slice()->is_playing() ? .5f : 0.0f, UI_update_time);
             }
             lights[LIGHT_CLIP_RECORD].setSmoothBrightness(current_clip().is_recording ? .5f : 0.0f, UI_update_time);
             lights[LIGHT_CLIP_CLEAR].setSmoothBrightness(current_clip().can_clear ? .5f : 0.0f, UI_update_time);
@@ -671,7 +1081,7 @@ struct Reflux: Module {
             set_rgb_light(LIGHT_PLAYBACK_TARGET, nvgHSL(playback_target_hues.at(playback_target), 1.0, 0.2));
             set_rgb_light(LIGHT_PLAYBACK_MODE, nvgHSL(playback_mode_hues.at(profile->mode), 1.0, 0.2));
             set_rgb_light(LIGHT_PLAYBACK_VOL_PAN_MODE, nvgHSL(vp_mode_hues.at(profile->vp_knob_mode), 1.0, 0.2));
-            set_rgb_light(LIGHT_PLAYBACK_TUNER_SWITCH, tuner_output_colors.at(profile->tuner.output_mode));
+            set_rgb_light(LIGHT_PLAYBACK_TUNER_SWITCH, tuner_output_colors.at(profile->tuner_mode));
             set_rgb_light(LIGHT_PLAYBACK_TUNER_MODE, nvgHSL(tuner_control_hues.at(profile->tuner_knob_mode), 1.0, 0.2));
         }
     }
@@ -680,28 +1090,33 @@ struct Reflux: Module {
         int wavefroms_playing = 0;
         double audio_out_l = 0;
         double audio_out_r = 0;
+        // one pole towards the measured auto gain
+        const double slew = std::min(1.0, args.sampleTime * 1000.0 / AutoGain::SLEW_MS);
 
         for (int i = 0; i < NUM_CLIPS; i++) {
             auto& clip = clips.at(i);
+            clip.auto_gain += (clip.auto_gain_target - clip.auto_gain) * slew;
             if (clip.is_playing) {
                 wavefroms_playing += 1;
                 auto frame = clip.read_frame();
-                audio_out_l += frame[0];
-                audio_out_r += frame[1];
+                audio_out_l += frame[0] * clip.auto_gain;
+                audio_out_r += frame[1] * clip.auto_gain;
             }
         }
 
-        for (int i = 0; i < slices.size(); i++) {
-            const auto& slice = slices.at(i);
-            if (slice->is_playing) {
+        // only rows with work queued can be playing
+        for (SliceTable::Row row : slice_table.active_rows()) {
+            if (slice_table.playing[row]) {
                 wavefroms_playing += 1;
-                auto frame = slice->read_frame();
+                auto frame = slice_table.owner[row]->read_frame();
                 if (frame.empty()) {
                     continue;
                 }
-                audio_out_l += frame[0];
+                double& gain = slice_table.gain[row];
+                gain += (slice_table.gain_target[row] - gain) * slew;
+                audio_out_l += frame[0] * gain;
                 if (frame.size() > 1) {
-                    audio_out_r += frame[1];
+                    audio_out_r += frame[1] * gain;
                 }
             }
         }
@@ -740,6 +1155,7 @@ struct Reflux: Module {
         process_update_lights(args);
 
         // process_clips
+        process_clips(args);
         process_slices(args);
 
         // compute_output
@@ -763,6 +1179,13 @@ struct Reflux: Module {
         json_object_set_new(json_root, "slices", json_slices);
         json_object_set_new(json_root, "trig0_target", json_integer((int)trig0_target));
         json_object_set_new(json_root, "playback_target", json_integer((int)playback_target));
+        json_object_set_new(json_root, "display_spectrogram", json_boolean(display_spectrogram));
+        json_object_set_new(json_root, "auto_slice_sensitivity", json_real(auto_slice_sensitivity));
+        json_object_set_new(json_root, "snap_zero_crossings", json_boolean(snap_zero_crossings));
+        json_object_set_new(json_root, "export_format", json_integer((int)export_format));
+        json_object_set_new(json_root, "export_playback_profile", json_boolean(export_playback_profile));
+        json_object_set_new(json_root, "detect_key", json_boolean(detect_key));
+        json_object_set_new(json_root, "auto_gain_target", json_integer(auto_gain_target));
 
         return json_root;
     }
@@ -778,14 +1201,36 @@ struct Reflux: Module {
             clips.at(idx).load_json(json_obj);
         }
 
+        // slices register with their clips in bulk, each clip sorts its consumers once at the end
+        for (auto& clip : clips) {
+            clip.consumers.begin_bulk();
+        }
+        slices.reserve(slices.size() + json_array_size(json_slices));
         json_array_foreach(json_slices, idx, json_obj) {
             const double clip_idx = json_real_value(json_object_get(json_obj, "clip_idx"));
-            auto slice = AudioSlice::create(clips.at(clip_idx), &slice_dbb);
+            auto slice = AudioSlice::create(clips.at(clip_idx), slice_table, &slice_dbb, &prerenderer);
             slice->load_json(json_obj);
             slices.push_back(slice);
         }
+        for (auto& clip : clips) {
+            clip.consumers.end_bulk();
+        }
+        similarity_dirty = true;
         trig0_target = (Reflux::InTrigTarget)json_integer_value(json_object_get(root, "trig0_target"));
         playback_target = (PlaybackPanelTarget)json_integer_value(json_object_get(root, "playback_target"));
+        display_spectrogram = json_boolean_value(json_object_get(root, "display_spectrogram"));
+        if (json_t* sensitivity = json_object_get(root, "auto_slice_sensitivity"))
+            auto_slice_sensitivity = json_real_value(sensitivity);
+        if (json_t* snap = json_object_get(root, "snap_zero_crossings"))
+            snap_zero_crossings = json_boolean_value(snap);
+        export_format = (SliceExporter::Format)clamp(
+            (int)json_integer_value(json_object_get(root, "export_format")),
+            0,
+            SliceExporter::NUM_FORMATS - 1
+        );
+        export_playback_profile = json_boolean_value(json_object_get(root, "export_playback_profile"));
+        detect_key = json_boolean_value(json_object_get(root, "detect_key"));
+        auto_gain_target = json_integer_value(json_object_get(root, "auto_gain_target"));
     }
 
     void onAdd(const AddEvent& event) override {
@@ -819,6 +1264,11 @@ struct Reflux: Module {
         }
     }
 
+    ~Reflux() {
+        // retired slices still point at the builders and the slice table
+        WorkerPool::shared().cancel_owner(&retiring_slices);
+    }
+
     void onReset() override {
         slices = {};
         clips = {};
@@ -828,6 +1278,17 @@ struct Reflux: Module {
         // TODO
     }
 
+    // display builds, requested by the widget that shows the waveform
+    void request_display_build(AudioClip* clip) {
+        clip->request_display_build();
+    }
+
+    // slice builds are grouped by their clip in the builder, so every slice of a clip shown before the batch
+    // runs is drawn in the same pass. the slice list belongs to the audio thread and is not walked from here
+    void request_display_build(AudioSlice* slice) {
+        slice->request_display_build();
+    }
+
     Optional<EventfulValueRange> get_playback_pv_knob_value() {
         auto profile = get_selected_playback_profile();
         if (profile)
@@ -876,47 +1337,171 @@ const ColorSchemeMap default_colors = {
     {"text", nvgRGBA(255, 255, 255, 90)},
 };
 
+enum { WAVEFORM_DISPLAY_OVERSAMPLE = 2 };
+enum { WAVEFORM_DISPLAY_MIN_FRAMES = 16 };
+
 template<class WaveformType>
 struct WaveformDisplayWidget: TransparentWidget {
+    // everything but the markers, only re-rendered when one of these changes
+    struct StaticKey {
+        const void* waveform = nullptr;
+        bool has_data = false;
+        uint64_t epoch = 0;
+        DisplayView view;
+        std::vector<Region> regions;
+        std::string title;
+        std::string info;
+        Vec size;
+
+        bool operator!=(const StaticKey& other) const {
+            return waveform != other.waveform || has_data != other.has_data || epoch != other.epoch ||
+                view != other.view || !(regions == other.regions) || title != other.title || info != other.info ||
+                size.x != other.size.x || size.y != other.size.y;
+        }
+    };
+
+    struct StaticLayer: Widget {
+        WaveformDisplayWidget* display = nullptr;
+
+        void draw(const DrawArgs& args) override {
+            display->draw_static(args);
+        }
+    };
+
     Reflux* module {nullptr};
-    const WaveformType* waveform;
+    const WaveformType* waveform {nullptr};
     const ColorSchemeMap& colorscheme;
+    Rect waveform_rect;
+    Rect title_rect;
+    Rect info_rect;
+    FramebufferWidget* static_cache;
+    StaticKey static_key;
+    StrokeBatch marker_strokes;
+    // spectrogram texture, owned by the context of the cached framebuffer
+    NVGcontext* spectrogram_vg = nullptr;
+    int spectrogram_handle = -1;
+    int spectrogram_width = 0;
+    int spectrogram_height = 0;
 
     WaveformDisplayWidget(const ColorSchemeMap& colorscheme = default_colors) :
         TransparentWidget(),
-        colorscheme(colorscheme) {}
+        colorscheme(colorscheme) {
+        // drawn by hand on the light layer, hidden so the default layer 0 pass skips it
+        static_cache = new FramebufferWidget();
+        static_cache->visible = false;
+        auto* static_layer = new StaticLayer();
+        static_layer->display = this;
+        static_cache->addChild(static_layer);
+        addChild(static_cache);
+    }
+
+    ~WaveformDisplayWidget() {
+        if (spectrogram_vg && spectrogram_handle >= 0)
+            nvgDeleteImage(spectrogram_vg, spectrogram_handle);
+    }
+
+    // wheel zooms around the mouse, shift + wheel or a horizontal wheel scrolls
+    void onHoverScroll(const event::HoverScroll& e) override {
+        WaveformType* target = module ? module->get_current_waveform<WaveformType>() : nullptr;
+        if (!target || !target->has_data() || waveform_rect.size.x <= 0)
+            return;
+
+        DisplayView view = target->get_display_view();
+        const double span = view.end - view.begin;
+        const double frames = std::max<double>(target->get_display_frames(), 1.0);
+        const double min_span = std::min(1.0, WAVEFORM_DISPLAY_MIN_FRAMES / frames);
+        const double mouse = clamp((e.pos.x - waveform_rect.pos.x) / waveform_rect.size.x, 0.f, 1.f);
+        const bool shift = (APP->window->getMods() & RACK_MOD_MASK) == GLFW_MOD_SHIFT;
+
+        double new_span = span;
+        double begin = view.begin;
+        if (shift || e.scrollDelta.x != 0.f) {
+            const double delta = shift ? e.scrollDelta.y : e.scrollDelta.x;
+            begin -= delta / waveform_rect.size.x * span;
+        } else {
+            const double anchor = view.begin + mouse * span;
+            new_span = clamp(span * std::exp(-e.scrollDelta.y * 0.005), min_span, 1.0);
+            begin = anchor - mouse * new_span;
+        }
+
+        view.begin = clamp(begin, 0.0, 1.0 - new_span);
+        view.end = view.begin + new_span;
+        target->set_display_view(view);
+        e.consume(this);
+    }
+
+    // keeps one display point per (oversampled) pixel, then builds if the shown data went stale
+    void sync_display(WaveformType* target) {
+        DisplayView view = target->get_display_view();
+        view.points = (IdxType)std::ceil(waveform_rect.size.x * WAVEFORM_DISPLAY_OVERSAMPLE);
+        view.spectrogram = module->display_spectrogram;
+        target->set_display_view(view);
+        module->request_display_build(target);
+    }
+
+    // uploads the image built on the worker only when the cached layer is redrawn, i.e. when it changed
+    void draw_spectrogram(const DrawArgs& args, Rect rect) {
+        const SpectrogramImage& image = waveform->get_spectrogram_image();
+        if (image.width <= 0 || image.rgba.empty())
+            return;
+
+        if (spectrogram_vg != args.vg || spectrogram_width != image.width || spectrogram_height != image.height) {
+            if (spectrogram_vg == args.vg && spectrogram_handle >= 0)
+                nvgDeleteImage(args.vg, spectrogram_handle);
+            spectrogram_handle = nvgCreateImageRGBA(args.vg, image.width, image.height, 0, image.rgba.data());
+            spectrogram_vg = args.vg;
+            spectrogram_width = image.width;
+            spectrogram_height = image.height;
+        } else {
+            nvgUpdateImage(args.vg, spectrogram_handle, image.rgba.data());
+        }
+
+        const NVGpaint paint =
+            nvgImagePattern(args.vg, rect.pos.x, rect.pos.y, rect.size.x, rect.size.y, 0.f, spectrogram_handle, 1.f);
+        nvgBeginPath(args.vg);
+        nvgRect(args.vg, rect.pos.x, rect.pos.y, rect.size.x, rect.size.y);
+        nvgFillPaint(args.vg, paint);
+        nvgFill(args.vg);
+    }
 
     void draw_waveform(const DrawArgs& args, NVGcolor color, Rect rect) {
         const auto& display_buf = waveform->get_display_buf();
-        const auto samples = display_buf[0].size();
+        const auto samples = display_buf.size();
         if (samples <= 0) {
             return;
         }
 
-        const auto rect_center = rect.getCenter();
         auto fill_color = color;
         fill_color.a -= 0.2;
 
         nvgSave(args.vg);
         nvgScissor(args.vg, rect.pos.x, rect.pos.y, rect.size.x, rect.size.y);
         nvgBeginPath(args.vg);
-        nvgMoveTo(args.vg, rect.pos.x, rect_center.y);
-
-        for (unsigned int i = 0; i < samples; i++) {
-            const float spx = rect.pos.x + rect.size.x * ((float)i / ((float)samples - 1));
-            const float spy = rect_center.y + (rect.size.y / 2) * ((float)display_buf[0][i]);
-            nvgLineTo(args.vg, spx, spy);
-        }
-        if (display_buf[1].size() >= samples) {
-            for (unsigned int i = samples - 1; i > 0; i--) {
-                const float spx = rect.pos.x + rect.size.x * ((float)i / ((float)samples - 1));
-                const float spy = rect_center.y - (rect.size.y / 2) * ((float)display_buf[1][i]);
-                nvgLineTo(args.vg, spx, spy);
+
+        // one lane per channel, each outlined by its max on top and its min below
+        const float lane_height = rect.size.y / display_buf.channels;
+        const float point_width = rect.size.x / samples;
+        for (IdxType cidx = 0; cidx < display_buf.channels; cidx++) {
+            const auto& mins = display_buf.min[cidx];
+            const auto& maxs = display_buf.max[cidx];
+            const float lane_center = rect.pos.y + lane_height * (cidx + 0.5f);
+            const float lane_half = lane_height / 2;
+
+            for (size_t i = 0; i < samples; i++) {
+                const float spx = rect.pos.x + point_width * (i + 0.5f);
+                const float spy = lane_center - lane_half * maxs[i];
+                if (i == 0)
+                    nvgMoveTo(args.vg, spx, spy);
+                else
+                    nvgLineTo(args.vg, spx, spy);
+            }
+            for (size_t i = samples; i > 0; i--) {
+                const float spx = rect.pos.x + point_width * (i - 0.5f);
+                nvgLineTo(args.vg, spx, lane_center - lane_half * mins[i - 1]);
             }
+            nvgClosePath(args.vg);
         }
 
-        nvgLineTo(args.vg, rect.pos.x, rect_center.y);
-
         nvgFillColor(args.vg, fill_color);
         nvgStrokeColor(args.vg, color);
         nvgLineCap(args.vg, NVG_ROUND);
@@ -929,23 +1514,53 @@ struct WaveformDisplayWidget: TransparentWidget {
         nvgRestore(args.vg);
     }
 
-    void drawLayer(const DrawArgs& args, int layer) override {
+    void layout() {
         const float title_height = 10;
+        const Rect local_box = Rect(Vec(0), box.size);
+        auto result = split_rect_h(local_box, title_height / local_box.getHeight());
+        auto header_rect = result.A;
+        waveform_rect = result.B;
+        result = split_rect_v(header_rect, 0.6);
+        title_rect = result.A;
+        info_rect = result.B;
+    }
+
+    void step() override {
+        layout();
+        static_cache->box.size = box.size;
+        for (Widget* child : static_cache->children) {
+            child->box.size = box.size;
+        }
+
+        StaticKey key;
+        key.size = box.size;
+        waveform = module ? module->get_current_waveform<WaveformType>() : nullptr;
+        if (waveform) {
+            key.waveform = waveform;
+            key.has_data = waveform->has_data();
+            key.title = waveform->get_text_title();
+            key.info = waveform->get_text_info();
+            if (key.has_data) {
+                sync_display(module->get_current_waveform<WaveformType>());
+                key.epoch = waveform->get_display_epoch();
+                key.view = waveform->get_display_view();
+                key.regions = waveform->get_regions();
+            }
+        }
+
+        if (key != static_key) {
+            static_key = key;
+            static_cache->setDirty();
+        }
+        TransparentWidget::step();
+    }
+
+    // background, text, waveform and regions, rendered into the cached framebuffer
+    void draw_static(const DrawArgs& args) {
         const auto color_borders = default_colors.at("borders");
         const auto color_bg = default_colors.at("background");
         const auto color_txt = default_colors.at("text");
         const Rect local_box = Rect(Vec(0), box.size);
-        Rect waveform_rect;
-        Rect title_rect;
-        Rect info_rect;
-        {
-            auto result = split_rect_h(local_box, title_height / local_box.getHeight());
-            auto header_rect = result.A;
-            waveform_rect = result.B;
-            result = split_rect_v(header_rect, 0.6);
-            title_rect = result.A;
-            info_rect = result.B;
-        }
 
         draw_rect(args, color_bg, local_box, true);
         draw_rect(args, color_borders, title_rect);
@@ -953,54 +1568,97 @@ struct WaveformDisplayWidget: TransparentWidget {
 
         // Zero Line
         draw_h_line(args, color_borders, waveform_rect, 0.5);
-        if ((bool)module) {
-            waveform = module->get_current_waveform<WaveformType>();
-            if (waveform) {
-                if (layer == 1) {
-                    // Text
-                    draw_text(args, color_borders, title_rect, waveform->get_text_title());
-                    draw_text(args, color_borders, info_rect, waveform->get_text_info());
-
-                    if (waveform->has_data()) {
-                        // Waveform
-                        draw_waveform(args, color_txt, waveform_rect);
-
-                        // Regions
-                        for (Region& region : waveform->get_regions()) {
-                            auto color = colorscheme.at(region.tag);
-                            color.a = 0.3;
-                            auto rect = split_rect_v(waveform_rect, region.end).A;
-                            rect = split_rect_v(rect, region.begin / region.end).B;
-                            draw_rect(args, color, rect, true);
-                        }
-
-                        // Markers
-                        for (Marker& marker : waveform->get_markers()) {
-                            auto color = colorscheme.at(marker.tag);
-                            draw_v_line(args, color, waveform_rect, marker.pos);
-                        }
-                    }
+        if (waveform) {
+            // Text
+            draw_text(args, color_borders, title_rect, static_key.title);
+            draw_text(args, color_borders, info_rect, static_key.info);
+
+            if (static_key.has_data) {
+                const DisplayView& view = static_key.view;
+
+                // Waveform
+                if (view.spectrogram)
+                    draw_spectrogram(args, waveform_rect);
+                else
+                    draw_waveform(args, color_txt, waveform_rect);
+
+                // Regions
+                for (const Region& region : static_key.regions) {
+                    const float begin = clamp((float)view.to_view(region.begin), 0.f, 1.f);
+                    const float end = clamp((float)view.to_view(region.end), 0.f, 1.f);
+                    if (end <= begin)
+                        continue;
+                    auto color = colorscheme.at(region.tag);
+                    color.a = 0.3;
+                    auto rect = split_rect_v(waveform_rect, end).A;
+                    rect = split_rect_v(rect, begin / end).B;
+                    draw_rect(args, color, rect, true);
                 }
             }
         }
         draw_rect(args, color_borders, waveform_rect);
+    }
+
+    void drawLayer(const DrawArgs& args, int layer) override {
+        if (layer == 1) {
+            static_cache->draw(args);
+
+            // Markers move every frame, so they are drawn on top of the cached layer
+            if (waveform && static_key.has_data) {
+                const DisplayView& view = static_key.view;
+                for (Marker& marker : waveform->get_markers()) {
+                    const float pos = view.to_view(marker.pos);
+                    if (pos < 0.f || pos > 1.f)
+                        continue;
+                    marker_strokes.v_line(colorscheme.at(marker.tag), waveform_rect, pos);
+                }
+                marker_strokes.flush(args);
+            }
+        }
         Widget::drawLayer(args, layer);
     }
 };
 
+// identifies what a text box shows (the value and its source), the text is only re-formatted when it changes
+using TextKey = std::pair<const void*, double>;
+
 struct TextBoxProps {
     std::function<std::string()> get_txt;
+    std::function<TextKey()> get_key;
     Optional<std::string> font_path;
     float font_size {9};
     int align {NVG_ALIGN_RIGHT};
     int length {4};
 };
-MAKE_BUILDER(MK_TextBoxProps, TextBoxProps, get_txt, font_path, font_size, align, length);
+MAKE_BUILDER(MK_TextBoxProps, TextBoxProps, get_txt, get_key, font_path, font_size, align, length);
 
 struct TextBoxWidget: TransparentWidget {
     TextBoxProps props;
+    FontCache font_cache;
+    std::string font_path;
+    std::string base_txt;
+    std::string text;
+    Optional<TextKey> text_key;
 
-    TextBoxWidget(TextBoxProps props) : TransparentWidget(), props(props) {}
+    TextBoxWidget(TextBoxProps props) :
+        TransparentWidget(),
+        props(props),
+        base_txt(props.length, '~') {
+        if (props.font_path.some())
+            font_path = asset::plugin(pluginInstance, props.font_path.value());
+    }
+
+    void update_text() {
+        if (!props.get_key) {
+            text = props.get_txt();
+            return;
+        }
+        const TextKey key = props.get_key();
+        if (text_key.some() && text_key.value() == key)
+            return;
+        text_key = Some(key);
+        text = props.get_txt();
+    }
 
     void drawLayer(const DrawArgs& args, int layer) override {
         const auto color_base_txt = default_colors.at("base_text");
@@ -1009,18 +1667,16 @@ struct TextBoxWidget: TransparentWidget {
         const auto color_bg = default_colors.at("background");
         const Rect text_rect = Rect(Vec(0), box.size);
         if (layer == 1) {
-            std::string text = props.get_txt();
+            update_text();
             draw_rect(args, color_bg, text_rect, true);
             draw_rect(args, color_borders, text_rect);
-            if (props.font_path.some()) {
-                std::string font_path_str = props.font_path.value();
-                std::shared_ptr<Font> font = APP->window->loadFont(asset::plugin(pluginInstance, font_path_str));
+            if (!font_path.empty()) {
+                std::shared_ptr<Font> font = font_cache.get(args, font_path);
                 nvgTextAlign(args.vg, props.align);
                 nvgFontFaceId(args.vg, font->handle);
             }
-            const std::string base_txt = std::string(props.length, '~');
-            draw_text(args, color_base_txt, Rect(Vec(0), box.size), base_txt, props.font_size);
-            draw_text(args, color_txt, Rect(Vec(0), box.size), text, props.font_size);
+            draw_text(args, color_base_txt, text_rect, base_txt, props.font_size);
+            draw_text(args, color_txt, text_rect, text, props.font_size);
         }
     }
 };
@@ -1088,8 +1744,10 @@ struct RefluxWidget: ModuleWidget {
         addChild(display);
     }
 
-    void add_info_display(Vec pos, std::function<std::string()> get_text) {
-        auto* display = new TextBoxWidget(MK_TextBoxProps().get_txt(get_text).font_path(std::string(RAGE_FONT_14SEG)));
+    void add_info_display(Vec pos, std::function<std::string()> get_text, std::function<TextKey()> get_key = nullptr) {
+        auto* display = new TextBoxWidget(
+            MK_TextBoxProps().get_txt(get_text).get_key(get_key).font_path(std::string(RAGE_FONT_14SEG))
+        );
         display->box.pos = pos;
         display->box.size = Vec(36, 15);
         addChild(display);
@@ -1135,38 +1793,67 @@ struct RefluxWidget: ModuleWidget {
         addChild(
             createParamCentered<RoundSmallGrayOmniKnob<Reflux>>(Vec(290, 225), module, Reflux::PARAM_PLAYBACK_PAN_VOL)
         );
-        add_info_display(Vec(310, 218), [module]() -> std::string {
-            if (module) {
-                Optional<EventfulValueRange> result = module->get_playback_pv_knob_value();
-                if (result.some())
-                    return result.value().str_value;
+        add_info_display(
+            Vec(310, 218),
+            [module]() -> std::string {
+                if (module) {
+                    Optional<EventfulValueRange> result = module->get_playback_pv_knob_value();
+                    if (result.some())
+                        return result.value().str_value();
+                }
+                return "";
+            },
+            [module]() -> TextKey {
+                if (module) {
+                    Optional<EventfulValueRange> result = module->get_playback_pv_knob_value();
+                    if (result.some())
+                        return {result.value().value, *result.value().value};
+                }
+                return {nullptr, 0};
             }
-            return "";
-        });
+        );
 
         // -- Speed
         addChild(
             createParamCentered<RoundSmallGrayOmniKnob<Reflux>>(Vec(290, 265), module, Reflux::PARAM_PLAYBACK_SPEED)
         );
-        add_info_display(Vec(310, 258), [module]() -> std::string {
-            if (!module)
-                return "";
-            return format_amount(*module->get_playback_speed());
-        });
+        add_info_display(
+            Vec(310, 258),
+            [module]() -> std::string {
+                if (!module)
+                    return "";
+                return format_amount(*module->get_playback_speed());
+            },
+            [module]() -> TextKey {
+                Eventful<double>* speed = module ? module->get_playback_speed() : nullptr;
+                return {speed, speed ? speed->value : 0};
+            }
+        );
 
         // -- Tune
         addChild(
             createParamCentered<RoundSmallGrayOmniKnob<Reflux>>(Vec(290, 305), module, Reflux::PARAM_PLAYBACK_TUNE_KNOB)
         );
 
-        add_info_display(Vec(310, 298), [module]() -> std::string {
-            if (module) {
-                Optional<EventfulValueRange> result = module->get_playback_tune_knob_value();
-                if (result.some())
-                    return result.value().str_value;
+        add_info_display(
+            Vec(310, 298),
+            [module]() -> std::string {
+                if (module) {
+                    Optional<EventfulValueRange> result = module->get_playback_tune_knob_value();
+                    if (result.some())
+                        return result.value().str_value();
+                }
+                return "";
+            },
+            [module]() -> TextKey {
+                if (module) {
+                    Optional<EventfulValueRange> result = module->get_playback_tune_knob_value();
+                    if (result.some())
+                        return {result.value().value, *result.value().value};
+                }
+                return {nullptr, 0};
             }
-            return "";
-        });
+        );
 
         // Audio Slice
         add_waveform_group<AudioSlice>(Vec(25, 110), {Reflux::PARAM_SELECTED_SLICE, 5});
@@ -1199,6 +1886,160 @@ struct RefluxWidget: ModuleWidget {
                             .default_type(WidgetType::WTInputPort)
                             .spacing(Vec(30, 38)));
     }
+
+    void appendContextMenu(Menu* menu) override {
+        auto* module = getModule<Reflux>();
+        if (!module)
+            return;
+
+        menu->addChild(new MenuSeparator);
+        menu->addChild(createMenuLabel("Display"));
+        menu->addChild(createBoolMenuItem(
+            "Spectrogram view",
+            "",
+            [=]() { return module->display_spectrogram; },
+            [=](bool enabled) { module->display_spectrogram = enabled; }
+        ));
+
+        menu->addChild(new MenuSeparator);
+        menu->addChild(createMenuLabel("Clip"));
+        menu->addChild(createBoolMenuItem(
+            "Snap to zero crossings",
+            "",
+            [=]() { return module->snap_zero_crossings; },
+            [=](bool enabled) { module->snap_zero_crossings = enabled; }
+        ));
+        menu->addChild(createIndexSubmenuItem(
+            "Auto slice sensitivity",
+            {"Lowest", "Low", "Medium", "High", "Highest"},
+            [=]() { return (size_t)clamp((int)std::round(module->auto_slice_sensitivity * 5.f - 0.5f), 0, 4); },
+            [=](size_t idx) { module->auto_slice_sensitivity = 0.1f + 0.2f * idx; }
+        ));
+        menu->addChild(createSubmenuItem("Slice to beat grid", "", [=](Menu* menu) {
+            const AudioClip& clip = module->current_clip();
+            if (clip.beat_grid.valid())
+                menu->addChild(createMenuLabel(fmt::format("{:.1f} BPM", clip.beat_grid.bpm())));
+            else if (clip.beat_tracker.is_busy())
+                menu->addChild(createMenuLabel("Detecting tempo..."));
+            const std::vector<std::pair<std::string, int>> choices {
+                {"Every beat", 1},
+                {"Every 2 beats", 2},
+                {"Every bar", 4},
+                {"Every 2 bars", 8},
+            };
+            for (const auto& choice : choices) {
+                const int beats = choice.second;
+                menu->addChild(createMenuItem(choice.first, "", [=]() { module->grid_slice_beats = beats; }));
+            }
+        }));
+        menu->addChild(createMenuLabel("Pitch: " + module->current_clip().pitch.describe()));
+        const AudioClip& clip = module->current_clip();
+        menu->addChild(createMenuLabel("Level: " + clip.level(0, clip.num_frames).describe()));
+        menu->addChild(createIndexSubmenuItem(
+            "Auto gain",
+            {"Off", "-23 LUFS", "-18 LUFS", "-14 LUFS"},
+            [=]() { return (size_t)module->auto_gain_target; },
+            [=](size_t idx) { module->auto_gain_target = (int)idx; }
+        ));
+        menu->addChild(createMenuItem("Tune clip from pitch", "", [=]() { module->tune_request = Reflux::TUNE_CLIP; }));
+        menu->addChild(createBoolMenuItem(
+            "Detect key",
+            "",
+            [=]() { return module->detect_key; },
+            [=](bool enabled) { module->detect_key = enabled; }
+        ));
+
+        if (module->current_slice()) {
+            menu->addChild(new MenuSeparator);
+            menu->addChild(createMenuLabel("Slice"));
+            menu->addChild(createIndexSubmenuItem(
+                "Envelope shape",
+                {"Linear", "Exponential", "Equal power"},
+                [=]() { return module->current_slice() ? (size_t)module->current_slice()->envelope.shape : 0; },
+                [=](size_t shape) { module->envelope_shape_request = (int)shape; }
+            ));
+            menu->addChild(createMenuLabel("Pitch: " + module->current_slice()->pitch.describe()));
+            menu->addChild(createMenuLabel(fmt::format(
+                "Level: {}, gain {:+.1f}dB",
+                module->current_slice()->level().describe(),
+                LoudnessStats::to_db(module->current_slice()->get_gain())
+            )));
+            menu->addChild(createMenuItem("Tune slice from pitch", "", [=]() {
+                module->tune_request = Reflux::TUNE_SLICE;
+            }));
+            const size_t analyzing = module->pitch_analyzer.num_pending();
+            menu->addChild(createMenuItem(
+                "Tune all slices from pitch",
+                analyzing > 0 ? fmt::format("{} analyzing", analyzing) : "",
+                [=]() { module->tune_request = Reflux::TUNE_ALL_SLICES; }
+            ));
+            menu->addChild(createMenuItem(
+                "Select most similar slice",
+                module->current_slice()->features.analyzed ? "" : "analyzing...",
+                [=]() { module->select_similar_request = true; }
+            ));
+
+            const SliceExporter& exporter = module->slice_exporter;
+            const bool exporting = exporter.is_busy();
+            menu->addChild(createMenuItem(
+                "Render all slices...",
+                exporting ? fmt::format("{}/{}", exporter.done(), exporter.total()) : "",
+                [=]() {
+                    char* path = osdialog_file(OSDIALOG_OPEN_DIR, module->get_last_directory().c_str(), NULL, NULL);
+                    if (path) {
+                        module->request_export(path);
+                        free(path);
+                    }
+                },
+                exporting
+            ));
+            menu->addChild(createIndexSubmenuItem(
+                "Render format",
+                {"WAV", "FLAC"},
+                [=]() { return (size_t)module->export_format; },
+                [=](size_t format) { module->export_format = (SliceExporter::Format)format; }
+            ));
+            menu->addChild(createBoolMenuItem(
+                "Render with playback profile",
+                "",
+                [=]() { return module->export_playback_profile; },
+                [=](bool enabled) { module->export_playback_profile = enabled; }
+            ));
+            if (!exporting && exporter.failed() > 0) {
+                const std::string failed = fmt::format("{} of {} slices failed", exporter.failed(), exporter.total());
+                menu->addChild(createMenuLabel(failed));
+            }
+        }
+
+        menu->addChild(new MenuSeparator);
+        menu->addChild(createMenuLabel("Playback target"));
+        menu->addChild(createBoolMenuItem(
+            "Pre-render tuner",
+            "",
+            [=]() { return module->get_selected_playback_profile()->prerender; },
+            [=](bool enabled) { module->get_selected_playback_profile()->prerender = enabled; }
+        ));
+        menu->addChild(createIndexSubmenuItem(
+            "Spectral stage",
+            {"Off", "Freeze", "Smear"},
+            [=]() { return (size_t)module->get_selected_playback_profile()->spectral.mode; },
+            [=](size_t mode) {
+                module->get_selected_playback_profile()->spectral.mode = (SpectralProcessor::Mode)mode;
+            }
+        ));
+        menu->addChild(createIndexSubmenuItem(
+            "Spectral smear",
+            {"50%", "75%", "90%", "97%"},
+            [=]() {
+                const float smear = module->get_selected_playback_profile()->spectral.smear;
+                return (size_t)(smear < 0.7f ? 0 : smear < 0.85f ? 1 : smear < 0.95f ? 2 : 3);
+            },
+            [=](size_t idx) {
+                const float amounts[] = {0.5f, 0.75f, 0.9f, 0.97f};
+                module->get_selected_playback_profile()->spectral.smear = amounts[idx];
+            }
+        ));
+    }
 };
 
 Model* modelReflux = createModel<Reflux, RefluxWidget>("Reflux");
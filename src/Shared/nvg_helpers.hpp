@@ -15,20 +15,16 @@ void draw_line(const DrawArgs& args, NVGcolor color, rack::math::Vec start, rack
     nvgStroke(args.vg);
 }
 
+// fill and outline share one path
 void draw_rect(const DrawArgs& args, NVGcolor color, rack::math::Rect rect, bool fill = false) {
-    auto pos = rect.pos;
-    auto size = rect.size;
+    nvgBeginPath(args.vg);
+    nvgRect(args.vg, rect.pos.x, rect.pos.y, rect.size.x, rect.size.y);
     if (fill) {
-        nvgBeginPath(args.vg);
         nvgFillColor(args.vg, color);
-        nvgRect(args.vg, rect.pos.x, rect.pos.y, rect.size.x, rect.size.y);
         nvgFill(args.vg);
-        nvgClosePath(args.vg);
     }
-    draw_line(args, color, pos, pos + size * Vec(1, 0));
-    draw_line(args, color, pos, pos + size * Vec(0, 1));
-    draw_line(args, color, pos + size * Vec(1, 0), pos + size * Vec(1, 1));
-    draw_line(args, color, pos + size * Vec(0, 1), pos + size * Vec(1, 1));
+    nvgStrokeColor(args.vg, color);
+    nvgStroke(args.vg);
 }
 
 void draw_h_line(const DrawArgs& args, NVGcolor color, Rect rect, float pos_ratio) {
@@ -49,6 +45,79 @@ void draw_text(const DrawArgs& args, NVGcolor color, Rect rect, std::string text
     nvgTextBox(args.vg, rect.pos.x + 2, rect.pos.y + rect.size.y - 2, rect.size.x - 4, text.c_str(), NULL);
 }
 
+// Collects line segments and strokes all segments of one color with a single path on flush
+struct StrokeBatch {
+    struct Group {
+        NVGcolor color;
+        std::vector<Vec> points;  // pairs of segment ends
+    };
+
+  private:
+    std::vector<Group> groups;
+
+    auto group(NVGcolor color) -> Group& {
+        for (auto& group : groups) {
+            const NVGcolor& other = group.color;
+            if (other.r == color.r && other.g == color.g && other.b == color.b && other.a == color.a)
+                return group;
+        }
+        groups.push_back({color, {}});
+        return groups.back();
+    }
+
+  public:
+    void line(NVGcolor color, Vec start, Vec stop) {
+        auto& points = group(color).points;
+        points.push_back(start);
+        points.push_back(stop);
+    }
+
+    void h_line(NVGcolor color, Rect rect, float pos_ratio) {
+        const float y_line = floor(pos_ratio * rect.size.y);
+        line(color, rect.pos + Vec(0, y_line), rect.pos + Vec(rect.size.x, y_line));
+    }
+
+    void v_line(NVGcolor color, Rect rect, float pos_ratio) {
+        const float x_line = floor(pos_ratio * rect.size.x);
+        line(color, rect.pos + Vec(x_line, 0), rect.pos + Vec(x_line, rect.size.y));
+    }
+
+    // groups keep their storage so steady state drawing does not allocate
+    void flush(const DrawArgs& args, float width = 0.8) {
+        nvgStrokeWidth(args.vg, width);
+        for (auto& group : groups) {
+            if (group.points.empty())
+                continue;
+            nvgBeginPath(args.vg);
+            for (size_t i = 0; i + 1 < group.points.size(); i += 2) {
+                nvgMoveTo(args.vg, group.points[i].x, group.points[i].y);
+                nvgLineTo(args.vg, group.points[i + 1].x, group.points[i + 1].y);
+            }
+            nvgStrokeColor(args.vg, group.color);
+            nvgStroke(args.vg);
+            group.points.clear();
+        }
+    }
+};
+
+// Fonts are bound to a nanovg context, so the handle is reloaded only when drawing into a different one
+struct FontCache {
+  private:
+    NVGcontext* vg = nullptr;
+    std::string path;
+    std::shared_ptr<Font> font;
+
+  public:
+    auto get(const DrawArgs& args, const std::string& path) -> std::shared_ptr<Font> {
+        if (!font || args.vg != vg || path != this->path) {
+            font = APP->window->loadFont(path);
+            vg = args.vg;
+            this->path = path;
+        }
+        return font;
+    }
+};
+
 struct SplitResult {
     Rect A;
     Rect B;
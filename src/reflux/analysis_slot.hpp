@@ -0,0 +1,75 @@
+#pragma once
+#include <stdint.h>
+
+#include <atomic>
+
+/*
+One background analysis and its result, kept with whatever is analyzed (a clip, a slice table row) so queueing
+and delivering it needs neither a lookup nor an allocation on the audio thread.
+The audio thread begins an analysis, the task finishes it on a worker and the audio thread takes the result.
+A slot stays pending until its result was taken, even after the slot was abandoned for another owner, so at
+most one task ever writes into it and a result taken after abandon() is dropped.
+*/
+
+template<class T>
+struct AnalysisSlot {
+  private:
+    std::atomic<bool> pending {false};  // begun and not yet taken
+    std::atomic<bool> ready {false};
+    std::atomic<uint64_t> generation {0};
+    uint64_t result_generation = 0;
+    T result;
+
+  public:
+    AnalysisSlot() = default;
+
+    // copies belong to a new owner, a task still writing into this slot is left to finish
+    AnalysisSlot(const AnalysisSlot&) {}
+
+    AnalysisSlot& operator=(const AnalysisSlot&) {
+        abandon();
+        return *this;
+    }
+
+    auto is_pending() const -> bool {
+        return pending;
+    }
+
+    // audio thread, false while an analysis is pending. ticket is passed on to finish
+    auto begin(uint64_t& ticket) -> bool {
+        if (pending)
+            return false;
+        pending = true;
+        ticket = generation;
+        return true;
+    }
+
+    // audio thread, for an analysis that could not be queued after begin
+    void cancel_begin() {
+        pending = false;
+    }
+
+    // the owner goes away, whatever is pending for it is dropped when it arrives
+    void abandon() {
+        generation += 1;
+    }
+
+    // worker
+    void finish(uint64_t ticket, const T& value) {
+        result = value;
+        result_generation = ticket;
+        ready.store(true, std::memory_order_release);
+    }
+
+    // audio thread, copies a finished result of the current owner into dst
+    auto take(T& dst) -> bool {
+        if (!ready.load(std::memory_order_acquire))
+            return false;
+        ready = false;
+        const bool current = result_generation == generation;
+        if (current)
+            dst = result;
+        pending = false;
+        return current;
+    }
+};
@@ -8,6 +8,7 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <condition_variable>
 #include <limits>
 #include <list>
@@ -21,12 +22,18 @@
 #include <vector>
 
 #include "plugin.hpp"
-#include "src/external/biquad.hpp"
 #include "src/shared/components.hpp"
 #include "src/shared/make_builder.hpp"
 #include "src/shared/math.hpp"
 #include "src/shared/nvg_helpers.hpp"
+#include "src/shared/svf.hpp"
+#include "src/shared/triple_buffer.hpp"
+#include "src/shared/worker_pool.hpp"
 #include "src/shared/utils.hpp"
+#include "peak_pyramid.hpp"
+#include "prerender_cache.hpp"
+#include "stft.hpp"
+#include "time_stretch.hpp"
 
 // NOLINTNEXTLINE (google-build-using-namespace)
 using namespace rage;
@@ -35,21 +42,80 @@ enum { AUDIO_CLIP_DISPLAY_RES = 64 };
 enum { AUDIO_CLIP_DISPLAY_CHANNELS = 2 };
 using IdxType = uintptr_t;
 
-using DisplayBufferType = std::array<std::vector<double>, 2>;
+// per point min / max of each displayed channel
+struct DisplayBuffer {
+    IdxType channels = 0;
+    std::array<std::vector<float>, AUDIO_CLIP_DISPLAY_CHANNELS> min;
+    std::array<std::vector<float>, AUDIO_CLIP_DISPLAY_CHANNELS> max;
+
+    auto size() const -> size_t {
+        return channels ? min[0].size() : 0;
+    }
+};
+
+// built on the display worker, read by the ui thread
+using DisplayBufferSlot = TripleBuffer<DisplayBuffer>;
+
+// Bumped whenever the data behind a display changes, the widget showing it compares generations to
+// decide when to ask for a build. Copies start out stale so they get rebuilt.
+struct DisplayGeneration {
+  private:
+    std::atomic<uint64_t> m_value {1};
+
+  public:
+    DisplayGeneration() = default;
+
+    DisplayGeneration(const DisplayGeneration&) {}
+
+    DisplayGeneration& operator=(const DisplayGeneration&) {
+        bump();
+        return *this;
+    }
+
+    void bump() {
+        m_value.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    auto get() const -> uint64_t {
+        return m_value.load(std::memory_order_relaxed);
+    }
+};
+
+// visible part of a waveform as fractions of its length, points is the display width in pixels
+struct DisplayView {
+    double begin = 0.0;
+    double end = 1.0;
+    IdxType points = AUDIO_CLIP_DISPLAY_RES;
+    bool spectrogram = false;
+
+    auto to_view(double pos) const -> double {
+        return (pos - begin) / (end - begin);
+    }
+
+    bool operator!=(const DisplayView& other) const {
+        return begin != other.begin || end != other.end || points != other.points || spectrogram != other.spectrogram;
+    }
+};
 
 struct DisplayBufferBuilder {
     struct BuildArgs {
         std::function<double(IdxType, IdxType)> get_sample = nullptr;
-        DisplayBufferType* dst = nullptr;
+        DisplayBufferSlot* dst = nullptr;
         IdxType start = 0;
         IdxType stop = 0;
         bool normalize = false;
+        IdxType num_channels = 1;
+        IdxType points = AUDIO_CLIP_DISPLAY_RES;
+        // when set, points are summarized from the pyramid and get_sample only covers ranges below its resolution
+        const PeakPyramid* pyramid = nullptr;
+        std::function<double(IdxType)> gain = nullptr;
+        std::shared_ptr<const void> source;  // owns what get_sample and the pyramid read
 
         BuildArgs() = default;
 
         BuildArgs(
             std::function<double(IdxType, IdxType)> get_sample,
-            DisplayBufferType* dst,
+            DisplayBufferSlot* dst,
             IdxType start,
             IdxType stop,
             bool normalize = false
@@ -61,87 +127,179 @@ struct DisplayBufferBuilder {
             normalize(normalize) {}
     };
 
-  private:
-    std::thread workerThread;
-    std::mutex workerMutex;
-    std::condition_variable workerCv;
-    bool running;
-    std::queue<DisplayBufferType*> tasks;
-    std::unordered_map<DisplayBufferType*, BuildArgs> task_args;
+    ~DisplayBufferBuilder() {
+        WorkerPool::shared().cancel_owner(this);
+    }
 
-  public:
-    DisplayBufferBuilder() {
-        workerThread = std::thread([this] { run(); });
+    // builds run on the shared pool, a newer build for the same buffer replaces a queued one
+    void build(BuildArgs args) {
+        WorkerPool::shared().submit(args.dst, [args] { build_(args); }, WorkerPool::HIGH, this);
     }
 
-    ~DisplayBufferBuilder() {
-        running = false;
-        workerCv.notify_one();
-        workerThread.join();
+    // Queues builds that all read the same source (e.g. every slice of one clip, with group = the clip).
+    // Pending builds of a group are drained together by a single task that sweeps the source once in frame
+    // order; different groups still run in parallel on the pool.
+    void build_batch(const void* group, const std::vector<BuildArgs>& batch, WorkerPool::Priority priority) {
+        {
+            std::lock_guard<std::mutex> lock(groups_mutex);
+            auto& pending = groups[group].pending;
+            for (const auto& args : batch) {
+                auto same_dst = [&](const BuildArgs& other) { return other.dst == args.dst; };
+                auto it = std::find_if(pending.begin(), pending.end(), same_dst);
+                if (it != pending.end())
+                    *it = args;
+                else
+                    pending.push_back(args);
+            }
+        }
+        WorkerPool::shared().submit(group, [this, group] { run_batch(group); }, priority, this);
     }
 
-    void build(BuildArgs args) {
-        std::lock_guard<std::mutex> lock(workerMutex);
-        tasks.push(args.dst);
-        task_args[args.dst] = args;
-        workerCv.notify_one();
+    // waits out any build of dst, call before dst goes away
+    void cancel(DisplayBufferSlot* dst) {
+        {
+            // a running batch publishes under this lock, so once dst is dropped here it is never touched again
+            std::lock_guard<std::mutex> lock(groups_mutex);
+            for (auto& entry : groups) {
+                auto& pending = entry.second.pending;
+                auto same_dst = [&](const BuildArgs& other) { return other.dst == dst; };
+                pending.erase(std::remove_if(pending.begin(), pending.end(), same_dst), pending.end());
+                auto& in_flight = entry.second.in_flight;
+                in_flight.erase(std::remove(in_flight.begin(), in_flight.end(), dst), in_flight.end());
+            }
+        }
+        WorkerPool::shared().cancel(dst);
     }
 
   private:
-    void run() {
-        running = true;
-        std::unique_lock<std::mutex> lock(workerMutex);
-        while (running) {
-            if (tasks.empty()) {
-                workerCv.wait(lock);
-                continue;
+    struct Group {
+        std::vector<BuildArgs> pending;
+        std::vector<DisplayBufferSlot*> in_flight;
+    };
+
+    std::mutex groups_mutex;
+    std::unordered_map<const void*, Group> groups;
+
+    static auto channel_count(const BuildArgs& args) -> IdxType {
+        return std::min<IdxType>(std::max<IdxType>(args.num_channels, 1), AUDIO_CLIP_DISPLAY_CHANNELS);
+    }
+
+    static auto point_count(const BuildArgs& args) -> IdxType {
+        return std::max<IdxType>(args.points, 2);
+    }
+
+    // frames covered by point i, fractional steps so zooming in past one frame per point still lands on every frame
+    static auto point_range(const BuildArgs& args, IdxType i) -> std::pair<IdxType, IdxType> {
+        const double step = (double)(args.stop - args.start) / point_count(args);
+        const IdxType begin = args.start + (IdxType)(i * step);
+        const IdxType end = std::max(begin + 1, args.start + (IdxType)((i + 1) * step));
+        return {begin, end};
+    }
+
+    static void prepare(const BuildArgs& args, DisplayBuffer& buffer) {
+        buffer.channels = channel_count(args);
+        for (IdxType cidx = 0; cidx < buffer.channels; cidx++) {
+            buffer.min[cidx].resize(point_count(args));
+            buffer.max[cidx].resize(point_count(args));
+        }
+    }
+
+    static void fill_point(const BuildArgs& args, DisplayBuffer& buffer, IdxType i) {
+        const auto range = point_range(args, i);
+        const double gain = args.gain ? args.gain(range.first + (range.second - range.first) / 2) : 1.0;
+
+        for (IdxType cidx = 0; cidx < buffer.channels; cidx++) {
+            PeakBlock block;
+            if (args.pyramid) {
+                block = args.pyramid->summarize(cidx, range.first, range.second, args.get_sample);
+            } else {
+                for (IdxType fidx = range.first; fidx < range.second; fidx++) {
+                    block.add((float)args.get_sample(cidx, fidx));
+                }
             }
-            DisplayBufferType* dst = tasks.front();
-            tasks.pop();
-            if (task_args.count(dst)) {
-                BuildArgs args = task_args[dst];
-                task_args.erase(dst);
-                lock.unlock();
-                build_(args);
-                lock.lock();
+            buffer.min[cidx][i] = block.count ? (float)(block.min * gain) : 0.f;
+            buffer.max[cidx][i] = block.count ? (float)(block.max * gain) : 0.f;
+        }
+    }
+
+    static void normalize(const BuildArgs& args, DisplayBuffer& buffer) {
+        if (!args.normalize)
+            return;
+
+        float peak = 0.f;
+        for (IdxType cidx = 0; cidx < buffer.channels; cidx++) {
+            for (size_t i = 0; i < buffer.size(); i++) {
+                peak = std::max(peak, std::max(std::abs(buffer.min[cidx][i]), std::abs(buffer.max[cidx][i])));
+            }
+        }
+        if (peak <= 0.f)
+            return;
+
+        const float inverse_peak = 1.f / peak;
+        for (IdxType cidx = 0; cidx < buffer.channels; cidx++) {
+            for (size_t i = 0; i < buffer.size(); i++) {
+                buffer.min[cidx][i] *= inverse_peak;
+                buffer.max[cidx][i] *= inverse_peak;
             }
         }
     }
 
-    void build_(BuildArgs args) {
-        DisplayBufferType& buffer = *args.dst;
-        IdxType chunk_size = (args.stop - args.start) / AUDIO_CLIP_DISPLAY_RES;
-
-        double inverse_chunk_size = 1.f / static_cast<double>(chunk_size);
-        IdxType curr, i, j;
-        double max, accum;
-        int cidx = 0;
-        int cidx1 = 1;
-
-        // for each channel
-        // for (int cidx = 0; cidx < 1; cidx++) {
-            // we need to downsample the audio to fit the display
-            if(buffer[cidx].size() != AUDIO_CLIP_DISPLAY_RES) buffer[cidx].resize(AUDIO_CLIP_DISPLAY_RES, 0.0);
-            if(buffer[cidx1].size() != AUDIO_CLIP_DISPLAY_RES) buffer[cidx1].resize(AUDIO_CLIP_DISPLAY_RES, 0.0);
-            curr = args.start;
-            max = 0;
-            for (i = 0; i < AUDIO_CLIP_DISPLAY_RES; i++) {
-                accum = 0.0;
-                for (j = 0; j < chunk_size; j++) {
-                    accum += std::abs(args.get_sample(cidx, curr++));
-                }
-                buffer[cidx][i] = accum * inverse_chunk_size;
-                buffer[cidx1][i] = accum * inverse_chunk_size;
-                max = std::max(buffer[cidx][i], max);
+    static void build_(const BuildArgs& args) {
+        DisplayBuffer& buffer = args.dst->back();
+        prepare(args, buffer);
+        for (IdxType i = 0; i < point_count(args); i++) {
+            fill_point(args, buffer, i);
+        }
+        normalize(args, buffer);
+        args.dst->publish();
+    }
+
+    void run_batch(const void* group) {
+        std::vector<BuildArgs> batch;
+        {
+            std::lock_guard<std::mutex> lock(groups_mutex);
+            auto it = groups.find(group);
+            if (it == groups.end())
+                return;
+            batch.swap(it->second.pending);
+            for (const auto& args : batch) {
+                it->second.in_flight.push_back(args.dst);
             }
-            auto inverse_max = 1.0 / max;
-            if (args.normalize) {
-                for (i = 0; i < AUDIO_CLIP_DISPLAY_RES; i++) {
-                    buffer[cidx][i] *= inverse_max;
-                    buffer[cidx1][i] *= inverse_max;
-                }
+        }
+
+        // every point of every build, visited in frame order so overlapping ranges hit the same data back to back
+        struct PointJob {
+            IdxType begin;
+            uint32_t item;
+            uint32_t point;
+        };
+        std::vector<PointJob> jobs;
+        std::vector<DisplayBuffer> results(batch.size());
+        for (uint32_t item = 0; item < batch.size(); item++) {
+            prepare(batch[item], results[item]);
+            for (uint32_t point = 0; point < point_count(batch[item]); point++) {
+                jobs.push_back({point_range(batch[item], point).first, item, point});
             }
-        //}
+        }
+        std::sort(jobs.begin(), jobs.end(), [](const PointJob& a, const PointJob& b) { return a.begin < b.begin; });
+        for (const auto& job : jobs) {
+            fill_point(batch[job.item], results[job.item], job.point);
+        }
+
+        std::lock_guard<std::mutex> lock(groups_mutex);
+        auto& group_state = groups[group];
+        auto& in_flight = group_state.in_flight;
+        for (uint32_t item = 0; item < batch.size(); item++) {
+            DisplayBufferSlot* dst = batch[item].dst;
+            if (std::find(in_flight.begin(), in_flight.end(), dst) == in_flight.end())
+                continue;
+            normalize(batch[item], results[item]);
+            std::swap(dst->back(), results[item]);
+            dst->publish();
+        }
+        in_flight.clear();
+        if (group_state.pending.empty())
+            groups.erase(group);
     }
 };
 
@@ -157,11 +315,14 @@ struct Marker {
 class AudioConsumer {
   public:
     using NotificationListener = std::function<void(void)>;
+    using Id = uint32_t;
+    Id id;
     std::string name;
     Marker marker;
     NotificationListener on_notify;
 
-    AudioConsumer(std::string name, float pos, std::string tag, NotificationListener on_notify) :
+    AudioConsumer(Id id, std::string name, double pos, std::string tag, NotificationListener on_notify) :
+        id(id),
         name(name),
         marker({pos, tag}),
         on_notify(on_notify) {}
@@ -181,38 +342,12 @@ struct Region {
     std::string tag;
 
     Region(float begin, float end, const std::string& tag = "region") : begin(begin), end(end), tag(tag) {}
-};
-
-struct IIR4Filter {
-    Biquad filter1;
-    Biquad filter2;
 
-    IIR4Filter(BQType FT, double sample_rate, double freq, double Q) :
-        filter1(FT, freq / sample_rate, Q, 0.0),
-        filter2(FT, freq / sample_rate, Q, 0.0) {}
-
-    double config(double sample_rate, double freq, double Q) {
-        filter1.setFc(freq / sample_rate);
-        filter1.setQ(Q);
-        filter1.reset();
-        filter2.setFc(freq / sample_rate);
-        filter2.setQ(Q);
-        filter2.reset();
-    }
-
-    double process(double in) {
-        return filter2.process(filter1.process(in));
+    bool operator==(const Region& other) const {
+        return begin == other.begin && end == other.end && tag == other.tag;
     }
 };
 
-auto filter_many(std::vector<IIR4Filter>& filters, std::vector<double> frame) -> std::vector<double> {
-    auto ret = std::vector<double>(frame.size());
-    for (IdxType i = 0; i < frame.size(); i++) {
-        ret[i] = filters[i].process(frame[i]);
-    }
-    return ret;
-}
-
 struct MultiChannelBuffer {
     // implements a circular buffer
   private:
@@ -351,12 +486,43 @@ int mod(int a, int b) {
     return (a % b + b) % b;
 }
 
+// filters of one tuner channel: the bandpass at the tuner frequency, and 4th order (two cascaded sections)
+// butterworth lowpass and highpass crossovers 0.75 range below and above it
+struct TunerBandFilters {
+    SVFilter band;
+    std::array<SVFilter, 2> low;
+    std::array<SVFilter, 2> high;
+
+    void reset() {
+        band.reset();
+        for (auto& filter : low) {
+            filter.reset();
+        }
+        for (auto& filter : high) {
+            filter.reset();
+        }
+    }
+
+    void set_crossovers(double low_fc, double high_fc) {
+        for (auto& filter : low) {
+            filter.set_fc(low_fc);
+        }
+        for (auto& filter : high) {
+            filter.set_fc(high_fc);
+        }
+    }
+
+    auto process(double in) -> SVFOutput {
+        const double bandpass = band.process(in).bandpass;
+        const double lowpass = low[1].process(low[0].process(in).lowpass).lowpass;
+        const double highpass = high[1].process(high[0].process(in).highpass).highpass;
+        return {lowpass, bandpass, highpass};
+    }
+};
+
 struct RealtimeMultiChannelTuner {
     MultiChannelBuffer filtered_buffer;
-    MultiChannelBuffer reduction_buffer;
-    std::vector<IIR4Filter> bandpass_filters;
-    std::vector<IIR4Filter> lowpass_filters;
-    std::vector<IIR4Filter> highpass_filters;
+    std::vector<TunerBandFilters> band_filters;
 
     enum OutputMode { OFF=0, MIX, WET, LP, BP, HP, NUM_MODES };
 
@@ -367,14 +533,11 @@ struct RealtimeMultiChannelTuner {
     double period_ratio = 1.0;
     double freq = 1000.0;
     double range = 1.0; // bandwith of the filter in octaves
+    double crossover_ratio = 1.0;  // lowpass and highpass cutoffs are freq divided and multiplied by this
 
     double period_length = 0.0;
     int zero_crossings_detected = 2;
 
-    IdxType optimal_out_buffer_size() {
-        return (IdxType)(sample_rate);  // 10000Hz is highest supported frequency
-    }
-
     IdxType optimal_in_buffer_size() {
         return (IdxType)(3 * sample_rate / 100);  // 100Hz is lowest supported frequency
     }
@@ -385,16 +548,32 @@ struct RealtimeMultiChannelTuner {
 
     void set_channels(double num_channels) {
         filtered_buffer.set_channels(num_channels);
-        reduction_buffer.set_channels(num_channels);
         config_filters(freq, range);
     }
 
+    // set_sample_rate and set_channels with these values would change nothing, so they need no allocation
+    auto is_configured_for(double sample_rate, IdxType num_channels) const -> bool {
+        return this->sample_rate == sample_rate && filtered_buffer.channels() == num_channels
+            && band_filters.size() == (size_t)num_channels;
+    }
+
     void set_sample_rate(double sample_rate) {
         this->sample_rate = sample_rate;
         auto in_buf_size = optimal_in_buffer_size();
         this->period_length = in_buf_size;
         filtered_buffer.set_size(in_buf_size);
-        reduction_buffer.set_size(optimal_out_buffer_size());
+        config_filters(freq, range);
+    }
+
+    // clears all signal history so a pooled tuner can be handed to a new voice
+    void reset() {
+        filtered_buffer.reset();
+        for (auto& filter : band_filters) {
+            filter.reset();
+        }
+        outptr = 0.0;
+        period_length = filtered_buffer.size();
+        zero_crossings_detected = 2;
     }
 
     void set_period_ratio(double period_ratio) {
@@ -404,26 +583,33 @@ struct RealtimeMultiChannelTuner {
     void config_filters(double freq, double range) {
         this->freq = freq;
         this->range = range;
-        
-        double low_freq = pow(2.0, log2(freq)  - range * 0.75);
-        double high_freq = pow(2.0, log2(freq) + range * 0.75);
 
         double w = 2.0 * M_PI * freq / sample_rate;
         double Q =  0.5 / sinh(0.5 * log(2) * range * w/sin(w));
+        const double butterworth_Q = M_SQRT1_2;
+        crossover_ratio = pow(2.0, range * 0.75);
 
-        if (lowpass_filters.size() != filtered_buffer.channels())
-            lowpass_filters.resize(filtered_buffer.channels(), IIR4Filter(BQType::lowpass, sample_rate, low_freq, 1));
-        
-        if (bandpass_filters.size() != filtered_buffer.channels())
-            bandpass_filters.resize(filtered_buffer.channels(), IIR4Filter(BQType::bandpass, sample_rate, freq, Q));
-        
-        if (highpass_filters.size() != filtered_buffer.channels())
-            highpass_filters.resize(filtered_buffer.channels(), IIR4Filter(BQType::highpass, sample_rate, high_freq, 1));
+        if (band_filters.size() != filtered_buffer.channels())
+            band_filters.resize(filtered_buffer.channels());
 
-        for (IdxType i = 0; i < filtered_buffer.channels(); i++) {
-            lowpass_filters[i].config(sample_rate, low_freq, 1);
-            bandpass_filters[i].config(sample_rate, freq, Q);
-            highpass_filters[i].config(sample_rate, high_freq, 1);
+        // filter state is kept so the bands can be re-tuned while playing without clicks
+        for (auto& filters : band_filters) {
+            filters.band.set(freq / sample_rate, Q);
+            for (auto& filter : filters.low) {
+                filter.set(freq / crossover_ratio / sample_rate, butterworth_Q);
+            }
+            for (auto& filter : filters.high) {
+                filter.set(freq * crossover_ratio / sample_rate, butterworth_Q);
+            }
+        }
+    }
+
+    // cheap cutoff update that keeps the bandwidth, safe to call every sample (e.g. from cv)
+    void set_freq(double freq) {
+        this->freq = freq;
+        for (auto& filters : band_filters) {
+            filters.band.set_fc(freq / sample_rate);
+            filters.set_crossovers(freq / crossover_ratio / sample_rate, freq * crossover_ratio / sample_rate);
         }
     }
 
@@ -433,11 +619,19 @@ struct RealtimeMultiChannelTuner {
         std::vector<double> lowpass;
     };
 
-    auto filter_bands(std::vector<double> frame) -> FilterResult {
-        auto bandpass = filter_many(bandpass_filters, frame);
-        auto highpass = filter_many(highpass_filters, frame);
-        auto lowpass = filter_many(lowpass_filters, frame);
-        return {highpass, bandpass, lowpass};
+    auto filter_bands(const std::vector<double>& frame) -> FilterResult {
+        FilterResult result {
+            std::vector<double>(frame.size()),
+            std::vector<double>(frame.size()),
+            std::vector<double>(frame.size()),
+        };
+        for (IdxType i = 0; i < frame.size(); i++) {
+            const SVFOutput bands = band_filters[i].process(frame[i]);
+            result.highpass[i] = bands.highpass;
+            result.bandpass[i] = bands.bandpass;
+            result.lowpass[i] = bands.lowpass;
+        }
+        return result;
     }
 
     auto process(std::vector<double> frame) -> std::vector<double> {
@@ -544,13 +738,167 @@ struct RealtimeMultiChannelTuner {
     }
 };
 
+// Process wide free list of tuners. Voices only hold a tuner while they are playing with the tuner on,
+// so patches with many idle clips and slices only pay for the voices that are actually sounding.
+// Free tuners sit in a fixed array of slots, taking or returning one is a single atomic exchange. The audio
+// thread only takes tuners that are already set up for its rate and channel count, and when there is none it
+// has a few prepared on the worker pool and plays untuned meanwhile, so it never allocates or waits.
+struct TunerPool {
+    enum { NUM_SLOTS = 256 };
+    enum { NUM_PREPARED = 4 };  // tuners made per refill
+
+  private:
+    std::array<std::atomic<RealtimeMultiChannelTuner*>, NUM_SLOTS> slots {};
+    std::mutex owned_mutex;
+    std::vector<std::unique_ptr<RealtimeMultiChannelTuner>> owned;  // every tuner ever made, off the audio thread
+    std::atomic<bool> refill_pending {false};
+
+    auto make_tuner() -> RealtimeMultiChannelTuner* {
+        std::lock_guard<std::mutex> lock(owned_mutex);
+        owned.emplace_back(new RealtimeMultiChannelTuner());
+        return owned.back().get();
+    }
+
+    auto take(double sample_rate, IdxType num_channels, bool any) -> RealtimeMultiChannelTuner* {
+        for (auto& slot : slots) {
+            RealtimeMultiChannelTuner* tuner = slot.exchange(nullptr, std::memory_order_acquire);
+            if (!tuner)
+                continue;
+            if (any || tuner->is_configured_for(sample_rate, num_channels))
+                return tuner;
+            RealtimeMultiChannelTuner* expected = nullptr;
+            if (!slot.compare_exchange_strong(expected, tuner, std::memory_order_release))
+                release(tuner);
+        }
+        return nullptr;
+    }
+
+    void refill(double sample_rate, IdxType num_channels) {
+        for (int idx = 0; idx < NUM_PREPARED; idx++) {
+            RealtimeMultiChannelTuner* tuner = make_tuner();
+            tuner->set_sample_rate(sample_rate);
+            tuner->set_channels(num_channels);
+            tuner->reset();
+            release(tuner);
+        }
+        refill_pending = false;
+    }
+
+  public:
+    static auto shared() -> TunerPool& {
+        static TunerPool pool;
+        return pool;
+    }
+
+    // the worker pool is made first so it is torn down last, after a queued refill is dropped
+    TunerPool() {
+        WorkerPool::shared();
+    }
+
+    ~TunerPool() {
+        WorkerPool::shared().cancel(this);
+    }
+
+    // worker threads, any free tuner or a new one. the caller sets it up
+    auto acquire() -> RealtimeMultiChannelTuner* {
+        RealtimeMultiChannelTuner* tuner = take(0, 0, true);
+        if (!tuner)
+            tuner = make_tuner();
+        tuner->reset();
+        return tuner;
+    }
+
+    // audio thread, a tuner ready for sample_rate and num_channels or nullptr while one is being prepared
+    auto acquire_realtime(double sample_rate, IdxType num_channels) -> RealtimeMultiChannelTuner* {
+        RealtimeMultiChannelTuner* tuner = take(sample_rate, num_channels, false);
+        if (tuner) {
+            tuner->reset();
+            return tuner;
+        }
+        if (!refill_pending.exchange(true)) {
+            auto task = [this, sample_rate, num_channels] { refill(sample_rate, num_channels); };
+            if (!WorkerPool::shared().post(this, task, WorkerPool::HIGH))
+                refill_pending = false;
+        }
+        return nullptr;
+    }
+
+    // any thread. with every slot taken the tuner simply stays unused in owned
+    void release(RealtimeMultiChannelTuner* tuner) {
+        for (auto& slot : slots) {
+            RealtimeMultiChannelTuner* expected = nullptr;
+            if (slot.compare_exchange_strong(expected, tuner, std::memory_order_release))
+                return;
+        }
+    }
+};
+
+// Owning handle to a pooled tuner, copies start out empty
+struct TunerLease {
+  private:
+    RealtimeMultiChannelTuner* m_tuner = nullptr;
+
+  public:
+    TunerLease() = default;
+
+    TunerLease(const TunerLease&) {}
+
+    TunerLease& operator=(const TunerLease&) {
+        release();
+        return *this;
+    }
+
+    ~TunerLease() {
+        release();
+    }
+
+    auto acquire() -> RealtimeMultiChannelTuner* {
+        if (!m_tuner)
+            m_tuner = TunerPool::shared().acquire();
+        return m_tuner;
+    }
+
+    // audio thread, nullptr until the pool has a tuner set up for this rate and channel count
+    auto acquire_realtime(double sample_rate, IdxType num_channels) -> RealtimeMultiChannelTuner* {
+        if (!m_tuner)
+            m_tuner = TunerPool::shared().acquire_realtime(sample_rate, num_channels);
+        return m_tuner;
+    }
+
+    void release() {
+        if (m_tuner) {
+            TunerPool::shared().release(m_tuner);
+            m_tuner = nullptr;
+        }
+    }
+
+    auto get() const -> RealtimeMultiChannelTuner* {
+        return m_tuner;
+    }
+
+    explicit operator bool() const {
+        return m_tuner != nullptr;
+    }
+
+    auto operator->() const -> RealtimeMultiChannelTuner* {
+        return m_tuner;
+    }
+};
+
 using SampleGetter = std::function<double(double, double)>;
 
 struct EventfulValueRange {
+    using Formatter = std::string (*)(double);
+
     Eventful<double>* value;
     double min_value;
     double max_value;
-    std::string str_value;
+    Formatter format;
+
+    // formatting is left to the caller so displays can skip it while the value is unchanged
+    auto str_value() const -> std::string {
+        return format(value->value);
+    }
 };
 
 std::string format_frequency(double amount) {
@@ -563,7 +911,7 @@ std::string format_frequency(double amount) {
 
 struct PlaybackProfile {
     enum class PlaybackMode { OneShot = 0, Loop, PingPong, NUM_MODES };
-    enum class TunerKnobMode { Range = 0, Frequency, Xhift, NUM_MODES };
+    enum class TunerKnobMode { Range = 0, Frequency, Xhift, Pitch, Grain, NUM_MODES };
     enum class VPKnobMode { Volume = 0, Pan, NUM_MODES };
 
     PlaybackMode mode = PlaybackMode::OneShot;
@@ -575,35 +923,69 @@ struct PlaybackProfile {
     Eventful<double> volume = 1.l;
     Eventful<double> pan = 0.l;
     Eventful<double> speed = 1.l;
-    Eventful<double> xhift {1.l, [this](EventfulBase::Event, double) { this->tuner.set_period_ratio(xhift); }};
+    Eventful<double> xhift {1.l, [this](EventfulBase::Event, double) {
+        if (this->tuner)
+            this->tuner->set_period_ratio(xhift);
+    }};
     Eventful<double> freq {500, on_freq_range_changed};
     Eventful<double> range {1.0, on_freq_range_changed};
 
-    RealtimeMultiChannelTuner tuner;
+    // granular time stretch: pitch in semitones, grain size in ms (0 = off, speed changes pitch as usual)
+    Eventful<double> pitch = 0.l;
+    Eventful<double> grain = 0.l;
+
+    // the tuner state is leased from the pool only while this profile is playing with the tuner on
+    RealtimeMultiChannelTuner::OutputMode tuner_mode = RealtimeMultiChannelTuner::OFF;
+    TunerLease tuner;
+    GrainStretcher stretcher;
+    SpectralStage spectral;
+
+    // when enabled, static tuner settings are rendered in the background and played from the cache
+    bool prerender = false;
+    PrerenderCache render_cache;
+    uint64_t prerender_version = 1;
+    uint64_t requested_version = 0;
+    rack::dsp::Timer settle_timer;
+
+    struct PrerenderKey {
+        double freq, range, xhift;
+        RealtimeMultiChannelTuner::OutputMode output_mode;
+
+        bool operator!=(const PrerenderKey& other) const {
+            return freq != other.freq || range != other.range || xhift != other.xhift
+                || output_mode != other.output_mode;
+        }
+    };
+    PrerenderKey prerender_key {0, 0, 0, RealtimeMultiChannelTuner::OFF};
 
     double pong_mult = 1.l;
 
     void reconfig_filters() {
-        tuner.config_filters(freq, range);
+        if (tuner)
+            tuner->config_filters(freq, range);
     }
 
     EventfulValueRange get_tune_knob_value() {
         switch (tuner_knob_mode) {
             case TunerKnobMode::Range:
-                return {&range, 0.1, 9.99, fmt::format("R{:.2f}", range.value)};
+                return {&range, 0.1, 9.99, [](double v) { return fmt::format("R{:.2f}", v); }};
             case TunerKnobMode::Frequency:
-                return {&freq, 60, 10000, format_frequency(freq)};
+                return {&freq, 60, 10000, &format_frequency};
             case TunerKnobMode::Xhift:
-                return {&xhift, 0.1, 4, fmt::format("X{:.2f}", xhift.value)};
+                return {&xhift, 0.1, 4, [](double v) { return fmt::format("X{:.2f}", v); }};
+            case TunerKnobMode::Pitch:
+                return {&pitch, -24, 24, [](double v) { return fmt::format("P{:+.1f}", v); }};
+            case TunerKnobMode::Grain:
+                return {&grain, 0, 200, [](double v) { return v < 1 ? std::string("G OFF") : fmt::format("G{:.0f}", v); }};
         }
     }
 
     EventfulValueRange get_pv_knob_value() {
         switch (vp_knob_mode) {
             case VPKnobMode::Volume:
-                return {&volume, 0, 1, fmt::format("V{:.2f}", volume.value)};
+                return {&volume, 0, 1, [](double v) { return fmt::format("V{:.2f}", v); }};
             case VPKnobMode::Pan:
-                return {&pan, -1, 1, fmt::format("{:.2f}", pan.value)};
+                return {&pan, -1, 1, [](double v) { return fmt::format("{:.2f}", v); }};
         }
     }
 
@@ -642,10 +1024,11 @@ struct PlaybackProfile {
     auto read_channels(SampleGetter get_sample, IdxType num_channels, double pos) -> std::vector<double> {
         auto data = std::vector<double>(num_channels);
 
-        for (IdxType channel_idx = 0; channel_idx < num_channels; channel_idx++) {
-            auto result = rounded_sum(pos, speed);
-            auto p = result.more == result.less ? 0.0 : (result.actual - result.less) / (result.more - result.less);
+        // the interpolation position is the same for every channel
+        auto result = rounded_sum(pos, speed);
+        auto p = result.more == result.less ? 0.0 : (result.actual - result.less) / (result.more - result.less);
 
+        for (IdxType channel_idx = 0; channel_idx < num_channels; channel_idx++) {
             auto less_sample = get_sample(channel_idx, result.less);
             auto more_sample = get_sample(channel_idx, result.more);
 
@@ -668,11 +1051,97 @@ struct PlaybackProfile {
         return {new_left * volume, new_right * volume};
     }
 
+    // the audio source changed (edited range, new recording, ...)
+    void invalidate_prerender() {
+        prerender_version += 1;
+        settle_timer.reset();
+    }
+
+    // the render holds the tuner output at the source rate, played back at another speed or through grains its
+    // tuner band and period would move with the speed
+    auto can_use_prerender() const -> bool {
+        return prerender && tuner_mode != RealtimeMultiChannelTuner::OFF && std::abs(speed.value) == 1.0
+            && !is_stretching();
+    }
+
+    // a render of the current settings is still waiting for them to settle
+    auto prerender_pending() const -> bool {
+        return prerender && tuner_mode != RealtimeMultiChannelTuner::OFF && requested_version != prerender_version;
+    }
+
+    // true once the tuner settings have stopped changing for a while and a render of them is not yet requested
+    auto prerender_due(float delta) -> bool {
+        if (!prerender || tuner_mode == RealtimeMultiChannelTuner::OFF)
+            return false;
+
+        const PrerenderKey key {freq, range, xhift, tuner_mode};
+        if (key != prerender_key) {
+            prerender_key = key;
+            invalidate_prerender();
+            return false;
+        }
+
+        if (requested_version == prerender_version || settle_timer.process(delta) < rage::UI_update_time)
+            return false;
+
+        requested_version = prerender_version;
+        return true;
+    }
+
+    // the due render could not be queued, it comes due again after another settle time
+    void retry_prerender() {
+        requested_version = prerender_version - 1;
+        settle_timer.reset();
+    }
+
+    // gives pooled state back once the voice stops
+    void release_voice() {
+        tuner.release();
+        spectral.release();
+    }
+
+    // called when playback (re)starts from the start or stop head
+    void restart_voice() {
+        stretcher.reset();
+        spectral.unfreeze();
+    }
+
+    auto is_stretching() const -> bool {
+        return grain.value >= 1;
+    }
+
+    auto read_stretched(
+        SampleGetter get_sample,
+        IdxType num_channels,
+        IdxType frame_rate,
+        double pos,
+        double speed,
+        double start,
+        double stop
+    ) -> std::vector<double> {
+        stretcher.configure(grain * 0.001 * frame_rate, std::pow(2.0, pitch / 12.0));
+        return stretcher.process(get_sample, num_channels, pos, speed, start, stop);
+    }
+
     auto retune(std::vector<double> frame, IdxType frame_rate) -> std::vector<double> {
-        if (tuner.sample_rate != frame_rate)
-            tuner.set_sample_rate(frame_rate);
+        if (tuner_mode == RealtimeMultiChannelTuner::OFF) {
+            tuner.release();
+            return frame;
+        }
+
+        // setting a held tuner up for other audio would allocate, one that is ready for it is taken instead
+        if (tuner && !tuner->is_configured_for(frame_rate, frame.size()))
+            tuner.release();
+        if (!tuner) {
+            auto* leased = tuner.acquire_realtime(frame_rate, frame.size());
+            if (!leased)
+                return frame;
+            leased->config_filters(freq, range);
+            leased->set_period_ratio(xhift);
+        }
 
-        return tuner.process(frame);
+        tuner->set_output_mode(tuner_mode);
+        return tuner->process(frame);
     }
 
     struct ReadResult {
@@ -692,12 +1161,26 @@ struct PlaybackProfile {
         auto params = compute_params(start, stop, read);
 
         if (params.finished) {
+            release_voice();
             return {std::vector<double>(num_channels, 0.0), params.read, true};
         }
 
-        auto data = read_channels(get_sample, num_channels, params.read);
+        const PrerenderCache::Render* render = can_use_prerender() ? render_cache.ready(prerender_version) : nullptr;
+        const bool use_prerender = render != nullptr;
+        if (use_prerender) {
+            get_sample = [render](double channel_idx, double frame_idx) {
+                return render->get_sample(channel_idx, frame_idx);
+            };
+        }
+
+        auto data = is_stretching()
+            ? read_stretched(get_sample, num_channels, frame_rate, params.read, params.speed, start, stop)
+            : read_channels(get_sample, num_channels, params.read);
+
+        if (!use_prerender)
+            data = retune(data, frame_rate);
 
-        data = retune(data, frame_rate);
+        data = spectral.process(data);
 
         data = repan(data);
 
@@ -711,6 +1194,12 @@ struct PlaybackProfile {
         json_object_set(root, "xhift", json_real(xhift));
         json_object_set(root, "mode", json_integer((int)mode));
         json_object_set(root, "pong_mult", json_real(pong_mult));
+        json_object_set(root, "tuner_mode", json_integer((int)tuner_mode));
+        json_object_set(root, "pitch", json_real(pitch));
+        json_object_set(root, "grain", json_real(grain));
+        json_object_set(root, "prerender", json_boolean(prerender));
+        json_object_set(root, "spectral_mode", json_integer((int)spectral.mode));
+        json_object_set(root, "smear", json_real(spectral.smear));
 
         return root;
     }
@@ -720,5 +1209,13 @@ struct PlaybackProfile {
         xhift = json_real_value(json_object_get(root, "xhift"));
         mode = (PlaybackMode)json_integer_value(json_object_get(root, "mode"));
         pong_mult = json_real_value(json_object_get(root, "pong_mult"));
+        tuner_mode = (RealtimeMultiChannelTuner::OutputMode)json_integer_value(json_object_get(root, "tuner_mode"));
+        pitch = json_real_value(json_object_get(root, "pitch"));
+        grain = json_real_value(json_object_get(root, "grain"));
+        prerender = json_boolean_value(json_object_get(root, "prerender"));
+        spectral.mode = (SpectralProcessor::Mode)json_integer_value(json_object_get(root, "spectral_mode"));
+        json_t* json_smear = json_object_get(root, "smear");
+        if (json_smear)
+            spectral.smear = json_real_value(json_smear);
     }
 };
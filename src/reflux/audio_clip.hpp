@@ -1,5 +1,19 @@
 #pragma once
+#include <atomic>
+#include <limits>
+#include <memory>
+#include <mutex>
+
 #include "audio_base.hpp"
+#include "beat_tracker.hpp"
+#include "clip_audio.hpp"
+#include "consumer_registry.hpp"
+#include "loudness.hpp"
+#include "peak_sidecar.hpp"
+#include "pitch_analyzer.hpp"
+#include "prerender.hpp"
+#include "spectrogram.hpp"
+#include "zero_crossings.hpp"
 #include "dep/babycat/babycat.h"
 
 // NOLINTNEXTLINE (google-build-using-namespace)
@@ -18,18 +32,181 @@ struct BabycatWaveformInfo {
         frame_rate_hz(babycat_waveform_get_frame_rate_hz(waveform)) {}
 };
 
+// Audio of a file decoded away from the audio thread, swapped into the clip in one go
+struct DecodedAudio {
+    bool ok = false;
+    bool preview = false;  // only the stored peaks, the decoded audio follows
+    bool new_file = true;  // other than the one the clip had, analysis of the previous audio no longer applies
+    IdxType num_frames = 0;
+    IdxType num_channels = 0;
+    IdxType frame_rate_hz = 0;
+    std::shared_ptr<ClipAudio> audio;
+
+    void load_babycat_waveform(babycat_Waveform* waveform) {
+        const auto info = BabycatWaveformInfo(waveform);
+        this->num_frames = info.num_frames;
+        this->num_channels = info.num_channels;
+        this->frame_rate_hz = info.frame_rate_hz;
+        this->audio = std::make_shared<ClipAudio>(num_channels, num_frames);
+
+        for (IdxType cidx = 0; cidx < this->num_channels; cidx++) {
+            auto& channel = this->audio->channels[cidx];
+            for (IdxType fidx = 0; fidx < this->num_frames; fidx++) {
+                channel[fidx] = babycat_waveform_get_unchecked_sample(waveform, fidx, cidx);
+            }
+        }
+        this->audio->peaks.rebuild(this->audio->getter(), num_channels, num_frames);
+    }
+
+    auto load_babycat_path(const std::string& path) -> bool {
+        const babycat_WaveformArgs waveform_args = babycat_waveform_args_init_default();
+        const babycat_WaveformResult waveform_result = babycat_waveform_from_file(path.c_str(), waveform_args);
+        if (waveform_result.error_num != 0) {
+            printf("Failed to load audio clip [%s] with error: %u\n", path.c_str(), waveform_result.error_num);
+            return false;
+        }
+
+        auto* waveform = waveform_result.result;
+        {
+            // make sure we are working with 1 sample per channel in each frame
+            auto info = BabycatWaveformInfo(waveform);
+            const IdxType samples_per_channel_per_frame = info.num_samples / (info.num_channels * info.num_frames);
+            babycat_waveform_resample(waveform, info.frame_rate_hz * samples_per_channel_per_frame);
+        }
+
+        this->load_babycat_waveform(waveform);
+        this->ok = true;
+        return true;
+    }
+
+    // peaks stored next to path, false without a sidecar
+    auto load_preview(const std::string& path) -> bool {
+        uint32_t frame_rate = 0;
+        this->audio = std::make_shared<ClipAudio>();
+        if (!PeakSidecar::read(path, this->audio->peaks, frame_rate))
+            return false;
+        this->num_frames = this->audio->peaks.frames();
+        this->num_channels = this->audio->peaks.channels();
+        this->frame_rate_hz = frame_rate;
+        this->preview = true;
+        this->ok = true;
+        return true;
+    }
+};
+
+// Hands a background decode over to the audio thread, only the newest load is ever delivered
+struct DecodeHandoff {
+  private:
+    std::mutex mutex;
+    std::unique_ptr<DecodedAudio> result;
+    std::unique_ptr<DecodedAudio> taken;  // audio thread, the last result handed over
+    uint64_t result_id = 0;
+    std::atomic<uint64_t> latest {0};
+    std::atomic<bool> pending {false};
+    std::atomic<bool> ready {false};
+
+  public:
+    DecodeHandoff() = default;
+
+    // copies start out empty
+    DecodeHandoff(const DecodeHandoff&) {}
+
+    DecodeHandoff& operator=(const DecodeHandoff&) {
+        abandon();
+        return *this;
+    }
+
+    // returns the id the decode has to finish with
+    auto start() -> uint64_t {
+        abandon();
+        pending = true;
+        return latest.load();
+    }
+
+    // Drops a pending decode, a late finish of it is ignored. Audio thread safe: it never waits and leaves a
+    // stale result to be freed by the next finish
+    void abandon() {
+        latest += 1;
+        pending = false;
+        ready = false;
+    }
+
+    auto is_pending() const -> bool {
+        return pending;
+    }
+
+    // a preview is delivered without ending the load, the decoded audio follows with the same id
+    void finish(uint64_t id, std::unique_ptr<DecodedAudio> decoded) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (id != latest)
+            return;
+        result.swap(decoded);
+        result_id = id;
+        ready = true;
+    }
+
+    // Audio thread, never waits on the lock. The result stays valid until the next take, the one it replaces is
+    // freed by the next finish. nullptr when there is nothing new
+    auto take() -> DecodedAudio* {
+        if (!ready)
+            return nullptr;
+        std::unique_lock<std::mutex> lock(mutex, std::try_to_lock);
+        if (!lock.owns_lock() || !ready)
+            return nullptr;
+        ready = false;
+        if (result_id != latest)
+            return nullptr;
+        result.swap(taken);
+        if (!taken->preview)
+            pending = false;
+        return taken.get();
+    }
+};
+
 using namespace std::placeholders;
 struct AudioClip {
     int id = 0;
     IdxType num_frames = 0;
     IdxType num_channels = 0;
     IdxType frame_rate_hz = 0;
-    std::vector<std::vector<double>> raw_data;
+    std::shared_ptr<ClipAudio> audio = ClipAudio::empty();  // audio thread, other threads read shared_storage()
 
     std::string file_path;
     std::string file_display;
     std::string file_info_display;
-    DisplayBufferType display_buf;
+    DisplayBufferSlot display_buf;
+    DisplayView display_view;
+    DisplayGeneration display_generation;
+    SpectrogramCache spectrogram;
+    SpectrogramSlot spectrogram_image;
+    uint64_t built_generation = 0;  // ui thread only
+    ZeroCrossingIndex zero_crossings;
+    BeatGrid beat_grid;
+    bool beat_grid_known = false;  // analyzed, the grid may still be empty when no tempo was found
+    BeatTracker beat_tracker;
+    uint64_t content_version = 0;  // changes whenever the audio is replaced by other audio
+    PitchEstimate pitch;
+    PitchAnalyzer::Slot pitch_slot;
+    LoudnessTrack loudness;
+    double auto_gain = 1.0;  // playback gain, slews towards auto_gain_target
+    double auto_gain_target = 1.0;  // measured from the loudness when auto gain is on
+    DecodeHandoff decode_handoff;
+
+    // recording past the capacity of the storage stages frames here while bigger storage is made on the pool
+    enum { RECORD_CHANNELS = 2 };
+    enum { STAGING_FRAMES = 16384 };
+    enum { GROWTH_SECONDS = 30 };
+    enum { GROWTH_MARGIN_SECONDS = 10 };
+    ClipAudioGrowth audio_growth;
+    bool growth_requested = false;
+    IdxType written_begin = std::numeric_limits<IdxType>::max();  // lowest frame written since the growth was asked
+    std::vector<IdxType> staged_frames = std::vector<IdxType>(STAGING_FRAMES);
+    std::vector<double> staged_samples = std::vector<double>(STAGING_FRAMES * RECORD_CHANNELS);
+    size_t num_staged = 0;
+
+    ClipAudioPublisher published_audio;
+    bool audio_published = true;
+    std::shared_ptr<const ClipAudio> retired_audio;  // storage the pool queue had no room for yet
 
     bool has_loaded = false;
     bool has_recorded = false;
@@ -42,58 +219,151 @@ struct AudioClip {
         this->fix_heads();
     };
 
+    Eventful<double>::Callback on_range_event = [this](EventfulBase::Event, double) {
+        this->fix_heads();
+        this->playback_profile.invalidate_prerender();
+    };
+
     Eventful<double> read_head {0, on_head_event};
     Eventful<double> write_head {1.0, on_head_event};
-    Eventful<double> start_head {0, on_head_event};
-    Eventful<double> stop_head {0, on_head_event};
+    Eventful<double> start_head {0, on_range_event};
+    Eventful<double> stop_head {0, on_range_event};
 
-    using StoredConsumer = std::shared_ptr<AudioConsumer>;
-    std::vector<StoredConsumer> consumers;
+    using StoredConsumer = ConsumerRegistry::Stored;
+    ConsumerRegistry consumers;
     rack::dsp::Timer write_timer;
     DisplayBufferBuilder* display_buffer_builder = nullptr;
+    PrerenderBuilder* prerenderer = nullptr;
     PlaybackProfile playback_profile;
 
     AudioClip() : file_path("Unsaved.***") {
         this->update_display_data();
     }
 
+    ~AudioClip() {
+        // slice display batches are keyed by their clip, spectrogram renders are owned by its cache
+        WorkerPool::shared().cancel(this);
+        WorkerPool::shared().cancel(&decode_handoff);
+        WorkerPool::shared().cancel(&audio_growth);
+        zero_crossings.cancel();
+        loudness.cancel();
+        spectrogram.cancel_all();
+        if (display_buffer_builder)
+            display_buffer_builder->cancel(&display_buf);
+        if (prerenderer)
+            prerenderer->cancel(&playback_profile.render_cache);
+    }
+
     void set_id(int id) {
         this->id = id;
     }
 
-    void load_babycat_waveform(babycat_Waveform* waveform) {
-        const auto info = BabycatWaveformInfo(waveform);
-        this->num_frames = info.num_frames;
-        this->num_channels = info.num_channels;
-        this->frame_rate_hz = info.frame_rate_hz;
-        this->raw_data.resize(this->num_channels);
+    // audio thread, the storage background work started from here reads. other threads use shared_storage()
+    auto storage() const -> std::shared_ptr<const ClipAudio> {
+        return audio;
+    }
 
-        for (IdxType cidx = 0; cidx < this->num_channels; cidx++) {
-            this->raw_data[cidx].resize(this->num_frames, 0.0);
-            for (IdxType fidx = 0; fidx < this->num_frames; fidx++) {
-                this->raw_data[cidx][fidx] = babycat_waveform_get_unchecked_sample(waveform, fidx, cidx);
-            }
-        }
+    // the storage last published by the audio thread
+    auto shared_storage() const -> std::shared_ptr<const ClipAudio> {
+        return published_audio.read();
     }
 
-    auto load_babycat_path(std::string& path) -> bool {
-        const babycat_WaveformArgs waveform_args = babycat_waveform_args_init_default();
-        const babycat_WaveformResult waveform_result = babycat_waveform_from_file(path.c_str(), waveform_args);
-        if (waveform_result.error_num != 0) {
-            printf("Failed to load audio clip [%s] with error: %u\n", path.c_str(), waveform_result.error_num);
-            return false;
-        }
+    // previews and cleared clips have no samples to analyze
+    auto has_samples() const -> bool {
+        return audio->has_samples();
+    }
 
-        auto* waveform = waveform_result.result;
-        {
-            // make sure we are working with 1 sample per channel in each frame
-            auto info = BabycatWaveformInfo(waveform);
-            const IdxType samples_per_channel_per_frame = info.num_samples / (info.num_channels * info.num_frames);
-            babycat_waveform_resample(waveform, info.frame_rate_hz * samples_per_channel_per_frame);
+    // frames that are in the storage, recorded frames can be staged past it for a while
+    auto stored_frames() const -> IdxType {
+        return std::min(num_frames, audio->capacity());
+    }
+
+    // audio thread, swaps next in. the previous storage may still be read by tasks, so it is let go of on the pool
+    void replace_audio(std::shared_ptr<ClipAudio> next) {
+        audio.swap(next);
+        retire_audio(std::move(next));
+        publish_audio();
+    }
+
+    void publish_audio() {
+        std::shared_ptr<const ClipAudio> previous = audio;
+        audio_published = published_audio.publish(previous);
+        // unpublished, previous is still held by audio
+        if (audio_published)
+            retire_audio(std::move(previous));
+    }
+
+    void retire_audio(std::shared_ptr<const ClipAudio> storage) {
+        if (!storage || WorkerPool::shared().retire(storage))
+            return;
+        // the pool queue is full, update_timer tries again. only one is kept, an older one is let go of here
+        retired_audio.swap(storage);
+    }
+
+    // swaps decoded audio (or a peak only preview of it) in, see DecodeHandoff
+    void adopt_decoded(DecodedAudio& decoded) {
+        // reloading the same file keeps the grid stored with the patch
+        if (decoded.new_file) {
+            forget_beat_grid();
+            content_version += 1;
         }
+        abandon_growth();
+        this->num_frames = decoded.num_frames;
+        this->num_channels = decoded.num_channels;
+        this->frame_rate_hz = decoded.frame_rate_hz;
+        this->replace_audio(std::move(decoded.audio));
+        this->stop_head = this->num_frames;
+        this->playback_profile.invalidate_prerender();
+        this->spectrogram.invalidate_from(0);
+        this->zero_crossings.invalidate_from(0);
+        this->loudness.invalidate_from(0);
+        this->request_frame_analysis();
+        if (!decoded.preview)
+            this->request_beat_grid();
+        this->update_display_data();
+        this->display_generation.bump();
+    }
 
-        this->load_babycat_waveform(waveform);
-        return true;
+    // zero crossings and levels, previews have no samples yet so theirs are built once the decoded audio is adopted
+    void request_frame_analysis() {
+        if (!has_samples())
+            return;
+        const std::shared_ptr<const ClipAudio> storage = audio;
+        zero_crossings.request(storage, num_channels, stored_frames());
+        loudness.request(storage, num_channels, stored_frames(), (IdxType)frame_rate_hz);
+    }
+
+    auto level(IdxType start, IdxType stop) const -> LoudnessStats {
+        return loudness.stats(start, stop);
+    }
+
+    // frame moved onto a zero crossing at most 10 ms away, see ZeroCrossingIndex::snap for direction
+    auto snap_to_zero_crossing(double frame, int direction = 0) const -> double {
+        return zero_crossings.snap(frame, frame_rate_hz * 0.01, direction);
+    }
+
+    // the same for the audio thread
+    auto snap_to_zero_crossing_realtime(double frame, int direction = 0) const -> double {
+        return zero_crossings.snap_realtime(frame, frame_rate_hz * 0.01, direction);
+    }
+
+    // tempo and beats of the whole clip on the pool, loaded files go through the beat cache
+    void request_beat_grid() {
+        if (!has_samples() || beat_grid_known || beat_tracker.is_busy())
+            return;
+        OnsetDetector::Args args;
+        args.audio = audio;
+        args.num_channels = num_channels;
+        args.frame_rate = frame_rate_hz;
+        args.start = 0;
+        args.stop = stored_frames();
+        beat_tracker.analyze(args, has_loaded ? file_path : "");
+    }
+
+    void forget_beat_grid() {
+        beat_tracker.abandon();
+        beat_grid = BeatGrid();
+        beat_grid_known = false;
     }
 
     void update_display_data() {
@@ -106,27 +376,80 @@ struct AudioClip {
         free(path_dup);
     }
 
+    // spectrogram of frames [start, stop) into dst, shared by the clip and its slices
+    void request_spectrogram(SpectrogramSlot* dst, IdxType start, IdxType stop, IdxType points) {
+        const auto storage = shared_storage();
+        SpectrogramCache::RenderArgs args;
+        args.get_sample = storage->getter();
+        args.source = storage;
+        args.dst = dst;
+        args.num_channels = num_channels;
+        args.num_frames = num_frames;
+        args.sample_rate = frame_rate_hz;
+        args.start = start;
+        args.stop = stop;
+        args.points = points;
+        spectrogram.request(args);
+    }
+
     void build_display_buf_self() {
         using namespace std::placeholders;
-        const auto get_sample_lambda = std::bind(&AudioClip::get_sample, this, _1, _2);
+        if (display_view.spectrogram) {
+            request_spectrogram(
+                &spectrogram_image,
+                (IdxType)(display_view.begin * num_frames),
+                (IdxType)std::ceil(display_view.end * num_frames),
+                display_view.points
+            );
+            return;
+        }
+
+        const auto storage = shared_storage();
         if (this->display_buffer_builder) {
-            display_buffer_builder->build({get_sample_lambda, &display_buf, 0, num_frames});
+            DisplayBufferBuilder::BuildArgs args {
+                storage->getter(),
+                &display_buf,
+                (IdxType)(display_view.begin * num_frames),
+                (IdxType)std::ceil(display_view.end * num_frames)
+            };
+            args.num_channels = num_channels;
+            args.points = display_view.points;
+            args.pyramid = &storage->peaks;
+            args.source = storage;
+            display_buffer_builder->build(args);
         }
     }
 
     auto load_file(std::string& path) -> bool {
-        // Try load waveform using babycat
-        if (!this->load_babycat_path(path)) {
-            return false;
+        // Files seen before show their stored peaks while decoding in the background,
+        // new ones are decoded with babycat right here and get a sidecar for next time.
+        // Either way the audio thread swaps the result in on its next update, see adopt_decoded
+        const bool new_file = path != file_path;
+        std::unique_ptr<DecodedAudio> decoded(new DecodedAudio());
+        if (!decoded->load_preview(path)) {
+            if (!decoded->load_babycat_path(path))
+                return false;
+            PeakSidecar::write(path, decoded->audio->peaks, (uint32_t)decoded->frame_rate_hz);
+        }
+        decoded->new_file = new_file;
+        const bool preview = decoded->preview;
+
+        DecodeHandoff* handoff = &decode_handoff;
+        const uint64_t load_id = handoff->start();
+        handoff->finish(load_id, std::move(decoded));
+        if (preview) {
+            auto decode = [handoff, load_id, path, new_file] {
+                std::unique_ptr<DecodedAudio> decoded(new DecodedAudio());
+                decoded->load_babycat_path(path);
+                decoded->new_file = new_file;
+                handoff->finish(load_id, std::move(decoded));
+            };
+            WorkerPool::shared().submit(handoff, decode, WorkerPool::NORMAL, this);
         }
 
-        this->stop_head = this->num_frames;
         this->file_path = path;
         this->has_loaded = true;
         this->has_recorded = false;
-        this->update_display_data();
-        this->build_display_buf_self();
-
         return true;
     }
 
@@ -150,9 +473,10 @@ struct AudioClip {
         const auto num_samples = (sf_count_t)(num_channels * num_frames);
         auto save_buffer = std::vector<double>(num_samples);
 
+        const auto storage = shared_storage();
         for (IdxType cidx = 0; cidx < this->num_channels; cidx++) {
             for (IdxType fidx = 0; fidx < this->num_frames; fidx++) {
-                save_buffer[num_channels * fidx + cidx] = get_sample(cidx, fidx);
+                save_buffer[num_channels * fidx + cidx] = storage->get_sample(cidx, fidx);
             }
         }
 
@@ -177,31 +501,103 @@ struct AudioClip {
         return result;
     }
 
-    auto get_sample(IdxType channel_idx, IdxType frame_idx) -> double {
-        if (channel_idx >= this->raw_data.size() || frame_idx >= this->raw_data[channel_idx].size()) {
-            return 0;
-        }
-        return this->raw_data[channel_idx][frame_idx];
+    // audio thread
+    auto get_sample(IdxType channel_idx, IdxType frame_idx) const -> double {
+        return this->audio->get_sample(channel_idx, frame_idx);
     }
 
-    auto set_sample(IdxType channel_idx, IdxType frame_idx, double value, bool overwrite = true) -> bool {
-        if (channel_idx >= this->num_channels) {
-            this->num_channels = channel_idx + 1;
-            this->raw_data.resize(this->num_channels);
-        }
+    // Audio thread, never allocates. A frame the storage has no room for is staged until the storage made by
+    // request_growth is taken over, it is dropped when the staging buffer is full as well.
+    void store_frame(const double* values, IdxType channel_count, IdxType frame_idx) {
+        channel_count = std::min<IdxType>(channel_count, RECORD_CHANNELS);
+        this->num_channels = std::max(num_channels, channel_count);
         this->num_frames = std::max(num_frames, frame_idx + 1);
+        this->written_begin = std::min(written_begin, frame_idx);
+
+        if (frame_idx < audio->capacity() && channel_count <= audio->num_channels()) {
+            for (IdxType cidx = 0; cidx < channel_count; cidx++) {
+                audio->channels[cidx][frame_idx] = values[cidx];
+            }
+            audio->peaks.write_frame(values, channel_count, frame_idx);
+        } else if (num_staged < STAGING_FRAMES) {
+            double* staged = &staged_samples[num_staged * RECORD_CHANNELS];
+            for (IdxType cidx = 0; cidx < RECORD_CHANNELS; cidx++) {
+                staged[cidx] = cidx < channel_count ? values[cidx] : 0.0;
+            }
+            staged_frames[num_staged] = frame_idx;
+            num_staged += 1;
+        }
 
-        auto& channel = raw_data[channel_idx];
+        if (frame_idx + frame_rate_hz * GROWTH_MARGIN_SECONDS >= audio->capacity()
+            || num_channels > audio->num_channels())
+            request_growth();
+    }
 
-        if (frame_idx >= channel.size()) {
-            double segment_size = (double)frame_rate_hz * 60 * 3;
-            double capacity_segments = ceil((double)frame_idx / segment_size);
-            channel.reserve(capacity_segments * segment_size);
-            channel.resize(frame_idx + 1);
+    // copies the storage into a bigger one on the pool, the copy is taken over by take_growth
+    void request_growth() {
+        if (growth_requested)
+            return;
+        const IdxType frames = num_frames;
+        const IdxType channels = num_channels;
+        const IdxType capacity = std::max(audio->capacity() * 2, frames + frame_rate_hz * GROWTH_SECONDS);
+        std::shared_ptr<const ClipAudio> from = audio;
+        ClipAudioGrowth* growth = &audio_growth;
+        const uint64_t id = growth->start();
+        auto task = [growth, id, from, frames, channels, capacity] {
+            growth->finish(id, ClipAudio::grown(*from, frames, channels, capacity));
+        };
+        // a full queue asks again with the next frame
+        if (!WorkerPool::shared().post(growth, std::move(task), WorkerPool::HIGH, this))
+            return;
+        growth_requested = true;
+        written_begin = std::numeric_limits<IdxType>::max();
+    }
+
+    // audio thread, swaps in the grown storage once it is ready
+    void take_growth() {
+        std::shared_ptr<ClipAudio> grown;
+        if (!audio_growth.take(grown))
+            return;
+        growth_requested = false;
+
+        // frames recorded into the old storage while it was copied
+        const IdxType copy_channels = std::min<IdxType>(RECORD_CHANNELS, audio->num_channels());
+        const IdxType copy_end = std::min(num_frames, audio->capacity());
+        for (IdxType fidx = written_begin; fidx < copy_end; fidx++) {
+            for (IdxType cidx = 0; cidx < copy_channels; cidx++) {
+                grown->channels[cidx][fidx] = audio->channels[cidx][fidx];
+            }
         }
+        grown->peaks.mark_written(written_begin, copy_end);
+        written_begin = std::numeric_limits<IdxType>::max();
+
+        // then the staged ones, those that still do not fit wait for the next growth
+        size_t kept = 0;
+        const IdxType staged_channels = std::min<IdxType>(RECORD_CHANNELS, grown->num_channels());
+        for (size_t idx = 0; idx < num_staged; idx++) {
+            const IdxType fidx = staged_frames[idx];
+            const double* staged = &staged_samples[idx * RECORD_CHANNELS];
+            if (fidx >= grown->capacity()) {
+                staged_frames[kept] = fidx;
+                std::copy(staged, staged + RECORD_CHANNELS, &staged_samples[kept * RECORD_CHANNELS]);
+                written_begin = std::min(written_begin, fidx);
+                kept += 1;
+                continue;
+            }
+            for (IdxType cidx = 0; cidx < staged_channels; cidx++) {
+                grown->channels[cidx][fidx] = staged[cidx];
+            }
+            grown->peaks.write_frame(staged, staged_channels, fidx);
+        }
+        num_staged = kept;
+        replace_audio(std::move(grown));
+    }
 
-        channel[frame_idx] = value;
-        return true;
+    void abandon_growth() {
+        audio_growth.abandon();
+        growth_requested = false;
+        written_begin = std::numeric_limits<IdxType>::max();
+        num_staged = 0;
     }
 
     auto has_data() const -> bool {
@@ -209,12 +605,17 @@ struct AudioClip {
     }
 
     void clear() {
-        this->raw_data.clear();
+        this->decode_handoff.abandon();
+        this->forget_beat_grid();
+        this->content_version += 1;
+        this->abandon_growth();
+        this->replace_audio(ClipAudio::empty());
         this->num_channels = 0;
         this->num_frames = 0;
         this->has_loaded = false;
         this->has_recorded = false;
         this->is_playing = false;
+        this->playback_profile.release_voice();
         this->is_recording = false;
         this->can_clear = false;
         this->file_path = "";
@@ -223,12 +624,20 @@ struct AudioClip {
         this->start_head = 0;
         this->stop_head = 0;
         this->read_head = 0;
+        this->playback_profile.invalidate_prerender();
+        this->spectrogram.invalidate_from(0);
+        this->zero_crossings.invalidate_from(0);
+        this->loudness.invalidate_from(0);
+        this->auto_gain = 1.0;
+        this->auto_gain_target = 1.0;
+        this->display_generation.bump();
         this->notify_consumers();
     }
 
     void start_playing() {
         if (has_data()) {
             this->read_head = playback_profile.speed > 0 ? start_head : stop_head;
+            this->playback_profile.restart_voice();
             this->is_playing = true;
             this->can_clear = false;
         }
@@ -237,6 +646,7 @@ struct AudioClip {
     void toggle_playing() {
         if (this->is_playing) {
             this->is_playing = false;
+            this->playback_profile.release_voice();
         } else {
             start_playing();
         }
@@ -273,17 +683,28 @@ struct AudioClip {
     };
 
     void write_frame(const double* channels, WriteArgs args = {}) {
-        if (!is_recording) {
+        // the clip is about to be replaced by the file being decoded
+        if (!is_recording || decode_handoff.is_pending()) {
             return;
         }
 
         frame_rate_hz = 1.0 / args.delta;
-
-        for (IdxType cidx = 0; cidx < args.channel_count; cidx++) {
-            set_sample(cidx, write_head.value, channels[cidx], args.overwrite);
+        if (beat_grid_known || beat_tracker.is_busy())
+            forget_beat_grid();
+        content_version += 1;
+
+        // appended audio is picked up incrementally, overwritten audio has to be recomputed
+        if (write_head.value < num_frames) {
+            spectrogram.invalidate_from((uint64_t)write_head.value);
+            zero_crossings.invalidate_from((uint64_t)write_head.value);
+            loudness.invalidate_from((uint64_t)write_head.value);
         }
 
+        take_growth();
+        store_frame(channels, args.channel_count, (IdxType)write_head.value);
+
         this->has_recorded = true;
+        this->playback_profile.invalidate_prerender();
 
         if (write_head.value == stop_head.value) {
             is_recording = false;
@@ -295,19 +716,99 @@ struct AudioClip {
 
         if (write_timer.process(args.delta) > rage::UI_update_time) {
             write_timer.reset();
+            if (has_samples())
+                audio->peaks.refresh(audio->getter());
+            this->request_frame_analysis();
             this->update_display_data();
-            this->build_display_buf_self();
+            this->display_generation.bump();
         }
     }
 
+    void update_timer(float delta) {
+        if (DecodedAudio* decoded = decode_handoff.take()) {
+            if (decoded->ok)
+                adopt_decoded(*decoded);
+            else
+                clear();
+        }
+
+        // retried until the pool has room and no reader holds the lock
+        if (retired_audio)
+            WorkerPool::shared().retire(retired_audio);
+        if (!audio_published)
+            publish_audio();
+
+        if (beat_tracker.take(beat_grid))
+            beat_grid_known = true;
+
+        if (playback_profile.prerender_due(delta))
+            request_prerender();
+    }
+
+    void request_prerender() {
+        if (!prerenderer || !has_data() || stop_head - start_head > frame_rate_hz * PRERENDER_MAX_SECONDS)
+            return;
+
+        auto args = PrerenderBuilder::RenderArgs::from_profile(playback_profile);
+        args.audio = audio;
+        args.num_channels = num_channels;
+        args.frame_rate = frame_rate_hz;
+        args.start = start_head;
+        args.stop = stop_head;
+        if (!prerenderer->render(args))
+            playback_profile.retry_prerender();
+    }
+
     void fix_heads() {
         stop_head.silent_set(std::max<double>(start_head, stop_head));
         read_head.silent_set(std::max<double>(start_head, read_head));
         read_head.silent_set(std::min<double>(stop_head, read_head));
     }
 
-    const DisplayBufferType& get_display_buf() const {
-        return display_buf;
+    const DisplayBuffer& get_display_buf() const {
+        return display_buf.read();
+    }
+
+    // epoch of the newest published display buffer, changes whenever a build lands
+    auto get_display_epoch() const -> uint64_t {
+        if (display_view.spectrogram) {
+            spectrogram_image.read();
+            return spectrogram_image.epoch();
+        }
+        display_buf.read();
+        return display_buf.epoch();
+    }
+
+    const SpectrogramImage& get_spectrogram_image() const {
+        return spectrogram_image.read();
+    }
+
+    auto get_display_view() const -> DisplayView {
+        return display_view;
+    }
+
+    void set_display_view(DisplayView view) {
+        if (view != display_view) {
+            display_view = view;
+            display_generation.bump();
+        }
+    }
+
+    auto get_display_generation() const -> uint64_t {
+        return display_generation.get();
+    }
+
+    // called by the widget showing this clip, builds only when something changed since the last request
+    void request_display_build() {
+        const uint64_t generation = get_display_generation();
+        if (generation == built_generation)
+            return;
+        built_generation = generation;
+        build_display_buf_self();
+    }
+
+    auto get_display_frames() const -> IdxType {
+        return num_frames;
     }
 
     std::vector<Marker> get_markers() const {
@@ -337,51 +838,24 @@ struct AudioClip {
         return fmt::format("{}. {}", id + 1, file_display);
     }
 
+    // ui thread, the tempo is formatted here so taking a beat grid leaves the strings alone
     auto get_text_info() const -> std::string {
-        return file_info_display;
+        const BeatGrid grid = beat_grid;
+        if (!grid.valid())
+            return file_info_display;
+        return file_info_display + fmt::format("-{:.1f}BPM", grid.bpm());
     }
 
-    StoredConsumer create_consumer(float pos, std::string tag, AudioConsumer::NotificationListener on_notify) {
-        std::string name = "";
-        do {
-            name = random_string(4);
-        } while (find_consumer_by_name(name) >= 0);
-
-        auto obj = std::make_shared<AudioConsumer>(name, pos, tag, on_notify);
-        consumers.push_back(obj);
-        sort_consumers();
-        return obj;
-    }
-
-    void sort_consumers() {
-        std::sort(consumers.begin(), consumers.end(), [](StoredConsumer consumer1, StoredConsumer consumer2) {
-            return *consumer1 < *consumer2;
-        });
-    }
-
-    auto find_consumer(std::function<bool(const StoredConsumer)> predicate) const -> int {
-        auto iter = std::find_if(consumers.begin(), consumers.end(), std::move(predicate));
-        if (iter == consumers.end()) {
-            return -1;
-        }
-        return std::distance(consumers.begin(), iter);
-    }
-
-    auto find_consumer_by_name(std::string name) const -> int {
-        return find_consumer([&](const StoredConsumer other) { return other->name == name; });
+    StoredConsumer create_consumer(double pos, std::string tag, AudioConsumer::NotificationListener on_notify) {
+        return consumers.create(pos, tag, on_notify);
     }
 
     void remove_consumer(const StoredConsumer& consumer) {
-        const int idx = find_consumer_by_name(consumer->name);
-        if (idx >= 0) {
-            consumers.erase(consumers.begin() + idx);
-        }
+        consumers.remove(consumer->id);
     }
 
     void notify_consumers() {
-        for (auto& consumer : consumers) {
-            consumer->notify();
-        }
+        consumers.notify_all();
     }
 
     json_t* make_json_obj() {
@@ -397,6 +871,10 @@ struct AudioClip {
         json_object_set(root, "start_head", json_real(start_head));
         json_object_set(root, "stop_head", json_real(stop_head));
         json_object_set(root, "playback_profile", playback_profile.make_json_obj());
+        if (beat_grid_known)
+            json_object_set_new(root, "beat_grid", beat_grid.make_json_obj());
+        if (pitch.analyzed)
+            json_object_set_new(root, "pitch", pitch.make_json_obj());
 
         return root;
     }
@@ -412,5 +890,11 @@ struct AudioClip {
         start_head = json_real_value(json_object_get(root, "start_head"));
         stop_head = json_real_value(json_object_get(root, "stop_head"));
         playback_profile.load_json(json_object_get(root, "playback_profile"));
+        if (json_t* grid = json_object_get(root, "beat_grid")) {
+            beat_grid.load_json(grid);
+            beat_grid_known = true;
+        }
+        if (json_t* estimate = json_object_get(root, "pitch"))
+            pitch.load_json(estimate, content_version);
     }
 };
\ No newline at end of file
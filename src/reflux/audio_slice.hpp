@@ -1,11 +1,21 @@
 #pragma once
 #include "audio_base.hpp"
 #include "audio_clip.hpp"
+#include "slice_envelope.hpp"
+#include "slice_features.hpp"
+#include "slice_table.hpp"
 
 struct AudioSlice {
   private:
     AudioClip& m_clip;
-    DisplayBufferType m_display_buf;
+    SliceTable& m_table;
+    const SliceTable::Row m_row;
+    bool m_detached = false;
+    DisplayBufferSlot m_display_buf;
+    DisplayView m_display_view;
+    DisplayGeneration m_display_generation;
+    SpectrogramSlot m_spectrogram_image;
+    uint64_t m_built_generation = 0;  // ui thread only
     rack::dsp::Timer m_update_timer;
     Eventful<double>::Callback m_handle_range_changed = [this](EventfulBase::Event, double) { this->update_data(); };
 
@@ -16,10 +26,13 @@ struct AudioSlice {
         start.silent_set(clamp((double)start, 0.0L, m_clip.num_frames));
         attack.silent_set(clamp((double)attack, start, stop));
         release.silent_set(clamp((double)release, start, stop));
-        read = clamp((double)read, start, stop);
-        consumer->marker.pos = (float)start / (m_clip.num_frames + 1);
-        consumer->marker.tag = "start";
+        set_read(clamp(get_read(), start, stop));
+        envelope.configure(start, stop, attack, release);
+        m_table.set_range(m_row, start, stop, attack, release);
+        m_table.activate(m_row);
+        m_clip.consumers.set_marker(*consumer, (float)start / (m_clip.num_frames + 1), "start");
         needs_ui_update = true;
+        playback_profile.invalidate_prerender();
     }
 
   public:
@@ -30,13 +43,15 @@ struct AudioSlice {
     Eventful<double> attack;
     Eventful<double> release;
 
-    double read;
+    SliceEnvelope envelope;
+    PitchEstimate pitch;
+    SliceFeatures features;
     bool needs_ui_update = true;
     IdxType idx = 0;
     IdxType total = 0;
-    bool is_playing = false;
 
     DisplayBufferBuilder* display_buffer_builder;
+    PrerenderBuilder* prerenderer;
 
     PlaybackProfile playback_profile;
 
@@ -47,24 +62,68 @@ struct AudioSlice {
         PingPong
     };
 
-    static std::shared_ptr<AudioSlice> create(AudioClip& clip, DisplayBufferBuilder* dbb) {
-        return std::make_shared<AudioSlice>(clip, dbb);
+    static std::shared_ptr<AudioSlice> create(
+        AudioClip& clip,
+        SliceTable& table,
+        DisplayBufferBuilder* dbb,
+        PrerenderBuilder* prerenderer = nullptr
+    ) {
+        return std::make_shared<AudioSlice>(clip, table, dbb, prerenderer);
     }
 
-    AudioSlice(AudioClip& clip, IdxType start, IdxType stop, DisplayBufferBuilder* dbb = nullptr) :
+    AudioSlice(
+        AudioClip& clip,
+        SliceTable& table,
+        IdxType start,
+        IdxType stop,
+        DisplayBufferBuilder* dbb = nullptr,
+        PrerenderBuilder* prerenderer = nullptr
+    ) :
         m_clip(clip),
+        m_table(table),
+        m_row(table.acquire(this)),
         consumer(m_clip.create_consumer(0, "", on_notification)),
         start(Eventful<double>(start, m_handle_range_changed)),
         stop(Eventful<double>(stop, m_handle_range_changed)),
         attack(Eventful<double>(start, m_handle_range_changed)),
         release(Eventful<double>(stop, m_handle_range_changed)),
-        read(start),
-        display_buffer_builder(dbb)
+        display_buffer_builder(dbb),
+        prerenderer(prerenderer)
     {
+        set_read(start);
         update_data();
     }
 
-    AudioSlice(AudioClip& clip, DisplayBufferBuilder* dbb) : AudioSlice(clip, clip.start_head, clip.stop_head, dbb) {}
+    AudioSlice(AudioClip& clip, SliceTable& table, DisplayBufferBuilder* dbb, PrerenderBuilder* prerenderer = nullptr) :
+        AudioSlice(clip, table, clip.start_head, clip.stop_head, dbb, prerenderer) {}
+
+    auto row() const -> SliceTable::Row {
+        return m_row;
+    }
+
+    auto is_playing() const -> bool {
+        return m_table.playing[m_row];
+    }
+
+    auto get_read() const -> double {
+        return m_table.read[m_row];
+    }
+
+    void set_read(double value) {
+        m_table.read[m_row] = value;
+    }
+
+    auto get_gain() const -> double {
+        return m_table.gain[m_row];
+    }
+
+    void set_gain_target(double value) {
+        m_table.gain_target[m_row] = value;
+    }
+
+    auto level() const -> LoudnessStats {
+        return m_clip.level((IdxType)start, (IdxType)stop);
+    }
 
     const AudioClip& clip() {
         return m_clip;
@@ -75,49 +134,48 @@ struct AudioSlice {
     }
 
     void start_playing() {
-        this->read = playback_profile.speed > 0 ? start : stop;
-        this->is_playing = true;
+        this->set_read(playback_profile.speed > 0 ? start : stop);
+        this->playback_profile.restart_voice();
+        m_table.set_playing(m_row, true);
     }
 
     void toggle_playing() {
-        is_playing = !is_playing;
+        m_table.set_playing(m_row, !is_playing());
+        if (!is_playing())
+            playback_profile.release_voice();
     }
     
-    auto get_sample(IdxType channel_idx, IdxType frame_idx) -> double {
-        // Pitch shift
-
-
-        const double attack_mult =
-            (attack > start && frame_idx < attack) ? (frame_idx - start) / (attack - start) : 1.0;
-
-        const double release_mult =
-            (release < stop && frame_idx > release) ? 1.0 - ((frame_idx - release) / (stop - release)) : 1.0;
+    void set_envelope_shape(SliceEnvelope::Shape shape) {
+        envelope.shape = shape;
+        update_data();
+    }
 
-        return attack_mult * release_mult * m_clip.get_sample(channel_idx, frame_idx);
+    auto get_sample(IdxType channel_idx, IdxType frame_idx) -> double {
+        return envelope.gain(frame_idx) * m_clip.get_sample(channel_idx, frame_idx);
     }
 
     auto read_frame() -> std::vector<double> {
         auto num_channels = m_clip.num_channels;
 
-        if (!is_playing) return std::vector<double>(num_channels, 0.0);
+        if (!is_playing()) return std::vector<double>(num_channels, 0.0);
 
         using namespace std::placeholders;
         auto result = playback_profile.read_frame(
             std::bind(get_sample, this, _1, _2),
             num_channels,
             m_clip.frame_rate_hz,
-            read,
-            start,
-            stop
+            m_table.read[m_row],
+            m_table.start[m_row],
+            m_table.stop[m_row]
         );
         
-        is_playing = !result.reached_end;
-        read = result.next;
+        m_table.playing[m_row] = !result.reached_end;
+        m_table.read[m_row] = result.next;
         return result.data;
     }
 
     auto get_text_title() const -> std::string {
-        int clip_slice_index = m_clip.find_consumer_by_name(consumer->name);
+        int clip_slice_index = m_clip.consumers.rank(*consumer);
         return fmt::format("clip{}-{}-[{}]", (int)m_clip.id, consumer->name, clip_slice_index);
     }
 
@@ -126,7 +184,7 @@ struct AudioSlice {
     }
 
     std::vector<Marker> get_markers() const {
-        auto read_ratio = float(read - start) / (stop - start);
+        auto read_ratio = float(get_read() - start) / (stop - start);
         auto attack_ratio = float(attack - start) / (stop - start);
         auto release_ratio = float(release - start) / (stop - start);
         return {
@@ -140,24 +198,133 @@ struct AudioSlice {
         return {};
     }
 
-    const DisplayBufferType& get_display_buf() const {
-        return m_display_buf;
+    const DisplayBuffer& get_display_buf() const {
+        return m_display_buf.read();
+    }
+
+    // epoch of the newest published display buffer, changes whenever a build lands
+    auto get_display_epoch() const -> uint64_t {
+        if (m_display_view.spectrogram) {
+            m_spectrogram_image.read();
+            return m_spectrogram_image.epoch();
+        }
+        m_display_buf.read();
+        return m_display_buf.epoch();
+    }
+
+    const SpectrogramImage& get_spectrogram_image() const {
+        return m_spectrogram_image.read();
+    }
+
+    void build_spectrogram() {
+        const double length = stop - start;
+        m_clip.request_spectrogram(
+            &m_spectrogram_image,
+            (IdxType)(start + m_display_view.begin * length),
+            (IdxType)std::ceil(start + m_display_view.end * length),
+            m_display_view.points
+        );
+    }
+
+    auto get_display_view() const -> DisplayView {
+        return m_display_view;
+    }
+
+    void set_display_view(DisplayView view) {
+        if (view != m_display_view) {
+            m_display_view = view;
+            m_display_generation.bump();
+        }
+    }
+
+    // the slice is drawn from the clip data, so clip changes make it stale as well
+    auto get_display_generation() const -> uint64_t {
+        return m_display_generation.get() + m_clip.get_display_generation();
+    }
+
+    auto is_display_stale() const -> bool {
+        return get_display_generation() != m_built_generation;
+    }
+
+    void mark_display_built() {
+        m_built_generation = get_display_generation();
+    }
+
+    void request_display_build() {
+        if (!is_display_stale())
+            return;
+        mark_display_built();
+        if (m_display_view.spectrogram)
+            build_spectrogram();
+        else
+            build_display_buf();
+    }
+
+    auto get_display_frames() const -> IdxType {
+        return (IdxType)(stop - start);
+    }
+
+    // slice builds are batched per clip, so slices of one clip share a single pass over its data
+    void build_display_buf() {
+        if (display_buffer_builder)
+            display_buffer_builder->build_batch(&m_clip, {display_build_args()}, WorkerPool::HIGH);
+    }
+
+    auto display_build_args() -> DisplayBufferBuilder::BuildArgs {
+        using namespace std::placeholders;
+
+        // the clip pyramid holds the raw data, the envelope is applied per display point
+        const double length = stop - start;
+        const auto storage = m_clip.shared_storage();
+        DisplayBufferBuilder::BuildArgs args {
+            storage->getter(),
+            &m_display_buf,
+            (IdxType)(start + m_display_view.begin * length),
+            (IdxType)std::ceil(start + m_display_view.end * length),
+            true
+        };
+        args.num_channels = m_clip.num_channels;
+        args.points = m_display_view.points;
+        args.pyramid = &storage->peaks;
+        args.source = storage;
+        // a copy, so the build never reads the envelope while the slice is edited
+        const SliceEnvelope envelope = this->envelope;
+        args.gain = [envelope](IdxType frame_idx) { return envelope.gain(frame_idx); };
+        return args;
+    }
+
+    void request_prerender() {
+        if (!prerenderer || stop - start > m_clip.frame_rate_hz * PRERENDER_MAX_SECONDS)
+            return;
+
+        auto args = PrerenderBuilder::RenderArgs::from_profile(playback_profile);
+        args.audio = m_clip.audio;
+        args.envelope = envelope;
+        args.apply_envelope = true;
+        args.num_channels = m_clip.num_channels;
+        args.frame_rate = m_clip.frame_rate_hz;
+        args.start = start;
+        args.stop = stop;
+        if (!prerenderer->render(args))
+            playback_profile.retry_prerender();
     }
 
-    void update_timer(float delta) {
+    // returns false once the slice has nothing left to do per sample
+    auto update_timer(float delta) -> bool {
         using namespace std::placeholders;
 
+        if (playback_profile.prerender_due(delta))
+            request_prerender();
+
         if (m_update_timer.process(delta) >= rage::UI_update_time) {
             if (needs_ui_update) {
-                m_clip.sort_consumers();
-                if (display_buffer_builder) {
-                    const auto get_sample_lambda = std::bind(&AudioSlice::get_sample, this, _1, _2);
-                    display_buffer_builder->build({get_sample_lambda, &m_display_buf, (IdxType)start, (IdxType)stop, true});
-                }
+                m_display_generation.bump();
                 needs_ui_update = false;
                 m_update_timer.reset();
             }
         }
+
+        return is_playing() || needs_ui_update || playback_profile.prerender_pending();
     }
 
     json_t* make_json_obj() {
@@ -170,9 +337,14 @@ struct AudioSlice {
         json_object_set(root, "stop", json_real(stop.value));
         json_object_set(root, "attack", json_real(attack.value));
         json_object_set(root, "release", json_real(release.value));
-        json_object_set(root, "read", json_real(read));
-        json_object_set(root, "is_playing", json_boolean(is_playing));
+        json_object_set(root, "read", json_real(get_read()));
+        json_object_set(root, "envelope_shape", json_integer((int)envelope.shape));
+        json_object_set(root, "is_playing", json_boolean(is_playing()));
         json_object_set(root, "playback_profile", playback_profile.make_json_obj());
+        if (pitch.analyzed)
+            json_object_set_new(root, "pitch", pitch.make_json_obj());
+        if (features.analyzed)
+            json_object_set_new(root, "features", features.make_json_obj());
 
         return root;
     }
@@ -184,13 +356,39 @@ struct AudioSlice {
         stop.value = json_real_value(json_object_get(root, "stop"));
         attack.value = json_real_value(json_object_get(root, "attack"));
         release.value = json_real_value(json_object_get(root, "release"));
-        read = json_real_value(json_object_get(root, "read"));
-        is_playing = json_boolean_value(json_object_get(root, "is_playing"));
+        set_read(json_real_value(json_object_get(root, "read")));
+        envelope.shape = (SliceEnvelope::Shape)clamp(
+            (int)json_integer_value(json_object_get(root, "envelope_shape")),
+            0,
+            SliceEnvelope::NUM_SHAPES - 1
+        );
+        envelope.configure(start, stop, attack, release);
+        m_table.set_range(m_row, start, stop, attack, release);
+        m_table.set_playing(m_row, json_boolean_value(json_object_get(root, "is_playing")));
         playback_profile.load_json(json_object_get(root, "playback_profile"));
+        if (json_t* estimate = json_object_get(root, "pitch"))
+            pitch.load_json(estimate, m_clip.content_version);
+        if (json_t* json_features = json_object_get(root, "features"))
+            features.load_json(json_features, m_clip.content_version);
         needs_ui_update = true;
+        m_table.activate(m_row);
     }
 
-    ~AudioSlice() {
+    // audio thread, unhooks the slice from its clip and the slice table so it can be destroyed on another thread
+    void detach() {
+        if (m_detached)
+            return;
         m_clip.remove_consumer(consumer);
+        m_table.release_row(m_row);
+        m_detached = true;
+    }
+
+    ~AudioSlice() {
+        WorkerPool::shared().cancel(&m_spectrogram_image);
+        if (display_buffer_builder)
+            display_buffer_builder->cancel(&m_display_buf);
+        if (prerenderer)
+            prerenderer->cancel(&playback_profile.render_cache);
+        detach();
     }
 };
\ No newline at end of file
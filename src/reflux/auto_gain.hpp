@@ -0,0 +1,152 @@
+#pragma once
+#include <stdint.h>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "audio_clip.hpp"
+#include "loudness.hpp"
+#include "slice_table.hpp"
+
+/*
+Gains that bring clips and slices to a loudness target, measured on the worker pool.
+The audio thread hands over the ranges to measure in preallocated slots, the task publishes a gain for each and
+the audio thread takes them as targets that playback slews towards, so a new measurement never steps the output.
+With auto gain off nothing is measured, every range gets unit gain.
+Whole clips and long slices are read from the loudness track of their clip. Short slices are measured directly
+from the samples, where the 100 ms steps of the track would be off by most of a step on either edge, and are
+only measured again when they change.
+*/
+
+struct AutoGain {
+    enum { MAX_RANGES = 64 + SliceTable::RESERVED_ROWS };
+    enum { SLEW_MS = 50 };  // time constant of the slew towards a new gain
+    enum { DIRECT_SECONDS = 10 };  // slices up to this long are measured from their samples
+
+    struct Range {
+        const AudioClip* clip = nullptr;
+        uint64_t version = 0;  // content version of the clip
+        IdxType start = 0;
+        IdxType stop = 0;
+        IdxType num_channels = 0;
+        IdxType frame_rate = 0;
+        uint32_t index = 0;  // clip index, or slice table row
+        bool is_clip = false;
+        bool settled = false;  // the samples are stored and published, they can be measured directly
+    };
+
+    struct Gain {
+        Range range;
+        float gain = 1.f;
+    };
+
+  private:
+    struct Ranges {
+        std::vector<Range> ranges = std::vector<Range>(MAX_RANGES);
+        size_t count = 0;
+        double target = 0.0;  // LUFS, 0 is off
+    };
+
+    struct Measured {
+        Range range;
+        LoudnessStats level;
+    };
+
+    rage::TripleBuffer<Ranges> requested;
+    rage::TripleBuffer<std::vector<Gain>> measured;
+    std::vector<Measured> direct;  // worker only, by slice table row
+    uint64_t taken_epoch = 0;  // audio thread only
+
+    auto level_of(const Range& range) -> LoudnessStats {
+        const bool is_short = range.stop - range.start <= (IdxType)DIRECT_SECONDS * range.frame_rate;
+        if (range.is_clip || !range.settled || !is_short || range.stop <= range.start)
+            return range.clip->level(range.start, range.stop);
+
+        if (direct.size() <= range.index)
+            direct.resize(range.index + 1);
+        Measured& cached = direct[range.index];
+        const Range& last = cached.range;
+        if (last.clip == range.clip && last.version == range.version && last.start == range.start
+            && last.stop == range.stop)
+            return cached.level;
+
+        const auto storage = range.clip->shared_storage();
+        const IdxType stop = std::min(range.stop, storage->capacity());
+        cached.range = range;
+        cached.level =
+            LoudnessTrack::measure(storage->getter(), range.num_channels, range.frame_rate, range.start, stop);
+        return cached.level;
+    }
+
+    void run() {
+        const Ranges& in = requested.read();
+        std::vector<Gain>& out = measured.back();
+        out.clear();
+        for (size_t idx = 0; idx < in.count; idx++) {
+            Gain gain;
+            gain.range = in.ranges[idx];
+            gain.gain = in.target == 0.0 ? 1.f : (float)gain_for(level_of(gain.range), in.target);
+            out.push_back(gain);
+        }
+        measured.publish();
+    }
+
+  public:
+    ~AutoGain() {
+        rage::WorkerPool::shared().cancel_owner(this);
+    }
+
+    // gain that brings level to target, boosts stop short of clipping full scale
+    static auto gain_for(const LoudnessStats& level, double target) -> double {
+        if (target == 0.0 || !level.valid())
+            return 1.0;
+        const double gain = std::pow(10.0, (target - level.lufs) / 20.0);
+        const double headroom = level.peak > 0.0 ? std::max(1.0, 1.0 / level.peak) : 1.0;
+        return clamp(gain, 1.0 / 16, std::min(headroom, 4.0));
+    }
+
+    // audio thread, frames [start, stop) of clip
+    static auto range_of(const AudioClip& clip, IdxType start, IdxType stop, uint32_t index, bool is_clip) -> Range {
+        Range range;
+        range.clip = &clip;
+        range.version = clip.content_version;
+        range.start = start;
+        range.stop = stop;
+        range.num_channels = clip.num_channels;
+        range.frame_rate = clip.frame_rate_hz;
+        range.index = index;
+        range.is_clip = is_clip;
+        range.settled = clip.has_samples() && !clip.is_recording && clip.audio_published;
+        return range;
+    }
+
+    // audio thread, starts collecting the ranges of the next request
+    void begin(double target) {
+        Ranges& ranges = requested.back();
+        ranges.count = 0;
+        ranges.target = target;
+    }
+
+    // audio thread, ranges past MAX_RANGES keep their gain
+    void add(const Range& range) {
+        Ranges& ranges = requested.back();
+        if (ranges.count < ranges.ranges.size())
+            ranges.ranges[ranges.count++] = range;
+    }
+
+    // audio thread, false when the pool queue is full, the ranges are then measured with the next request
+    auto request() -> bool {
+        requested.publish();
+        return rage::WorkerPool::shared().post(this, [this] { run(); }, rage::WorkerPool::LOW, this);
+    }
+
+    // audio thread, the gains measured since the last call or nullptr
+    auto take() -> const std::vector<Gain>* {
+        const std::vector<Gain>& gains = measured.read();
+        if (measured.epoch() == taken_epoch)
+            return nullptr;
+        taken_epoch = measured.epoch();
+        return &gains;
+    }
+};
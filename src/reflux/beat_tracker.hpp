@@ -0,0 +1,274 @@
+#pragma once
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "onset_detector.hpp"
+#include "peak_sidecar.hpp"
+
+/*
+References:
+    - Ellis, "Beat tracking by dynamic programming" (onset envelope autocorrelation, log gaussian tempo prior)
+    - Scheirer, "Tempo and beat analysis of acoustic musical signals" (comb filter scoring)
+
+The tempo is the lag of the onset envelope autocorrelation that scores best together with its first multiples
+(a comb over the autocorrelation), weighted towards 120 BPM. The period is then refined to a fraction of an
+envelope step and the phase picked by summing the envelope under a pulse train over the whole clip, so long
+loops do not drift off the grid.
+*/
+
+struct BeatGrid {
+    double period = 0.0;  // seconds per beat, 0 when no tempo was found
+    double offset = 0.0;  // seconds of one beat, the others are whole periods away
+
+    auto valid() const -> bool {
+        return period > 0.0;
+    }
+
+    auto bpm() const -> double {
+        return valid() ? 60.0 / period : 0.0;
+    }
+
+    // frames of every step-th beat in (start, stop), counted from the first beat after start
+    auto beat_frames(double frame_rate, IdxType start, IdxType stop, int step = 1) const -> std::vector<IdxType> {
+        std::vector<IdxType> frames;
+        if (!valid() || frame_rate <= 0.0 || step < 1)
+            return frames;
+        const double period_frames = period * frame_rate;
+        const double anchor = offset * frame_rate;
+        const double first = anchor + std::floor((start - anchor) / period_frames + 1.0) * period_frames;
+        for (double frame = first; frame < stop; frame += period_frames * step) {
+            if (frame > start)
+                frames.push_back((IdxType)std::round(frame));
+        }
+        return frames;
+    }
+
+    json_t* make_json_obj() const {
+        json_t* root = json_object();
+        json_object_set_new(root, "period", json_real(period));
+        json_object_set_new(root, "offset", json_real(offset));
+        return root;
+    }
+
+    void load_json(json_t* root) {
+        period = json_real_value(json_object_get(root, "period"));
+        offset = json_real_value(json_object_get(root, "offset"));
+    }
+};
+
+struct BeatTracker {
+    enum { MIN_BPM = 60 };
+    enum { MAX_BPM = 200 };
+    enum { COMB_MULTIPLES = 4 };
+    enum { CACHE_VERSION = 1 };
+
+    static auto detect(const OnsetDetector::Args& args) -> BeatGrid {
+        BeatGrid grid;
+        const std::vector<float> envelope = smooth(OnsetDetector::onset_envelope(args));
+        const double rate = (double)args.frame_rate / OnsetDetector::HOP;  // envelope values per second
+        const size_t size = envelope.size();
+        const size_t min_lag = std::max<size_t>((size_t)(rate * 60.0 / MAX_BPM), 1);
+        const size_t max_lag = std::min<size_t>((size_t)std::ceil(rate * 60.0 / MIN_BPM), size / 2);
+        if (max_lag <= min_lag)
+            return grid;
+
+        // autocorrelation of the envelope without its mean
+        double mean = 0.0;
+        for (float value : envelope) {
+            mean += value;
+        }
+        mean /= size;
+        const size_t max_comb_lag = std::min(max_lag * COMB_MULTIPLES, size - 1);
+        std::vector<double> acf(max_comb_lag + 1, 0.0);
+        for (size_t lag = min_lag; lag <= max_comb_lag; lag++) {
+            double sum = 0.0;
+            for (size_t n = 0; n + lag < size; n++) {
+                sum += (envelope[n] - mean) * (envelope[n + lag] - mean);
+            }
+            acf[lag] = sum / (size - lag);
+        }
+
+        size_t best_lag = 0;
+        double best_score = 0.0;
+        for (size_t lag = min_lag; lag <= max_lag; lag++) {
+            double score = 0.0;
+            for (size_t k = 1; k <= COMB_MULTIPLES && k * lag <= max_comb_lag; k++) {
+                score += acf[k * lag];
+            }
+            // a beat period also correlates at its multiples, the prior keeps the tempo in a usual range
+            const double octaves = std::log2(60.0 * rate / lag / 120.0);
+            score *= std::exp(-0.5 * octaves * octaves);
+            if (score > best_score) {
+                best_score = score;
+                best_lag = lag;
+            }
+        }
+        if (best_lag == 0)
+            return grid;
+
+        // linear interpolation between envelope values, 0 past the end
+        auto sample = [&](double pos) -> double {
+            const size_t idx = (size_t)pos;
+            if (idx + 1 >= size)
+                return idx < size ? envelope[idx] : 0.0;
+            const double frac = pos - idx;
+            return envelope[idx] + (envelope[idx + 1] - envelope[idx]) * frac;
+        };
+
+        // pulse train over the whole clip around the coarse lag, mean envelope under the pulses
+        double best_period = best_lag;
+        double best_phase = 0.0;
+        double best_pulse = -1.0;
+        for (double period = best_lag - 1.0; period <= best_lag + 1.0; period += 0.02) {
+            for (double phase = 0.0; phase < period; phase += 0.25) {
+                double sum = 0.0;
+                size_t count = 0;
+                for (double pos = phase; pos < size; pos += period) {
+                    sum += sample(pos);
+                    count += 1;
+                }
+                const double pulse = count ? sum / count : 0.0;
+                if (pulse > best_pulse) {
+                    best_pulse = pulse;
+                    best_period = period;
+                    best_phase = phase;
+                }
+            }
+        }
+
+        // flux value n peaks for an onset near the middle of its window
+        const double beat_frame = args.start + best_phase * OnsetDetector::HOP + OnsetDetector::FFT_SIZE / 2;
+        grid.period = best_period * OnsetDetector::HOP / args.frame_rate;
+        grid.offset = beat_frame / args.frame_rate;
+        return grid;
+    }
+
+    // onsets a fraction of an envelope step apart land on neighbouring values, a short triangle spreads them so
+    // the autocorrelation does not split a fractional period over two lags
+    static auto smooth(const std::vector<float>& envelope) -> std::vector<float> {
+        static const float taps[] = {1.f / 9, 2.f / 9, 3.f / 9, 2.f / 9, 1.f / 9};
+        std::vector<float> smoothed(envelope.size(), 0.f);
+        for (size_t n = 0; n < envelope.size(); n++) {
+            for (size_t t = 0; t < 5; t++) {
+                if (n + t >= 2 && n + t - 2 < envelope.size())
+                    smoothed[n] += taps[t] * envelope[n + t - 2];
+            }
+        }
+        return smoothed;
+    }
+
+    // grids of files seen before are kept next to their peak sidecars
+    static auto read_cache(const std::string& path, BeatGrid& grid) -> bool {
+        const std::string cache = PeakSidecar::cache_path(path, "beats");
+        if (cache.empty())
+            return false;
+        json_t* root = json_load_file(cache.c_str(), 0, nullptr);
+        if (!root)
+            return false;
+        const bool ok = json_integer_value(json_object_get(root, "version")) == CACHE_VERSION;
+        if (ok)
+            grid.load_json(root);
+        json_decref(root);
+        return ok;
+    }
+
+    static auto write_cache(const std::string& path, const BeatGrid& grid) -> bool {
+        const std::string cache = PeakSidecar::cache_path(path, "beats");
+        if (cache.empty())
+            return false;
+        rack::system::createDirectories(PeakSidecar::cache_dir());
+        json_t* root = grid.make_json_obj();
+        json_object_set_new(root, "version", json_integer(CACHE_VERSION));
+        const bool ok = json_dump_file(root, cache.c_str(), 0) == 0;
+        json_decref(root);
+        return ok;
+    }
+
+  private:
+    std::mutex mutex;
+    std::unique_ptr<BeatGrid> result;
+    uint64_t result_id = 0;
+    std::atomic<uint64_t> latest {0};
+    std::atomic<bool> ready {false};
+    std::atomic<bool> busy {false};
+
+  public:
+    BeatTracker() = default;
+
+    // copies start out idle
+    BeatTracker(const BeatTracker&) {}
+
+    BeatTracker& operator=(const BeatTracker&) {
+        abandon();
+        return *this;
+    }
+
+    ~BeatTracker() {
+        rage::WorkerPool::shared().cancel_owner(this);
+    }
+
+    auto is_busy() const -> bool {
+        return busy;
+    }
+
+    // tracks the beats of args on the pool, through the cache when path names the file the audio came from.
+    // args.audio is read on the pool, reading stops early once the analysis is abandoned
+    void analyze(const OnsetDetector::Args& args, const std::string& path) {
+        const uint64_t id = ++latest;
+        busy = true;
+        OnsetDetector::Args tracked = args;
+        tracked.latest = &latest;
+        tracked.id = id;
+        auto task = [this, id, tracked, path] {
+            std::unique_ptr<BeatGrid> grid(new BeatGrid());
+            if (path.empty() || !read_cache(path, *grid)) {
+                *grid = detect(tracked);
+                // a cut short analysis is neither cached nor delivered
+                if (tracked.abandoned())
+                    return;
+                if (!path.empty())
+                    write_cache(path, *grid);
+            }
+
+            // the grid replaced here is a stale one, it is freed on this worker
+            std::lock_guard<std::mutex> lock(mutex);
+            if (id != latest)
+                return;
+            result.swap(grid);
+            result_id = id;
+            ready = true;
+        };
+        if (!rage::WorkerPool::shared().post(this, std::move(task), rage::WorkerPool::LOW, this))
+            busy = false;
+    }
+
+    // Drops a running analysis, which stops reading audio and is ignored when it finishes anyway.
+    // Audio thread safe: it never waits and a stale result is left to be freed by the next analysis
+    void abandon() {
+        latest += 1;
+        ready = false;
+        busy = false;
+    }
+
+    // audio thread, never waits on the lock or frees. copies a finished grid into dst
+    auto take(BeatGrid& dst) -> bool {
+        if (!ready)
+            return false;
+        std::unique_lock<std::mutex> lock(mutex, std::try_to_lock);
+        if (!lock.owns_lock() || !ready)
+            return false;
+        ready = false;
+        if (result_id != latest)
+            return false;
+        busy = false;
+        dst = *result;
+        return true;
+    }
+};
@@ -0,0 +1,177 @@
+#pragma once
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "audio_base.hpp"
+#include "peak_pyramid.hpp"
+
+/*
+Samples and peaks of a clip, shared with the background work that reads them.
+The channels are allocated for their whole capacity when the storage is made and never resized, so a task
+holding a reference can keep reading while the audio thread records into frames it has room for. Replacing
+the audio (loading, clearing, recording past the capacity) swaps other storage into the clip, the previous
+one stays alive until the last task reading it is done and is let go of on the worker pool.
+*/
+
+struct ClipAudio {
+    using Getter = std::function<double(IdxType, IdxType)>;
+
+    std::vector<std::vector<double>> channels;  // [channel][frame], capacity frames each
+    PeakPyramid peaks;  // reserved for the capacity
+
+    ClipAudio() = default;
+
+    ClipAudio(IdxType num_channels, IdxType capacity) : channels(num_channels, std::vector<double>(capacity, 0.0)) {
+        peaks.reserve(num_channels, capacity);
+    }
+
+    // storage of cleared clips, made once so clearing never allocates
+    static auto empty() -> const std::shared_ptr<ClipAudio>& {
+        static const std::shared_ptr<ClipAudio> storage = std::make_shared<ClipAudio>();
+        return storage;
+    }
+
+    // copy of the first num_frames frames of from, with room for capacity frames of num_channels
+    static auto grown(const ClipAudio& from, IdxType num_frames, IdxType num_channels, IdxType capacity)
+        -> std::shared_ptr<ClipAudio> {
+        num_channels = std::max(num_channels, from.num_channels());
+        capacity = std::max(capacity, from.capacity());
+        num_frames = std::min(num_frames, from.capacity());
+        auto storage = std::make_shared<ClipAudio>();
+        storage->channels.resize(num_channels);
+        for (IdxType cidx = 0; cidx < num_channels; cidx++) {
+            auto& channel = storage->channels[cidx];
+            channel.reserve(capacity);
+            if (cidx < from.num_channels())
+                channel.assign(from.channels[cidx].begin(), from.channels[cidx].begin() + num_frames);
+            channel.resize(capacity, 0.0);
+        }
+        // from is still being recorded into, its peaks are summarized again rather than copied
+        storage->peaks.rebuild(storage->getter(), num_channels, num_frames);
+        storage->peaks.reserve(num_channels, capacity);
+        return storage;
+    }
+
+    auto num_channels() const -> IdxType {
+        return channels.size();
+    }
+
+    auto capacity() const -> IdxType {
+        return channels.empty() ? 0 : channels[0].size();
+    }
+
+    // previews only have peaks
+    auto has_samples() const -> bool {
+        return capacity() > 0;
+    }
+
+    auto get_sample(IdxType channel_idx, IdxType frame_idx) const -> double {
+        if (channel_idx >= channels.size() || frame_idx >= channels[channel_idx].size())
+            return 0;
+        return channels[channel_idx][frame_idx];
+    }
+
+    // reads this storage directly, whoever calls it has to keep a reference to the storage. only a pointer is
+    // captured, which std::function holds without allocating
+    auto getter() const -> Getter {
+        const ClipAudio* audio = this;
+        return [audio](IdxType channel_idx, IdxType frame_idx) { return audio->get_sample(channel_idx, frame_idx); };
+    }
+};
+
+// Hands bigger storage made on the pool over to the audio thread, only the newest request is ever delivered
+struct ClipAudioGrowth {
+  private:
+    std::mutex mutex;
+    std::shared_ptr<ClipAudio> result;
+    uint64_t result_id = 0;
+    std::atomic<uint64_t> latest {0};
+    std::atomic<bool> ready {false};
+
+  public:
+    ClipAudioGrowth() = default;
+
+    // copies start out empty
+    ClipAudioGrowth(const ClipAudioGrowth&) {}
+
+    ClipAudioGrowth& operator=(const ClipAudioGrowth&) {
+        abandon();
+        return *this;
+    }
+
+    // returns the id the growth has to finish with
+    auto start() -> uint64_t {
+        return ++latest;
+    }
+
+    // audio thread safe, a late finish of the current growth is ignored
+    void abandon() {
+        latest += 1;
+        ready = false;
+    }
+
+    // the storage replaced here is a stale one, so it is let go of on the calling worker
+    void finish(uint64_t id, std::shared_ptr<ClipAudio> storage) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (id != latest)
+            return;
+        result.swap(storage);
+        result_id = id;
+        ready = true;
+    }
+
+    // audio thread, never waits on the lock. swaps the storage into dst, whatever dst held is released later
+    // by the next finish
+    auto take(std::shared_ptr<ClipAudio>& dst) -> bool {
+        if (!ready)
+            return false;
+        std::unique_lock<std::mutex> lock(mutex, std::try_to_lock);
+        if (!lock.owns_lock() || !ready)
+            return false;
+        ready = false;
+        if (result_id != latest)
+            return false;
+        result.swap(dst);
+        return true;
+    }
+};
+
+// The storage as seen by threads other than the audio thread. The audio thread publishes without ever waiting
+// on the lock, readers only hold it to copy the pointer.
+struct ClipAudioPublisher {
+  private:
+    mutable std::mutex mutex;
+    std::shared_ptr<const ClipAudio> current = ClipAudio::empty();
+
+  public:
+    ClipAudioPublisher() = default;
+
+    // copies start out with the empty storage until their owner publishes, like the clips holding them
+    ClipAudioPublisher(const ClipAudioPublisher&) {}
+
+    ClipAudioPublisher& operator=(const ClipAudioPublisher&) {
+        std::lock_guard<std::mutex> lock(mutex);
+        current = ClipAudio::empty();
+        return *this;
+    }
+
+    // audio thread, false when a reader held the lock. storage is left with the previously published one
+    auto publish(std::shared_ptr<const ClipAudio>& storage) -> bool {
+        std::unique_lock<std::mutex> lock(mutex, std::try_to_lock);
+        if (!lock.owns_lock())
+            return false;
+        current.swap(storage);
+        return true;
+    }
+
+    auto read() const -> std::shared_ptr<const ClipAudio> {
+        std::lock_guard<std::mutex> lock(mutex);
+        return current;
+    }
+};
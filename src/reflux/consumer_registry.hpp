@@ -0,0 +1,130 @@
+#pragma once
+#include <stdint.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "audio_base.hpp"
+
+/*
+Consumers of a clip (its slices) by integer id, with an index sorted by marker position that is updated in
+place as markers move. During a bulk insert (patch load, auto slicing) the index is left alone and rebuilt
+once at the end, so adding n consumers costs O(n log n) instead of a sort per insert.
+*/
+
+struct ConsumerRegistry {
+    using Id = AudioConsumer::Id;
+    using Stored = std::shared_ptr<AudioConsumer>;
+
+  private:
+    using Key = std::pair<double, Id>;  // marker position, ties broken by id
+
+    std::unordered_map<Id, Stored> by_id;
+    std::vector<Key> order;
+    Id next_id = 0;
+    int bulk_depth = 0;
+
+    static auto key_of(const AudioConsumer& consumer) -> Key {
+        return {consumer.marker.pos, consumer.id};
+    }
+
+    void index_insert(const Key& key) {
+        order.insert(std::lower_bound(order.begin(), order.end(), key), key);
+    }
+
+    void index_erase(const Key& key) {
+        auto it = std::lower_bound(order.begin(), order.end(), key);
+        if (it != order.end() && *it == key)
+            order.erase(it);
+    }
+
+    void rebuild_index() {
+        order.clear();
+        order.reserve(by_id.size());
+        for (const auto& entry : by_id) {
+            order.push_back(key_of(*entry.second));
+        }
+        std::sort(order.begin(), order.end());
+    }
+
+  public:
+    // four letters that look random but never repeat, multiplying by a unit mod 26^4 is a permutation
+    static auto name_for(Id id) -> std::string {
+        const uint64_t space = 26 * 26 * 26 * 26;
+        uint64_t code = ((uint64_t)id * 7919 + 104729) % space;
+        std::string name(4, 'a');
+        for (int i = 3; i >= 0; i--) {
+            name[i] = (char)('a' + code % 26);
+            code /= 26;
+        }
+        return name;
+    }
+
+    auto create(double pos, const std::string& tag, AudioConsumer::NotificationListener on_notify) -> Stored {
+        const Id id = next_id++;
+        auto consumer = std::make_shared<AudioConsumer>(id, name_for(id), pos, tag, on_notify);
+        by_id.emplace(id, consumer);
+        if (bulk_depth == 0)
+            index_insert(key_of(*consumer));
+        return consumer;
+    }
+
+    void remove(Id id) {
+        auto it = by_id.find(id);
+        if (it == by_id.end())
+            return;
+        if (bulk_depth == 0)
+            index_erase(key_of(*it->second));
+        by_id.erase(it);
+    }
+
+    auto find(Id id) const -> Stored {
+        auto it = by_id.find(id);
+        return it == by_id.end() ? nullptr : it->second;
+    }
+
+    // moves the marker of a consumer and its place in the index
+    void set_marker(AudioConsumer& consumer, double pos, const std::string& tag) {
+        consumer.marker.tag = tag;
+        if (consumer.marker.pos == pos)
+            return;
+        if (bulk_depth == 0)
+            index_erase(key_of(consumer));
+        consumer.marker.pos = pos;
+        if (bulk_depth == 0)
+            index_insert(key_of(consumer));
+    }
+
+    // position of a consumer in marker order, -1 if it is not registered
+    auto rank(const AudioConsumer& consumer) const -> int {
+        if (bulk_depth > 0)
+            return -1;
+        const Key key = key_of(consumer);
+        auto it = std::lower_bound(order.begin(), order.end(), key);
+        return it != order.end() && *it == key ? (int)(it - order.begin()) : -1;
+    }
+
+    void begin_bulk() {
+        bulk_depth += 1;
+    }
+
+    void end_bulk() {
+        bulk_depth -= 1;
+        if (bulk_depth == 0)
+            rebuild_index();
+    }
+
+    auto size() const -> size_t {
+        return by_id.size();
+    }
+
+    void notify_all() {
+        for (auto& entry : by_id) {
+            entry.second->notify();
+        }
+    }
+};
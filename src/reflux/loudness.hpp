@@ -0,0 +1,317 @@
+#pragma once
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include "audio_base.hpp"
+
+/*
+References:
+    - ITU-R BS.1770-4, "Algorithms to measure audio programme loudness and true-peak audio level"
+    - EBU Tech 3341 (gated integrated loudness)
+
+Per clip level track next to the peak data: for every 100 ms step the sample peak, the mean square and the
+K-weighted mean square summed over channels. Up to four channels are filtered at once, one per float_4 lane.
+Built on the worker pool, appended audio only adds steps, overwritten audio re-scans from the step before the
+first changed frame so the filters settle again. Peak, RMS and gated integrated loudness of any range are then
+read from the steps it covers, 400 ms blocks with 75% overlap as in BS.1770. Steps on the edges of a range count
+for the frames they share with it. Short ranges are better measured directly, with steps starting at the range.
+*/
+
+struct LoudnessStats {
+    double peak = 0.0;  // linear
+    double rms = 0.0;  // linear
+    double lufs = -std::numeric_limits<double>::infinity();
+
+    auto valid() const -> bool {
+        return std::isfinite(lufs);
+    }
+
+    static auto to_db(double value) -> double {
+        return 20.0 * std::log10(std::max(value, 1e-9));
+    }
+
+    auto describe() const -> std::string {
+        if (!valid())
+            return "silent";
+        return fmt::format("peak {:.1f}dB, rms {:.1f}dB, {:.1f} LUFS", to_db(peak), to_db(rms), lufs);
+    }
+};
+
+struct LoudnessTrack {
+    enum { STEPS_PER_BLOCK = 4 };  // 400 ms blocks moving in 100 ms steps
+
+    struct Step {
+        float peak = 0.f;
+        float square = 0.f;  // mean over the step, summed over channels
+        float weighted = 0.f;  // same after K-weighting
+        uint32_t frames = 0;
+    };
+
+    struct Steps {
+        std::vector<Step> steps;
+        IdxType step_frames = 1;
+        IdxType num_channels = 0;
+    };
+
+    using FrameGetter = std::function<double(uintptr_t, uintptr_t)>;
+
+  private:
+    std::shared_ptr<const Steps> published = std::make_shared<const Steps>();
+    std::atomic<uint64_t> dirty_frame {0};
+    uint64_t scanned_frames = 0;  // worker only
+
+    auto snapshot() const -> std::shared_ptr<const Steps> {
+        return std::atomic_load(&published);
+    }
+
+    // direct form II transposed biquad over four channels
+    struct Biquad {
+        double b0 = 1, b1 = 0, b2 = 0, a1 = 0, a2 = 0;
+        rack::simd::float_4 z1 = 0.f;
+        rack::simd::float_4 z2 = 0.f;
+
+        auto process(rack::simd::float_4 x) -> rack::simd::float_4 {
+            const rack::simd::float_4 y = (float)b0 * x + z1;
+            z1 = (float)b1 * x - (float)a1 * y + z2;
+            z2 = (float)b2 * x - (float)a2 * y;
+            return y;
+        }
+    };
+
+    // the BS.1770 pre filter (high shelf) and RLB high pass for any frame rate
+    static void k_weighting(double frame_rate, Biquad& shelf, Biquad& highpass) {
+        {
+            const double f0 = 1681.974450955533;
+            const double gain_db = 3.999843853973347;
+            const double q = 0.7071752369554196;
+            const double k = std::tan(M_PI * f0 / frame_rate);
+            const double vh = std::pow(10.0, gain_db / 20.0);
+            const double vb = std::pow(vh, 0.4996667741545416);
+            const double a0 = 1.0 + k / q + k * k;
+            shelf.b0 = (vh + vb * k / q + k * k) / a0;
+            shelf.b1 = 2.0 * (k * k - vh) / a0;
+            shelf.b2 = (vh - vb * k / q + k * k) / a0;
+            shelf.a1 = 2.0 * (k * k - 1.0) / a0;
+            shelf.a2 = (1.0 - k / q + k * k) / a0;
+        }
+        {
+            const double f0 = 38.13547087602444;
+            const double q = 0.5003270373238773;
+            const double k = std::tan(M_PI * f0 / frame_rate);
+            const double a0 = 1.0 + k / q + k * k;
+            highpass.b0 = 1.0;
+            highpass.b1 = -2.0;
+            highpass.b2 = 1.0;
+            highpass.a1 = 2.0 * (k * k - 1.0) / a0;
+            highpass.a2 = (1.0 - k / q + k * k) / a0;
+        }
+    }
+
+    // fills the steps of track from first_step on with the frames [offset, end), the step before first_step only
+    // lets the filters settle. steps before first_step are kept
+    static void scan(
+        const FrameGetter& get_sample,
+        IdxType frame_rate,
+        IdxType offset,
+        IdxType end,
+        size_t first_step,
+        Steps& track
+    ) {
+        using rack::simd::float_4;
+        const IdxType step_frames = track.step_frames;
+        const IdxType num_channels = track.num_channels;
+        const size_t num_steps = end > offset ? (end - offset + step_frames - 1) / step_frames : 0;
+        track.steps.resize(std::min(first_step, num_steps));
+        track.steps.resize(num_steps);
+
+        const size_t warmup_step = first_step > 0 ? first_step - 1 : first_step;
+        for (IdxType group = 0; group < num_channels; group += 4) {
+            Biquad shelf;
+            Biquad highpass;
+            k_weighting(frame_rate, shelf, highpass);
+            const IdxType lanes = std::min<IdxType>(num_channels - group, 4);
+            for (size_t step = warmup_step; step < num_steps; step++) {
+                const IdxType begin = offset + step * step_frames;
+                const IdxType stop = std::min<IdxType>(begin + step_frames, end);
+                float_4 peak = 0.f;
+                float_4 square = 0.f;
+                float_4 weighted = 0.f;
+                for (IdxType fidx = begin; fidx < stop; fidx++) {
+                    float_4 x = 0.f;
+                    for (IdxType lane = 0; lane < lanes; lane++) {
+                        x[lane] = (float)get_sample(group + lane, fidx);
+                    }
+                    const float_4 k = highpass.process(shelf.process(x));
+                    peak = rack::simd::fmax(peak, rack::simd::abs(x));
+                    square += x * x;
+                    weighted += k * k;
+                }
+                if (step < first_step)
+                    continue;
+                Step& out = track.steps[step];
+                const float frames = (float)(stop - begin);
+                out.frames = (uint32_t)(stop - begin);
+                for (IdxType lane = 0; lane < lanes; lane++) {
+                    out.peak = std::max(out.peak, peak[lane]);
+                    out.square += square[lane] / frames;
+                    out.weighted += weighted[lane] / frames;
+                }
+            }
+        }
+    }
+
+    // levels of frames [start, stop) from steps that begin at offset
+    static auto summarize(const Steps& track, IdxType offset, IdxType start, IdxType stop) -> LoudnessStats {
+        LoudnessStats result;
+        start = std::max(start, offset);
+        if (track.steps.empty() || track.num_channels == 0 || stop <= start)
+            return result;
+
+        const IdxType step_frames = track.step_frames;
+        const size_t first = std::min<size_t>((start - offset) / step_frames, track.steps.size());
+        const size_t last = std::min<size_t>((stop - offset + step_frames - 1) / step_frames, track.steps.size());
+        // frames of a step inside the range, only the peak is that of the whole step
+        auto covered = [&](size_t step) {
+            const IdxType begin = offset + step * step_frames;
+            const IdxType end = begin + track.steps[step].frames;
+            const IdxType from = std::max(begin, start);
+            const IdxType to = std::min(end, stop);
+            return to > from ? (double)(to - from) : 0.0;
+        };
+
+        double square = 0.0;
+        double frames = 0.0;
+        for (size_t step = first; step < last; step++) {
+            const Step& s = track.steps[step];
+            result.peak = std::max<double>(result.peak, s.peak);
+            square += (double)s.square * covered(step);
+            frames += covered(step);
+        }
+        if (frames == 0.0)
+            return result;
+        result.rms = std::sqrt(square / frames / track.num_channels);
+
+        // mean square of each block, ranges shorter than a block are one block
+        std::vector<double> blocks;
+        const size_t block_steps = std::min<size_t>(STEPS_PER_BLOCK, last - first);
+        for (size_t begin = first; begin + block_steps <= last; begin++) {
+            double sum = 0.0;
+            double count = 0.0;
+            for (size_t step = begin; step < begin + block_steps; step++) {
+                sum += (double)track.steps[step].weighted * covered(step);
+                count += covered(step);
+            }
+            blocks.push_back(count > 0.0 ? sum / count : 0.0);
+        }
+
+        auto loudness = [](double mean_square) { return -0.691 + 10.0 * std::log10(std::max(mean_square, 1e-20)); };
+        auto gated_mean = [&](double gate) {
+            double sum = 0.0;
+            size_t count = 0;
+            for (double block : blocks) {
+                if (loudness(block) > gate) {
+                    sum += block;
+                    count += 1;
+                }
+            }
+            return count ? sum / count : 0.0;
+        };
+
+        // absolute gate at -70 LUFS, then relative gate 10 LU under the loudness of what passed
+        const double absolute = gated_mean(-70.0);
+        if (absolute <= 0.0)
+            return result;
+        const double relative = gated_mean(std::max(-70.0, loudness(absolute) - 10.0));
+        if (relative > 0.0)
+            result.lufs = loudness(relative);
+        return result;
+    }
+
+    void build(const FrameGetter& get_sample, IdxType num_channels, IdxType num_frames, IdxType frame_rate) {
+        const uint64_t dirty = dirty_frame.exchange(std::numeric_limits<uint64_t>::max());
+        const std::shared_ptr<const Steps> previous = snapshot();
+        const IdxType step_frames = std::max<IdxType>(frame_rate / 10, 1);
+
+        const bool same_layout = previous->step_frames == step_frames && previous->num_channels == num_channels;
+        if (same_layout && dirty == std::numeric_limits<uint64_t>::max() && scanned_frames == num_frames)
+            return;
+
+        // a new layout starts over, otherwise the last (maybe partial) step is always redone
+        const uint64_t from = same_layout ? std::min(scanned_frames, dirty) : 0;
+        size_t first_step = std::min<size_t>(from / step_frames, previous->steps.size());
+        if (first_step > 0 && first_step == previous->steps.size())
+            first_step -= 1;
+
+        std::shared_ptr<Steps> track = std::make_shared<Steps>();
+        track->step_frames = step_frames;
+        track->num_channels = num_channels;
+        track->steps.assign(previous->steps.begin(), previous->steps.begin() + first_step);
+        scan(get_sample, frame_rate, 0, num_frames, first_step, *track);
+
+        scanned_frames = num_frames;
+        std::atomic_store(&published, std::shared_ptr<const Steps>(std::move(track)));
+    }
+
+  public:
+    LoudnessTrack() = default;
+
+    // copies start out empty and are rebuilt on the next request
+    LoudnessTrack(const LoudnessTrack&) {}
+
+    LoudnessTrack& operator=(const LoudnessTrack&) {
+        invalidate_from(0);
+        return *this;
+    }
+
+    // marks audio from frame on as changed, cheap enough for the audio thread
+    void invalidate_from(uint64_t frame) {
+        uint64_t current = dirty_frame.load(std::memory_order_relaxed);
+        while (frame < current && !dirty_frame.compare_exchange_weak(current, frame)) {
+        }
+    }
+
+    // scans new or changed audio of source (anything with get_sample(channel, frame)) in the background and keeps
+    // it alive until the build is done. audio thread safe, copies only the pointer. when the pool queue is full the
+    // changes wait for the next request
+    template<class Source>
+    void request(std::shared_ptr<const Source> source, IdxType num_channels, IdxType num_frames, IdxType frame_rate) {
+        auto task = [this, source, num_channels, num_frames, frame_rate] {
+            const Source* audio = source.get();
+            auto get_sample = [audio](uintptr_t cidx, uintptr_t fidx) { return audio->get_sample(cidx, fidx); };
+            build(get_sample, num_channels, num_frames, frame_rate);
+        };
+        rage::WorkerPool::shared().post(this, std::move(task), rage::WorkerPool::LOW, this);
+    }
+
+    void cancel() {
+        rage::WorkerPool::shared().cancel_owner(this);
+    }
+
+    // levels of frames [start, stop) from the track, ui and worker threads
+    auto stats(IdxType start, IdxType stop) const -> LoudnessStats {
+        return summarize(*snapshot(), 0, start, stop);
+    }
+
+    // levels of frames [start, stop) scanned from get_sample with steps starting at start, exact for ranges that
+    // do not line up with the steps of the track. for workers, it reads every frame
+    static auto measure(
+        const FrameGetter& get_sample,
+        IdxType num_channels,
+        IdxType frame_rate,
+        IdxType start,
+        IdxType stop
+    ) -> LoudnessStats {
+        Steps track;
+        track.step_frames = std::max<IdxType>(frame_rate / 10, 1);
+        track.num_channels = num_channels;
+        scan(get_sample, frame_rate, start, stop, 0, track);
+        return summarize(track, start, start, stop);
+    }
+};
@@ -0,0 +1,289 @@
+#pragma once
+#include <stdint.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "audio_base.hpp"
+#include "clip_audio.hpp"
+
+/*
+References:
+    - Bello et al., "A tutorial on onset detection in music signals" (spectral flux, adaptive peak picking)
+    - Dixon, "Onset detection revisited" (log compressed magnitudes, local mean threshold)
+
+Onsets are peaks of the half wave rectified spectral flux of log compressed magnitudes, one frame every HOP
+frames. A peak counts when it is the local maximum and stands above the local mean by an amount set by the
+sensitivity. Each onset is then moved to the start of the block before the largest energy rise inside its
+analysis window, which puts it within a millisecond ahead of the attack.
+*/
+
+struct OnsetDetector {
+    enum { FFT_SIZE = 1024 };
+    enum { HOP = 512 };
+    enum { NUM_BINS = FFT_SIZE / 2 };
+    enum { PEAK_RADIUS = 2 };    // frames on each side a peak has to beat
+    enum { MEAN_RADIUS = 8 };    // frames on each side of the local mean
+    enum { REFINE_BLOCK = 32 };  // frames per energy block when refining
+
+    struct Args {
+        std::shared_ptr<const ClipAudio> audio;  // read on the worker, kept alive until the task is done
+        IdxType num_channels = 0;
+        IdxType frame_rate = 0;
+        IdxType start = 0;
+        IdxType stop = 0;
+        float sensitivity = 0.5f;  // 0..1, higher finds softer onsets
+        size_t max_onsets = 64;
+        double min_gap = 0.04;  // seconds between onsets
+        // owners that drop analyses set these, reading stops once *latest has moved past id
+        const std::atomic<uint64_t>* latest = nullptr;
+        uint64_t id = 0;
+
+        auto abandoned() const -> bool {
+            return latest && latest->load(std::memory_order_relaxed) != id;
+        }
+    };
+
+    // onset frames in (start, stop), ascending
+    static auto detect(const Args& args) -> std::vector<IdxType> {
+        std::vector<IdxType> onsets;
+        if (args.stop <= args.start + FFT_SIZE || args.num_channels == 0)
+            return onsets;
+
+        const std::vector<float> flux = spectral_flux(args);
+        std::vector<Candidate> candidates = pick_peaks(args, flux);
+
+        // strongest first, then drop the ones that crowd a stronger onset
+        std::sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b) {
+            return a.strength > b.strength;
+        });
+        const IdxType min_gap = std::max<IdxType>((IdxType)(args.min_gap * args.frame_rate), REFINE_BLOCK);
+        for (const auto& candidate : candidates) {
+            if (onsets.size() >= args.max_onsets)
+                break;
+            const IdxType onset = refine(args, candidate.frame);
+            if (onset <= args.start + min_gap / 2 || onset >= args.stop - min_gap / 2)
+                continue;
+            auto too_close = [&](IdxType other) {
+                return (onset > other ? onset - other : other - onset) < min_gap;
+            };
+            if (std::none_of(onsets.begin(), onsets.end(), too_close))
+                onsets.push_back(onset);
+        }
+        std::sort(onsets.begin(), onsets.end());
+        return onsets;
+    }
+
+    // normalized spectral flux, value n covers frames [start + n * HOP, start + n * HOP + FFT_SIZE)
+    static auto onset_envelope(const Args& args) -> std::vector<float> {
+        if (args.stop <= args.start + FFT_SIZE || args.num_channels == 0)
+            return {};
+        return spectral_flux(args);
+    }
+
+  private:
+    struct Candidate {
+        size_t frame;
+        float strength;
+    };
+
+    static auto frame_begin(const Args& args, size_t frame) -> IdxType {
+        return args.start + frame * HOP;
+    }
+
+    // one flux value per analysis frame, normalized to a peak of 1
+    static auto spectral_flux(const Args& args) -> std::vector<float> {
+        using rack::simd::float_4;
+        const size_t num_frames = (args.stop - args.start - FFT_SIZE) / HOP + 1;
+        std::vector<float> flux(num_frames, 0.f);
+
+        rack::dsp::RealFFT fft(FFT_SIZE);
+        alignas(16) std::array<float, FFT_SIZE> input;
+        alignas(16) std::array<float, FFT_SIZE> frame;
+        alignas(16) std::array<float, FFT_SIZE> spectrum;
+        alignas(16) std::array<float, NUM_BINS> magnitude;
+        alignas(16) std::array<float, NUM_BINS> previous;
+        std::array<float, FFT_SIZE> window;
+        for (size_t i = 0; i < FFT_SIZE; i++) {
+            window[i] = 0.5f * (1.f - std::cos(2.f * (float)M_PI * i / FFT_SIZE));
+        }
+        previous.fill(0.f);
+
+        const float channel_gain = 1.f / args.num_channels;
+        auto read_mono = [&](IdxType fidx) {
+            float sum = 0.f;
+            for (IdxType cidx = 0; cidx < args.num_channels; cidx++) {
+                sum += (float)args.audio->get_sample(cidx, fidx);
+            }
+            return sum * channel_gain;
+        };
+
+        // sliding input, each frame only reads the HOP new frames
+        for (size_t i = 0; i < FFT_SIZE; i++) {
+            input[i] = read_mono(args.start + i);
+        }
+
+        float peak = 0.f;
+        for (size_t n = 0; n < num_frames; n++) {
+            if (args.abandoned())
+                return {};
+            if (n > 0) {
+                std::copy(input.begin() + HOP, input.end(), input.begin());
+                const IdxType first_new = frame_begin(args, n) + FFT_SIZE - HOP;
+                for (size_t i = 0; i < HOP; i++) {
+                    input[FFT_SIZE - HOP + i] = read_mono(first_new + i);
+                }
+            }
+            for (size_t i = 0; i < FFT_SIZE; i += 4) {
+                (float_4::load(&input[i]) * float_4::load(&window[i])).store(&frame[i]);
+            }
+            fft.rfft(frame.data(), spectrum.data());
+            spectrum[1] = 0.f;  // packed nyquist, ignored
+
+            // log(1 + 10 |X|) of four bins at a time, bin k is (spectrum[2k], spectrum[2k + 1])
+            for (size_t k = 0; k < NUM_BINS; k += 4) {
+                const float_4 a = float_4::load(&spectrum[2 * k]);
+                const float_4 b = float_4::load(&spectrum[2 * k + 4]);
+                const float_4 a2 = a * a;
+                const float_4 b2 = b * b;
+                const float_4 power(a2[0] + a2[1], a2[2] + a2[3], b2[0] + b2[1], b2[2] + b2[3]);
+                rack::simd::log(1.f + 10.f * rack::simd::sqrt(power)).store(&magnitude[k]);
+            }
+
+            float_4 rise = 0.f;
+            for (size_t k = 0; k < NUM_BINS; k += 4) {
+                const float_4 current = float_4::load(&magnitude[k]);
+                rise += rack::simd::fmax(current - float_4::load(&previous[k]), 0.f);
+                current.store(&previous[k]);
+            }
+            flux[n] = n > 0 ? rise[0] + rise[1] + rise[2] + rise[3] : 0.f;
+            peak = std::max(peak, flux[n]);
+        }
+
+        if (peak > 0.f) {
+            for (auto& value : flux) {
+                value /= peak;
+            }
+        }
+        return flux;
+    }
+
+    static auto pick_peaks(const Args& args, const std::vector<float>& flux) -> std::vector<Candidate> {
+        std::vector<Candidate> candidates;
+        const float delta = 0.3f - 0.28f * clamp(args.sensitivity, 0.f, 1.f);
+        const size_t size = flux.size();
+
+        // running sum for the local means
+        std::vector<double> prefix(size + 1, 0.0);
+        for (size_t n = 0; n < size; n++) {
+            prefix[n + 1] = prefix[n] + flux[n];
+        }
+
+        for (size_t n = 1; n < size; n++) {
+            const size_t peak_lo = n > PEAK_RADIUS ? n - PEAK_RADIUS : 0;
+            const size_t peak_hi = std::min<size_t>(n + PEAK_RADIUS + 1, size);
+            if (*std::max_element(flux.begin() + peak_lo, flux.begin() + peak_hi) > flux[n])
+                continue;
+
+            const size_t mean_lo = n > MEAN_RADIUS ? n - MEAN_RADIUS : 0;
+            const size_t mean_hi = std::min<size_t>(n + MEAN_RADIUS + 1, size);
+            const float mean = (float)((prefix[mean_hi] - prefix[mean_lo]) / (mean_hi - mean_lo));
+            const float strength = flux[n] - mean - delta;
+            if (strength > 0.f)
+                candidates.push_back({n, strength});
+        }
+        return candidates;
+    }
+
+    // start of the block before the largest energy rise within the analysis window of frame, slicing a little
+    // early keeps the whole attack in the slice
+    static auto refine(const Args& args, size_t frame) -> IdxType {
+        enum { NUM_BLOCKS = FFT_SIZE / REFINE_BLOCK };
+        const IdxType begin = frame_begin(args, frame);
+        std::array<double, NUM_BLOCKS> energy;
+        for (size_t b = 0; b < NUM_BLOCKS; b++) {
+            double sum = 0.0;
+            for (size_t i = 0; i < REFINE_BLOCK; i++) {
+                for (IdxType cidx = 0; cidx < args.num_channels; cidx++) {
+                    const double value = args.audio->get_sample(cidx, begin + b * REFINE_BLOCK + i);
+                    sum += value * value;
+                }
+            }
+            energy[b] = sum;
+        }
+
+        size_t best = NUM_BLOCKS / 2;
+        double best_rise = 0.0;
+        for (size_t b = 1; b < NUM_BLOCKS; b++) {
+            const double rise = energy[b] - energy[b - 1];
+            if (rise > best_rise) {
+                best_rise = rise;
+                best = b;
+            }
+        }
+        return begin + (best - 1) * REFINE_BLOCK;
+    }
+};
+
+// Runs onset detection on the shared pool and hands the result back to the audio thread
+struct AutoSlicer {
+    struct Result {
+        const void* clip = nullptr;
+        IdxType start = 0;
+        IdxType stop = 0;
+        uint64_t version = 0;  // content version of the clip when analysis started, a changed clip discards the result
+        std::vector<IdxType> onsets;
+    };
+
+  private:
+    std::mutex mutex;
+    std::unique_ptr<Result> result;
+    std::atomic<bool> ready {false};
+    std::atomic<bool> busy {false};
+
+  public:
+    ~AutoSlicer() {
+        rage::WorkerPool::shared().cancel_owner(this);
+    }
+
+    auto is_busy() const -> bool {
+        return busy;
+    }
+
+    // clip only identifies the result, args.audio is read on the pool
+    void analyze(const void* clip, uint64_t version, const OnsetDetector::Args& args) {
+        busy = true;
+        auto task = [this, clip, version, args] {
+            std::unique_ptr<Result> found(new Result());
+            found->clip = clip;
+            found->start = args.start;
+            found->stop = args.stop;
+            found->version = version;
+            found->onsets = OnsetDetector::detect(args);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            result = std::move(found);
+            ready = true;
+        };
+        if (!rage::WorkerPool::shared().post(this, std::move(task), rage::WorkerPool::NORMAL, this))
+            busy = false;
+    }
+
+    // audio thread, never waits on the lock
+    auto take() -> std::unique_ptr<Result> {
+        if (!ready)
+            return nullptr;
+        std::unique_lock<std::mutex> lock(mutex, std::try_to_lock);
+        if (!lock.owns_lock() || !ready)
+            return nullptr;
+        ready = false;
+        busy = false;
+        return std::move(result);
+    }
+};
@@ -0,0 +1,315 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <stdint.h>
+#include <vector>
+
+/*
+Multi resolution min / max / sum of squares / sum of magnitudes summary of a clip.
+Level 0 summarizes BASE_BLOCK frames per entry, every level above combines FANOUT entries of the one below.
+Appending frames (recording) updates the summary incrementally, other writes only mark a dirty range that
+is recomputed on the next refresh. Any frame range can then be summarized into N points in O(N).
+A pyramid can also be restored from one stored level (see peak_sidecar.hpp) before its audio is available.
+Every level is allocated up front for the capacity the owner reserves, so writes never move the entries that
+background summaries are reading. Frames past the capacity are not summarized until the owner reserves more,
+which it only does while no reader can see the pyramid.
+*/
+
+struct PeakBlock {
+    float min = std::numeric_limits<float>::max();
+    float max = std::numeric_limits<float>::lowest();
+    double sumsq = 0.0;
+    double sumabs = 0.0;
+    uint32_t count = 0;
+
+    void add(float value) {
+        min = std::min(min, value);
+        max = std::max(max, value);
+        sumsq += (double)value * value;
+        sumabs += std::abs(value);
+        count += 1;
+    }
+
+    void merge(const PeakBlock& other) {
+        min = std::min(min, other.min);
+        max = std::max(max, other.max);
+        sumsq += other.sumsq;
+        sumabs += other.sumabs;
+        count += other.count;
+    }
+
+    auto rms() const -> double {
+        return count ? std::sqrt(sumsq / count) : 0.0;
+    }
+
+    auto mean_abs() const -> double {
+        return count ? sumabs / count : 0.0;
+    }
+
+    auto peak() const -> double {
+        return count ? std::max(std::abs(min), std::abs(max)) : 0.0;
+    }
+};
+
+struct PeakPyramid {
+    enum { BASE_BLOCK = 64 };
+    enum { FANOUT = 4 };
+
+    using FrameGetter = std::function<double(size_t, size_t)>;
+    using Level = std::vector<std::vector<PeakBlock>>;  // [channel][block]
+
+  private:
+    std::vector<Level> levels;
+    size_t num_channels = 0;
+    size_t num_frames = 0;
+    size_t capacity = 0;  // frames every level is allocated for
+    size_t first_level = 0;  // above 0 only for restored pyramids, finer levels are empty
+    size_t dirty_begin = std::numeric_limits<size_t>::max();
+    size_t dirty_end = 0;
+
+    static auto block_size(size_t level) -> size_t {
+        size_t size = BASE_BLOCK;
+        for (size_t l = 0; l < level; l++) {
+            size *= FANOUT;
+        }
+        return size;
+    }
+
+    // sizes every level for frames, keeping the entries already summarized
+    void allocate(size_t frames) {
+        capacity = std::max(capacity, frames);
+        size_t level_idx = 0;
+        size_t entries = (capacity + BASE_BLOCK - 1) / BASE_BLOCK;
+        while (true) {
+            if (levels.size() <= level_idx)
+                levels.emplace_back(num_channels);
+            levels[level_idx].resize(num_channels);
+            for (auto& channel : levels[level_idx]) {
+                if (channel.size() < entries)
+                    channel.resize(entries);
+            }
+            if (entries <= 1)
+                break;
+            entries = (entries + FANOUT - 1) / FANOUT;
+            level_idx += 1;
+        }
+    }
+
+    static void add_frames(PeakBlock& result, const FrameGetter& get_sample, size_t channel, size_t begin, size_t end) {
+        for (size_t fidx = begin; fidx < end; fidx++) {
+            result.add((float)get_sample(channel, fidx));
+        }
+    }
+
+    void merge_blocks(PeakBlock& result, size_t level, size_t channel, size_t begin, size_t end) const {
+        const auto& blocks = levels[level][channel];
+        end = std::min(end, blocks.size());
+        for (size_t idx = begin; idx < end; idx++) {
+            result.merge(blocks[idx]);
+        }
+    }
+
+    // recomputes the upper level entries that cover blocks [begin, end) of from_level
+    void propagate(size_t begin, size_t end, size_t from_level = 0) {
+        for (size_t level = from_level + 1; level < levels.size(); level++) {
+            begin /= FANOUT;
+            end = (end + FANOUT - 1) / FANOUT;
+            for (size_t cidx = 0; cidx < num_channels; cidx++) {
+                const auto& below = levels[level - 1][cidx];
+                auto& above = levels[level][cidx];
+                for (size_t idx = begin; idx < end && idx < above.size(); idx++) {
+                    PeakBlock block;
+                    const size_t last = std::min<size_t>((idx + 1) * FANOUT, below.size());
+                    for (size_t child = idx * FANOUT; child < last; child++) {
+                        block.merge(below[child]);
+                    }
+                    above[idx] = block;
+                }
+            }
+        }
+    }
+
+  public:
+    void reset(size_t num_channels) {
+        this->num_channels = num_channels;
+        this->num_frames = 0;
+        this->capacity = 0;
+        this->first_level = 0;
+        levels.clear();
+        dirty_begin = std::numeric_limits<size_t>::max();
+        dirty_end = 0;
+    }
+
+    auto channels() const -> size_t {
+        return num_channels;
+    }
+
+    auto frames() const -> size_t {
+        return num_frames;
+    }
+
+    auto frame_capacity() const -> size_t {
+        return first_level > 0 ? 0 : capacity;
+    }
+
+    // Makes room for max_frames frames of num_channels channels, keeping what is summarized. Allocates, so it
+    // must not run while a summary of this pyramid may be in progress. A restored pyramid starts over empty.
+    void reserve(size_t num_channels, size_t max_frames) {
+        if (first_level > 0)
+            reset(num_channels);
+        this->num_channels = std::max(this->num_channels, num_channels);
+        allocate(max_frames);
+    }
+
+    void rebuild(const FrameGetter& get_sample, size_t num_channels, size_t num_frames) {
+        reset(num_channels);
+        allocate(num_frames);
+        this->num_frames = num_frames;
+        invalidate(0, num_frames);
+        refresh(get_sample);
+    }
+
+    // entries of one level, [channel][block]
+    auto level_blocks(size_t level) const -> const Level& {
+        static const Level empty;
+        return level < levels.size() ? levels[level] : empty;
+    }
+
+    static auto frames_per_block(size_t level) -> size_t {
+        return block_size(level);
+    }
+
+    // Coarse pyramid from the entries of one level. Ranges finer than an entry are summarized by the whole
+    // entries they touch, which is close enough to draw until the audio itself is loaded.
+    void restore(size_t level, Level blocks, size_t num_frames) {
+        reset(blocks.size());
+        this->num_frames = num_frames;
+        this->first_level = level;
+        levels.resize(level, Level(num_channels));
+        size_t entries = blocks.empty() ? 0 : blocks[0].size();
+        capacity = entries * block_size(level);
+        levels.push_back(std::move(blocks));
+        while (entries > 1) {
+            entries = (entries + FANOUT - 1) / FANOUT;
+            levels.emplace_back(num_channels, std::vector<PeakBlock>(entries));
+        }
+        propagate(0, levels[level].empty() ? 0 : levels[level][0].size(), level);
+    }
+
+    // Call after a whole frame was written at frame_idx, never allocates. Frames past the reserved capacity or
+    // of a restored pyramid are skipped, channels past the reserved ones are left out
+    void write_frame(const double* channels, size_t channel_count, size_t frame_idx) {
+        if (first_level > 0 || frame_idx >= capacity)
+            return;
+        channel_count = std::min(channel_count, num_channels);
+
+        if (frame_idx != num_frames) {
+            // overwriting or skipping ahead, recompute from the data later
+            num_frames = std::max(num_frames, frame_idx + 1);
+            invalidate(frame_idx, frame_idx + 1);
+            return;
+        }
+
+        num_frames = frame_idx + 1;
+        const size_t block_idx = frame_idx / BASE_BLOCK;
+        for (size_t cidx = 0; cidx < channel_count; cidx++) {
+            levels[0][cidx][block_idx].add((float)channels[cidx]);
+        }
+
+        // fold completed blocks into the coarser levels
+        if ((frame_idx + 1) % BASE_BLOCK == 0)
+            propagate(block_idx, block_idx + 1);
+    }
+
+    // frames [begin, end) were written without write_frame, they are summarized on the next refresh. never allocates
+    void mark_written(size_t begin, size_t end) {
+        end = std::min(end, frame_capacity());
+        if (begin >= end)
+            return;
+        num_frames = std::max(num_frames, end);
+        invalidate(begin, end);
+    }
+
+    void invalidate(size_t begin, size_t end) {
+        dirty_begin = std::min(dirty_begin, begin);
+        dirty_end = std::max(dirty_end, std::min(end, num_frames));
+    }
+
+    auto is_dirty() const -> bool {
+        return dirty_begin < dirty_end;
+    }
+
+    // recomputes dirty level 0 blocks from the clip data, cost is proportional to the dirty range
+    void refresh(const FrameGetter& get_sample) {
+        if (!is_dirty() || levels.empty()) {
+            dirty_begin = std::numeric_limits<size_t>::max();
+            dirty_end = 0;
+            return;
+        }
+
+        const size_t begin = dirty_begin / BASE_BLOCK;
+        const size_t end = (dirty_end + BASE_BLOCK - 1) / BASE_BLOCK;
+        for (size_t cidx = 0; cidx < num_channels; cidx++) {
+            auto& blocks = levels[0][cidx];
+            for (size_t idx = begin; idx < end && idx < blocks.size(); idx++) {
+                PeakBlock block;
+                const size_t last = std::min<size_t>((idx + 1) * BASE_BLOCK, num_frames);
+                for (size_t fidx = idx * BASE_BLOCK; fidx < last; fidx++) {
+                    block.add((float)get_sample(cidx, fidx));
+                }
+                blocks[idx] = block;
+            }
+        }
+        propagate(begin, end);
+
+        dirty_begin = std::numeric_limits<size_t>::max();
+        dirty_end = 0;
+    }
+
+    // Summary of one channel over exactly [begin, end): the frames up to the first and from the last level 0 block
+    // edge are read from get_sample, everything between from the coarsest blocks that fit. Restored pyramids
+    // have no finer levels, their ranges are rounded out to whole entries until the audio itself is loaded.
+    auto summarize(size_t channel, size_t begin, size_t end, const FrameGetter& get_sample) const -> PeakBlock {
+        PeakBlock result;
+        end = std::min(end, num_frames);
+        if (begin >= end || channel >= num_channels)
+            return result;
+
+        if (levels.empty() || (first_level == 0 && end - begin < BASE_BLOCK)) {
+            add_frames(result, get_sample, channel, begin, end);
+            return result;
+        }
+
+        size_t size = block_size(first_level);
+        if (first_level == 0) {
+            const size_t head = std::min(end, (begin + size - 1) / size * size);
+            const size_t tail = std::max(head, end / size * size);
+            add_frames(result, get_sample, channel, begin, head);
+            add_frames(result, get_sample, channel, tail, end);
+            begin = head;
+            end = tail;
+        } else {
+            begin = begin / size * size;
+            end = (end + size - 1) / size * size;
+        }
+
+        // [begin, end) is now on block edges of the current level, peel off blocks until it is on the next
+        for (size_t level = first_level; begin < end; level++) {
+            size = block_size(level);
+            if (level + 1 == levels.size()) {
+                merge_blocks(result, level, channel, begin / size, end / size);
+                break;
+            }
+            const size_t above = size * FANOUT;
+            const size_t inner_begin = std::min(end, (begin + above - 1) / above * above);
+            const size_t inner_end = std::max(inner_begin, end / above * above);
+            merge_blocks(result, level, channel, begin / size, inner_begin / size);
+            merge_blocks(result, level, channel, inner_end / size, end / size);
+            begin = inner_begin;
+            end = inner_end;
+        }
+        return result;
+    }
+};
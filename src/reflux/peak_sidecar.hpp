@@ -0,0 +1,120 @@
+#pragma once
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "peak_pyramid.hpp"
+#include "plugin.hpp"
+
+/*
+Peak summary of a decoded file, stored in the user cache directory the first time the file is loaded.
+Sidecars are named after a hash of the source path, size and modification time, so an edited file simply
+gets a new one. Only min / max of one pyramid level are kept (SIDECAR_LEVEL, 1024 frames per entry) as
+16 bit values, about 4 bytes per channel per 1024 frames.
+*/
+
+struct PeakSidecar {
+    enum { SIDECAR_LEVEL = 2 };
+    enum { VERSION = 1 };
+    static constexpr uint32_t MAGIC = 0x50584652;  // "RFXP"
+
+    struct Header {
+        uint32_t magic = MAGIC;
+        uint32_t version = VERSION;
+        uint32_t num_channels = 0;
+        uint32_t frame_rate = 0;
+        uint64_t num_frames = 0;
+        uint64_t num_blocks = 0;
+    };
+
+    static auto cache_dir() -> std::string {
+        return rack::system::join(rack::asset::user("Rage"), "peaks");
+    }
+
+    // cache file with extension for the current version of the file at path, empty if the file can not be read
+    static auto cache_path(const std::string& path, const std::string& extension) -> std::string {
+        struct stat info;
+        if (stat(path.c_str(), &info) != 0)
+            return "";
+        const std::string identity = fmt::format("{}|{}|{}", path, (int64_t)info.st_size, (int64_t)info.st_mtime);
+        const size_t hash = std::hash<std::string>()(identity);
+        return rack::system::join(cache_dir(), fmt::format("{:016x}.{}", (uint64_t)hash, extension));
+    }
+
+    static auto sidecar_path(const std::string& path) -> std::string {
+        return cache_path(path, "peaks");
+    }
+
+    static auto read(const std::string& path, PeakPyramid& peaks, uint32_t& frame_rate) -> bool {
+        const std::string sidecar = sidecar_path(path);
+        if (sidecar.empty())
+            return false;
+        std::ifstream file(sidecar, std::ios::binary);
+        if (!file)
+            return false;
+
+        Header header;
+        file.read((char*)&header, sizeof(header));
+        if (!file || header.magic != MAGIC || header.version != VERSION || header.num_channels == 0)
+            return false;
+
+        const size_t block_frames = PeakPyramid::frames_per_block(SIDECAR_LEVEL);
+        if (header.num_blocks != (header.num_frames + block_frames - 1) / block_frames)
+            return false;
+
+        std::vector<int16_t> packed(header.num_blocks * 2);
+        PeakPyramid::Level blocks(header.num_channels);
+        for (auto& channel : blocks) {
+            file.read((char*)packed.data(), packed.size() * sizeof(int16_t));
+            if (!file)
+                return false;
+            channel.resize(header.num_blocks);
+            for (size_t idx = 0; idx < header.num_blocks; idx++) {
+                // only the extremes are stored, rms and mean of restored blocks read as 0
+                PeakBlock& block = channel[idx];
+                block.min = packed[2 * idx] / 32767.f;
+                block.max = packed[2 * idx + 1] / 32767.f;
+                block.count = (uint32_t)std::min<uint64_t>(block_frames, header.num_frames - idx * block_frames);
+            }
+        }
+
+        peaks.restore(SIDECAR_LEVEL, std::move(blocks), header.num_frames);
+        frame_rate = header.frame_rate;
+        return true;
+    }
+
+    static auto write(const std::string& path, const PeakPyramid& peaks, uint32_t frame_rate) -> bool {
+        const std::string sidecar = sidecar_path(path);
+        const auto& blocks = peaks.level_blocks(SIDECAR_LEVEL);
+        if (sidecar.empty() || blocks.empty() || blocks[0].empty())
+            return false;
+
+        rack::system::createDirectories(cache_dir());
+        std::ofstream file(sidecar, std::ios::binary | std::ios::trunc);
+        if (!file)
+            return false;
+
+        Header header;
+        header.num_channels = (uint32_t)blocks.size();
+        header.frame_rate = frame_rate;
+        header.num_frames = peaks.frames();
+        header.num_blocks = blocks[0].size();
+        file.write((const char*)&header, sizeof(header));
+
+        auto quantize = [](float value) { return (int16_t)std::round(clamp(value, -1.f, 1.f) * 32767.f); };
+        std::vector<int16_t> packed(header.num_blocks * 2);
+        for (const auto& channel : blocks) {
+            for (size_t idx = 0; idx < header.num_blocks; idx++) {
+                packed[2 * idx] = channel[idx].count ? quantize(channel[idx].min) : 0;
+                packed[2 * idx + 1] = channel[idx].count ? quantize(channel[idx].max) : 0;
+            }
+            file.write((const char*)packed.data(), packed.size() * sizeof(int16_t));
+        }
+        return (bool)file;
+    }
+};
@@ -0,0 +1,349 @@
+#pragma once
+#include <stdint.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "analysis_slot.hpp"
+#include "audio_base.hpp"
+#include "clip_audio.hpp"
+
+/*
+References:
+    - de Cheveigne, Kawahara, "YIN, a fundamental frequency estimator for speech and music"
+    - Krumhansl, "Cognitive foundations of musical pitch" (key profiles)
+
+The pitch of a range is the median YIN estimate over a few windows spread across it, skipping silent and
+unvoiced windows. The difference function is computed four lags of samples at a time. The key, when asked
+for, is the major or minor Krumhansl profile that correlates best with the chroma of the same range.
+*/
+
+struct PitchEstimate {
+    double freq = 0.0;  // Hz, 0 when the range has no clear pitch
+    double range = 1.0;  // suggested tuner bandwidth in octaves, wider for less stable pitch
+    float confidence = 0.f;
+    int key = -1;  // tonic pitch class (0 = C), -1 when not analyzed or unclear
+    bool minor = false;
+
+    // what the estimate was made from, a slice or clip with other values needs a new one
+    IdxType start = 0;
+    IdxType stop = 0;
+    uint64_t version = 0;
+    bool analyzed = false;
+    bool key_analyzed = false;
+
+    auto matches(IdxType start, IdxType stop, uint64_t version, bool with_key) const -> bool {
+        return analyzed && this->start == start && this->stop == stop && this->version == version
+            && (key_analyzed || !with_key);
+    }
+
+    auto voiced() const -> bool {
+        return freq > 0.0;
+    }
+
+    auto describe() const -> std::string {
+        static const char* names[] = {"C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B"};
+        if (!analyzed)
+            return "analyzing...";
+        std::string text = "no clear pitch";
+        if (voiced()) {
+            const int midi = (int)std::round(69 + 12 * std::log2(freq / 440.0));
+            text = fmt::format("{}{} ({:.1f}Hz)", names[((midi % 12) + 12) % 12], midi / 12 - 1, freq);
+        }
+        if (key >= 0)
+            text += fmt::format(", {} {}", names[key], minor ? "minor" : "major");
+        return text;
+    }
+
+    json_t* make_json_obj() const {
+        json_t* root = json_object();
+        json_object_set_new(root, "freq", json_real(freq));
+        json_object_set_new(root, "range", json_real(range));
+        json_object_set_new(root, "confidence", json_real(confidence));
+        json_object_set_new(root, "key", json_integer(key));
+        json_object_set_new(root, "minor", json_boolean(minor));
+        json_object_set_new(root, "start", json_real(start));
+        json_object_set_new(root, "stop", json_real(stop));
+        json_object_set_new(root, "key_analyzed", json_boolean(key_analyzed));
+        return root;
+    }
+
+    // version is not stored, the owner passes the current one of the audio the estimate was saved with
+    void load_json(json_t* root, uint64_t version) {
+        freq = json_real_value(json_object_get(root, "freq"));
+        range = json_real_value(json_object_get(root, "range"));
+        confidence = json_real_value(json_object_get(root, "confidence"));
+        key = json_integer_value(json_object_get(root, "key"));
+        minor = json_boolean_value(json_object_get(root, "minor"));
+        start = json_real_value(json_object_get(root, "start"));
+        stop = json_real_value(json_object_get(root, "stop"));
+        key_analyzed = json_boolean_value(json_object_get(root, "key_analyzed"));
+        this->version = version;
+        analyzed = true;
+    }
+};
+
+struct PitchAnalyzer {
+    enum { YIN_WINDOW = 1024 };
+    enum { MIN_FREQ = 50 };
+    enum { MAX_FREQ = 2000 };
+    enum { MAX_WINDOWS = 8 };
+    enum { CHROMA_FFT_SIZE = 4096 };
+
+    struct Request {
+        std::shared_ptr<const ClipAudio> audio;  // read on the worker, kept alive until the task is done
+        IdxType num_channels = 0;
+        IdxType frame_rate = 0;
+        IdxType start = 0;
+        IdxType stop = 0;
+        uint64_t version = 0;
+        bool detect_key = false;
+    };
+
+    static auto estimate(const Request& request) -> PitchEstimate {
+        PitchEstimate result;
+        result.start = request.start;
+        result.stop = request.stop;
+        result.version = request.version;
+        result.analyzed = true;
+        result.key_analyzed = request.detect_key;
+        if (request.num_channels == 0 || request.frame_rate == 0)
+            return result;
+
+        const IdxType max_lag = request.frame_rate / MIN_FREQ;
+        const IdxType min_lag = std::max<IdxType>(request.frame_rate / MAX_FREQ, 2);
+        const IdxType span = YIN_WINDOW + max_lag;
+        if (request.stop < request.start + span)
+            return result;
+
+        const float channel_gain = 1.f / request.num_channels;
+        auto read_mono = [&](IdxType begin, IdxType length, std::vector<float>& dst) {
+            dst.resize(length);
+            for (IdxType i = 0; i < length; i++) {
+                float sum = 0.f;
+                for (IdxType cidx = 0; cidx < request.num_channels; cidx++) {
+                    sum += (float)request.audio->get_sample(cidx, begin + i);
+                }
+                dst[i] = sum * channel_gain;
+            }
+        };
+
+        // windows evenly spread over the range
+        const IdxType length = request.stop - request.start;
+        const IdxType num_windows = std::min<IdxType>(std::max<IdxType>(length / span, 1), MAX_WINDOWS);
+        const double spacing = (double)(length - span) / num_windows;
+        std::vector<float> samples;
+        std::vector<float> difference(max_lag + 1);
+        std::vector<double> freqs;
+        std::vector<float> confidences;
+        for (IdxType w = 0; w < num_windows; w++) {
+            read_mono(request.start + (IdxType)(spacing * w + spacing / 2), span, samples);
+            float energy = 0.f;
+            for (IdxType i = 0; i < YIN_WINDOW; i++) {
+                energy += samples[i] * samples[i];
+            }
+            if (energy < YIN_WINDOW * 1e-6f)
+                continue;
+
+            float aperiodicity = 1.f;
+            const double lag = yin(samples, difference, min_lag, max_lag, aperiodicity);
+            if (lag > 0.0) {
+                freqs.push_back(request.frame_rate / lag);
+                confidences.push_back(1.f - aperiodicity);
+            }
+        }
+
+        // mostly unvoiced ranges have no pitch to tune to
+        if (!freqs.empty() && freqs.size() * 2 >= (size_t)num_windows) {
+            std::vector<double> sorted = freqs;
+            std::sort(sorted.begin(), sorted.end());
+            result.freq = sorted[sorted.size() / 2];
+            float confidence = 0.f;
+            for (float value : confidences) {
+                confidence += value;
+            }
+            result.confidence = confidence / confidences.size() * freqs.size() / num_windows;
+            // the spread between the quartiles in octaves, a steady note gets a narrow band
+            const double spread = std::log2(sorted[sorted.size() * 3 / 4] / sorted[sorted.size() / 4]);
+            result.range = clamp(0.25 + 2 * spread + (1.0 - result.confidence), 0.25, 4.0);
+        }
+
+        if (request.detect_key)
+            detect_key(request, read_mono, result);
+        return result;
+    }
+
+  private:
+    // lag of the first dip of the cumulative mean normalized difference below the threshold, 0 if unvoiced
+    static auto yin(
+        const std::vector<float>& samples,
+        std::vector<float>& difference,
+        IdxType min_lag,
+        IdxType max_lag,
+        float& aperiodicity
+    ) -> double {
+        using rack::simd::float_4;
+        for (IdxType lag = 1; lag <= max_lag; lag++) {
+            float_4 sum = 0.f;
+            for (IdxType i = 0; i < YIN_WINDOW; i += 4) {
+                const float_4 delta = float_4::load(&samples[i]) - float_4::load(&samples[i + lag]);
+                sum += delta * delta;
+            }
+            difference[lag] = sum[0] + sum[1] + sum[2] + sum[3];
+        }
+
+        // cumulative mean normalization in place
+        difference[0] = 1.f;
+        float running = 0.f;
+        for (IdxType lag = 1; lag <= max_lag; lag++) {
+            running += difference[lag];
+            difference[lag] = running > 0.f ? difference[lag] * lag / running : 1.f;
+        }
+
+        const float threshold = 0.15f;
+        IdxType best = 0;
+        for (IdxType lag = min_lag; lag < max_lag; lag++) {
+            if (difference[lag] < threshold) {
+                while (lag + 1 < max_lag && difference[lag + 1] < difference[lag]) {
+                    lag++;
+                }
+                best = lag;
+                break;
+            }
+        }
+        // no dip under the threshold, the global minimum still counts when it is clear enough
+        if (best == 0) {
+            best = (IdxType)(std::min_element(difference.begin() + min_lag, difference.begin() + max_lag)
+                             - difference.begin());
+            if (difference[best] > 0.35f)
+                return 0.0;
+        }
+
+        aperiodicity = difference[best];
+        // parabola through the minimum and its neighbours
+        const float before = difference[best - 1];
+        const float after = difference[best + 1];
+        const float curvature = before + after - 2 * difference[best];
+        const double shift = curvature > 0.f ? 0.5 * (before - after) / curvature : 0.0;
+        return best + clamp(shift, -0.5, 0.5);
+    }
+
+    template<class Reader>
+    static void detect_key(const Request& request, Reader& read_mono, PitchEstimate& result) {
+        // Krumhansl-Kessler major and minor profiles, tonic first
+        static const double major[12] = {6.35, 2.23, 3.48, 2.33, 4.38, 4.09, 2.52, 5.19, 2.39, 3.66, 2.29, 2.88};
+        static const double minor[12] = {6.33, 2.68, 3.52, 5.38, 2.60, 3.53, 2.54, 4.75, 3.98, 2.69, 3.34, 3.17};
+
+        const IdxType length = request.stop - request.start;
+        if (length < CHROMA_FFT_SIZE)
+            return;
+
+        rack::dsp::RealFFT fft(CHROMA_FFT_SIZE);
+        alignas(16) std::array<float, CHROMA_FFT_SIZE> frame;
+        alignas(16) std::array<float, CHROMA_FFT_SIZE> spectrum;
+        std::array<double, 12> chroma {};
+        std::vector<float> samples;
+
+        // pitch class of every bin between 55Hz and 2kHz
+        const double bin_hz = (double)request.frame_rate / CHROMA_FFT_SIZE;
+        const size_t first_bin = (size_t)std::ceil(55.0 / bin_hz);
+        const size_t last_bin = std::min<size_t>((size_t)(2000.0 / bin_hz), CHROMA_FFT_SIZE / 2 - 1);
+        std::vector<int> bin_class(last_bin + 1, 0);
+        for (size_t k = first_bin; k <= last_bin; k++) {
+            const int midi = (int)std::round(69 + 12 * std::log2(k * bin_hz / 440.0));
+            bin_class[k] = ((midi % 12) + 12) % 12;
+        }
+
+        const IdxType num_windows = std::min<IdxType>(std::max<IdxType>(length / CHROMA_FFT_SIZE, 1), MAX_WINDOWS);
+        const double spacing = (double)(length - CHROMA_FFT_SIZE) / num_windows;
+        for (IdxType w = 0; w < num_windows; w++) {
+            read_mono(request.start + (IdxType)(spacing * w + spacing / 2), CHROMA_FFT_SIZE, samples);
+            for (size_t i = 0; i < CHROMA_FFT_SIZE; i++) {
+                const float window = 0.5f * (1.f - std::cos(2.f * (float)M_PI * i / CHROMA_FFT_SIZE));
+                frame[i] = samples[i] * window;
+            }
+            fft.rfft(frame.data(), spectrum.data());
+            for (size_t k = first_bin; k <= last_bin; k++) {
+                const double re = spectrum[2 * k];
+                const double im = spectrum[2 * k + 1];
+                chroma[bin_class[k]] += std::sqrt(re * re + im * im);
+            }
+        }
+
+        auto correlation = [&](const double* profile, int tonic) {
+            double mean_chroma = 0.0;
+            double mean_profile = 0.0;
+            for (int i = 0; i < 12; i++) {
+                mean_chroma += chroma[i] / 12;
+                mean_profile += profile[i] / 12;
+            }
+            double cross = 0.0;
+            double chroma_power = 0.0;
+            double profile_power = 0.0;
+            for (int i = 0; i < 12; i++) {
+                const double c = chroma[i] - mean_chroma;
+                const double p = profile[(i - tonic + 12) % 12] - mean_profile;
+                cross += c * p;
+                chroma_power += c * c;
+                profile_power += p * p;
+            }
+            return chroma_power > 0.0 ? cross / std::sqrt(chroma_power * profile_power) : 0.0;
+        };
+
+        double best = 0.3;  // weaker matches leave the key unknown
+        for (int tonic = 0; tonic < 12; tonic++) {
+            const double as_major = correlation(major, tonic);
+            const double as_minor = correlation(minor, tonic);
+            if (as_major > best || as_minor > best) {
+                best = std::max(as_major, as_minor);
+                result.key = tonic;
+                result.minor = as_minor > as_major;
+            }
+        }
+    }
+
+    std::atomic<bool> finished {false};
+    std::atomic<size_t> num_in_flight {0};
+
+  public:
+    using Slot = AnalysisSlot<PitchEstimate>;
+
+    ~PitchAnalyzer() {
+        rage::WorkerPool::shared().cancel_owner(this);
+    }
+
+    // any thread
+    auto num_pending() const -> size_t {
+        return num_in_flight;
+    }
+
+    // audio thread, at most one analysis per slot is queued at a time. the slot has to outlive the analyzer
+    void analyze(const Request& request, Slot& slot) {
+        uint64_t ticket;
+        if (!slot.begin(ticket))
+            return;
+        Slot* target = &slot;
+        num_in_flight += 1;
+        auto task = [this, request, target, ticket] {
+            target->finish(ticket, estimate(request));
+            num_in_flight -= 1;
+            finished = true;
+        };
+        // a full queue leaves the slot unanalyzed, it is asked for again later
+        if (!rage::WorkerPool::shared().post(target, std::move(task), rage::WorkerPool::LOW, this)) {
+            slot.cancel_begin();
+            num_in_flight -= 1;
+        }
+    }
+
+    // audio thread, true when some slot may have a result to take since the last call
+    auto has_finished() -> bool {
+        return finished.exchange(false);
+    }
+};
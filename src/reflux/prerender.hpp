@@ -0,0 +1,98 @@
+#pragma once
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "audio_base.hpp"
+#include "clip_audio.hpp"
+#include "prerender_cache.hpp"
+#include "slice_envelope.hpp"
+
+struct PrerenderBuilder {
+    enum { CANCEL_CHECK_FRAMES = 4096 };
+
+    struct RenderArgs {
+        std::shared_ptr<const ClipAudio> audio;  // read on the worker, kept alive until the task is done
+        SliceEnvelope envelope;  // of slices, applied with apply_envelope
+        bool apply_envelope = false;
+        PrerenderCache* dst = nullptr;
+        IdxType num_channels = 0;
+        IdxType frame_rate = 0;
+        double start = 0;
+        double stop = 0;
+        uint64_t version = 0;
+        RealtimeMultiChannelTuner::OutputMode output_mode = RealtimeMultiChannelTuner::OFF;
+        double freq = 0;
+        double range = 0;
+        double xhift = 0;
+
+        // captures the current tuner settings of the profile, the caller fills in the audio
+        static auto from_profile(PlaybackProfile& profile) -> RenderArgs {
+            RenderArgs args;
+            args.dst = &profile.render_cache;
+            args.version = profile.prerender_version;
+            args.output_mode = profile.tuner_mode;
+            args.freq = profile.freq;
+            args.range = profile.range;
+            args.xhift = profile.xhift;
+            return args;
+        }
+    };
+
+    ~PrerenderBuilder() {
+        WorkerPool::shared().cancel_owner(this);
+    }
+
+    // Renders run on the shared pool behind display work, a newer request for the same cache replaces the queued
+    // one. Audio thread safe, false when the pool queue is full
+    auto render(RenderArgs args) -> bool {
+        return WorkerPool::shared().post(args.dst, [args] { render_(args); }, WorkerPool::LOW, this);
+    }
+
+    // drops queued work for dst and stops an in flight render of it, returns once that render has given up
+    void cancel(PrerenderCache* dst) {
+        WorkerPool::shared().cancel(dst);
+    }
+
+  private:
+    static void render_(const RenderArgs& args) {
+        PrerenderCache& cache = *args.dst;
+        PrerenderCache::Render& render = cache.back();
+        auto& frames = render.frames;
+        const IdxType start = (IdxType)args.start;
+        const IdxType num_frames = (IdxType)args.stop - start;
+
+        TunerLease lease;
+        RealtimeMultiChannelTuner& tuner = *lease.acquire();
+        tuner.set_sample_rate(args.frame_rate);
+        tuner.set_channels(args.num_channels);
+        tuner.config_filters(args.freq, args.range);
+        tuner.set_period_ratio(args.xhift);
+        tuner.set_output_mode(args.output_mode);
+
+        frames.resize(args.num_channels);
+        for (auto& channel : frames) {
+            channel.resize(num_frames);
+        }
+
+        auto frame = std::vector<double>(args.num_channels);
+        for (IdxType fidx = 0; fidx < num_frames; fidx++) {
+            // a cancelled render leaves the published slot as it was
+            if (fidx % CANCEL_CHECK_FRAMES == 0 && WorkerPool::cancelled())
+                return;
+            for (IdxType cidx = 0; cidx < args.num_channels; cidx++) {
+                frame[cidx] = args.audio->get_sample(cidx, start + fidx);
+                if (args.apply_envelope)
+                    frame[cidx] *= args.envelope.gain(start + fidx);
+            }
+            auto tuned = tuner.process(frame);
+            for (IdxType cidx = 0; cidx < args.num_channels; cidx++) {
+                frames[cidx][fidx] = tuned[cidx];
+            }
+        }
+
+        render.start = start;
+        render.version = args.version;
+        cache.publish();
+    }
+};
@@ -0,0 +1,48 @@
+#pragma once
+#include <stdint.h>
+
+#include <vector>
+
+#include "src/shared/triple_buffer.hpp"
+
+enum { PRERENDER_MAX_SECONDS = 120 };
+
+// Holds the tuned output of a clip or slice region. The worker renders into the back of a triple buffer and
+// publishes it, the audio thread only ever reads a published render, so a new render never writes into frames
+// that are still being played.
+struct PrerenderCache {
+    using Frames = std::vector<std::vector<double>>;
+
+    struct Render {
+        Frames frames;
+        double start = 0.0;
+        uint64_t version = 0;
+
+        auto get_sample(double channel_idx, double frame_idx) const -> double {
+            const double offset = frame_idx - start;
+            if (channel_idx >= frames.size() || offset < 0 || offset >= frames[(size_t)channel_idx].size())
+                return 0.0;
+            return frames[(size_t)channel_idx][(size_t)offset];
+        }
+    };
+
+  private:
+    rage::TripleBuffer<Render> renders;
+
+  public:
+    // worker, renders of one cache never run at the same time
+    auto back() -> Render& {
+        return renders.back();
+    }
+
+    void publish() {
+        renders.publish();
+    }
+
+    // audio thread, the newest published render if it is of version. a frame is read from what one call
+    // returned, a later call may already switch to a newer render
+    auto ready(uint64_t version) const -> const Render* {
+        const Render& render = renders.read();
+        return renders.epoch() > 0 && render.version == version ? &render : nullptr;
+    }
+};
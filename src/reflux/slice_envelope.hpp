@@ -0,0 +1,80 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cmath>
+
+/*
+Attack / release envelope of a slice. The curve shapes live in one shared table per shape and every range
+change folds start, stop, attack and release into a scale and offset per ramp, so evaluating the envelope is
+a multiply-add into the table and a lerp, with no division per sample.
+*/
+
+struct SliceEnvelope {
+    enum Shape { LINEAR = 0, EXPONENTIAL, EQUAL_POWER, NUM_SHAPES };
+    enum { TABLE_SIZE = 1024 };
+
+  private:
+    using Table = std::array<float, TABLE_SIZE + 1>;
+
+    // shared by every slice, built on first use
+    static auto table(Shape shape) -> const Table& {
+        struct Tables {
+            std::array<Table, NUM_SHAPES> shapes;
+
+            Tables() {
+                // exponential rises over about 40 dB, normalized to reach 0 and 1 at the ends
+                const double curve = 4.6;
+                for (int i = 0; i <= TABLE_SIZE; i++) {
+                    const double x = (double)i / TABLE_SIZE;
+                    shapes[LINEAR][i] = (float)x;
+                    shapes[EXPONENTIAL][i] = (float)((std::exp(curve * x) - 1.0) / (std::exp(curve) - 1.0));
+                    shapes[EQUAL_POWER][i] = (float)std::sin(x * M_PI / 2);
+                }
+            }
+        };
+        static const Tables tables;
+        return tables.shapes[shape];
+    }
+
+    const Table* curve = &table(LINEAR);
+    double attack_end = 0;
+    double attack_scale = 0;
+    double attack_offset = 0;
+    double release_begin = 0;
+    double release_scale = 0;
+    double release_offset = 0;
+    bool has_attack = false;
+    bool has_release = false;
+
+    auto lookup(double x) const -> double {
+        const double pos = std::min(std::max(x, 0.0), 1.0) * TABLE_SIZE;
+        const int idx = std::min((int)pos, TABLE_SIZE - 1);
+        const double frac = pos - idx;
+        return (*curve)[idx] + ((*curve)[idx + 1] - (*curve)[idx]) * frac;
+    }
+
+  public:
+    Shape shape = LINEAR;
+
+    // the attack ramp rises over [start, attack], the release ramp falls over [release, stop]
+    void configure(double start, double stop, double attack, double release) {
+        curve = &table(shape);
+
+        has_attack = attack > start;
+        attack_end = attack;
+        attack_scale = has_attack ? 1.0 / (attack - start) : 0.0;
+        attack_offset = -start * attack_scale;
+
+        has_release = release < stop;
+        release_begin = release;
+        release_scale = has_release ? -1.0 / (stop - release) : 0.0;
+        release_offset = -stop * release_scale;
+    }
+
+    auto gain(double frame) const -> double {
+        const double attack_gain = has_attack && frame < attack_end ? lookup(frame * attack_scale + attack_offset) : 1.0;
+        const double release_gain =
+            has_release && frame > release_begin ? lookup(frame * release_scale + release_offset) : 1.0;
+        return attack_gain * release_gain;
+    }
+};
@@ -0,0 +1,194 @@
+#pragma once
+#include <sndfile.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <cmath>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "audio_base.hpp"
+#include "slice_envelope.hpp"
+
+/*
+Writes slices to files of their own on the shared pool, one task per slice so an export spreads over every
+worker. Jobs copy the slice range, envelope and profile settings when the export starts, so slices can be
+edited or deleted meanwhile; only the clip samples are read while writing. A written job lets go of the clip
+storage right away, on its worker.
+*/
+
+struct SliceExporter {
+    enum Format { WAV = 0, FLAC, NUM_FORMATS };
+    enum { CHUNK_FRAMES = 4096 };
+
+    struct Job {
+        std::function<double(IdxType, IdxType)> get_sample = nullptr;  // of the clip, without envelope
+        std::shared_ptr<const void> source;  // owns what get_sample reads
+        SliceEnvelope envelope;
+        IdxType num_channels = 0;
+        IdxType frame_rate = 0;
+        IdxType start = 0;
+        IdxType stop = 0;
+        std::string path;
+        Format format = WAV;
+
+        // playback profile, only applied with apply_profile
+        bool apply_profile = false;
+        double speed = 1.0;
+        double volume = 1.0;
+        double pan = 0.0;
+        RealtimeMultiChannelTuner::OutputMode tuner_mode = RealtimeMultiChannelTuner::OFF;
+        double freq = 0;
+        double range = 0;
+        double xhift = 1;
+
+        void copy_profile(const PlaybackProfile& profile) {
+            apply_profile = true;
+            speed = profile.speed.value;
+            volume = profile.volume.value;
+            pan = profile.pan.value;
+            tuner_mode = profile.tuner_mode;
+            freq = profile.freq.value;
+            range = profile.range.value;
+            xhift = profile.xhift.value;
+        }
+    };
+
+    static auto extension(Format format) -> std::string {
+        return format == FLAC ? "flac" : "wav";
+    }
+
+  private:
+    std::vector<std::unique_ptr<Job>> jobs;
+    std::atomic<size_t> num_jobs {0};
+    std::atomic<size_t> num_done {0};
+    std::atomic<size_t> num_failed {0};
+
+  public:
+    ~SliceExporter() {
+        rage::WorkerPool::shared().cancel_owner(this);
+    }
+
+    auto is_busy() const -> bool {
+        return num_done < num_jobs;
+    }
+
+    // progress of the last export
+    auto done() const -> size_t {
+        return num_done;
+    }
+
+    auto total() const -> size_t {
+        return num_jobs;
+    }
+
+    auto failed() const -> size_t {
+        return num_failed;
+    }
+
+    // ui thread, queues every job. false while the previous export is still running
+    auto start(std::vector<std::unique_ptr<Job>> new_jobs) -> bool {
+        if (is_busy())
+            return false;
+
+        jobs = std::move(new_jobs);
+        num_done = 0;
+        num_failed = 0;
+        num_jobs = jobs.size();
+        for (auto& job : jobs) {
+            Job* pending = job.get();
+            auto task = [this, pending] {
+                if (!write(*pending))
+                    num_failed += 1;
+                pending->get_sample = nullptr;
+                pending->source.reset();
+                num_done += 1;
+            };
+            if (!rage::WorkerPool::shared().post(pending, std::move(task), rage::WorkerPool::NORMAL, this)) {
+                num_failed += 1;
+                num_done += 1;
+            }
+        }
+        return true;
+    }
+
+    static auto write(const Job& job) -> bool {
+        if (job.stop <= job.start || job.num_channels == 0)
+            return false;
+
+        SF_INFO info = {};
+        info.samplerate = (int)job.frame_rate;
+        info.channels = (int)job.num_channels;
+        info.format = (job.format == FLAC ? SF_FORMAT_FLAC : SF_FORMAT_WAV) | SF_FORMAT_PCM_24;
+        SNDFILE* file = sf_open(job.path.c_str(), SFM_WRITE, &info);
+        if (!file) {
+            std::cout << "Failed to open slice export file: " << sf_strerror(file) << std::endl;
+            return false;
+        }
+        // boosted or panned frames past full scale are clipped instead of wrapping around in the integer format
+        sf_command(file, SFC_SET_CLIPPING, NULL, SF_TRUE);
+
+        TunerLease lease;
+        RealtimeMultiChannelTuner* tuner = nullptr;
+        if (job.apply_profile && job.tuner_mode != RealtimeMultiChannelTuner::OFF) {
+            tuner = lease.acquire();
+            tuner->set_sample_rate(job.frame_rate);
+            tuner->set_channels(job.num_channels);
+            tuner->config_filters(job.freq, job.range);
+            tuner->set_period_ratio(job.xhift);
+            tuner->set_output_mode(job.tuner_mode);
+        }
+
+        // the slice as a one shot at the profile speed, backwards from its last frame for negative speeds
+        const double step = job.apply_profile ? std::max(std::abs(job.speed), 0.01) : 1.0;
+        const bool reverse = job.apply_profile && job.speed < 0;
+        const IdxType num_out = (IdxType)((job.stop - job.start) / step);
+        const IdxType last = job.stop - 1;
+        auto sample_at = [&](IdxType cidx, double pos) {
+            const IdxType less = (IdxType)pos;
+            const IdxType more = std::min<IdxType>(less + 1, last);
+            const double less_sample = job.envelope.gain(less) * job.get_sample(cidx, less);
+            const double more_sample = job.envelope.gain(more) * job.get_sample(cidx, more);
+            return less_sample + (more_sample - less_sample) * (pos - less);
+        };
+
+        std::vector<double> frame(job.num_channels);
+        std::vector<double> buffer(CHUNK_FRAMES * job.num_channels);
+        bool ok = true;
+        for (IdxType first = 0; first < num_out && ok; first += CHUNK_FRAMES) {
+            const IdxType count = std::min<IdxType>(CHUNK_FRAMES, num_out - first);
+            for (IdxType i = 0; i < count; i++) {
+                const double offset = (first + i) * step;
+                const double pos = reverse ? last - offset : job.start + offset;
+                for (IdxType cidx = 0; cidx < job.num_channels; cidx++) {
+                    frame[cidx] = sample_at(cidx, pos);
+                }
+                if (tuner)
+                    frame = tuner->process(frame);
+                if (job.apply_profile)
+                    apply_volume_pan(job, frame);
+                std::copy(frame.begin(), frame.end(), buffer.begin() + i * job.num_channels);
+            }
+            ok = sf_writef_double(file, buffer.data(), count) == (sf_count_t)count;
+        }
+
+        sf_close(file);
+        return ok;
+    }
+
+  private:
+    // same mid / side pan as playback, mono and multichannel slices only get the volume
+    static void apply_volume_pan(const Job& job, std::vector<double>& frame) {
+        if (frame.size() == 2) {
+            const double mid = (frame[0] + frame[1]) / 2;
+            const double side = (frame[0] - frame[1]) / 2;
+            frame[0] = mid + side * job.pan;
+            frame[1] = mid - side * job.pan;
+        }
+        for (auto& value : frame) {
+            value *= job.volume;
+        }
+    }
+};
@@ -0,0 +1,406 @@
+#pragma once
+#include <stdint.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "analysis_slot.hpp"
+#include "audio_base.hpp"
+#include "clip_audio.hpp"
+
+/*
+References:
+    - Davis, Mermelstein, "Comparison of parametric representations for monosyllabic word recognition in
+      continuously spoken sentences" (mel frequency cepstral coefficients)
+    - Peeters, "A large set of audio features for sound description" (spectral centroid and flatness)
+
+A slice is summed into one power spectrum over its first few half overlapping windows, which cover the attack
+and body that tell hits apart. That spectrum is reduced to a small timbre vector: cepstral coefficients of mel
+band energies, the overall log energy, spectral centroid, spectral flatness and the slice length.
+The similarity index scales every feature to unit variance over the analyzed slices and compares vectors four
+features at a time. Even a few thousand slices are ranked in well under a millisecond by brute force, so there
+is no tree to keep balanced while slices come and go. Index and ranking are made on the worker pool from copies
+of the features, the audio thread only looks up the published order.
+*/
+
+struct SliceFeatures {
+    enum { NUM_CEPSTRA = 12 };
+    enum { SIZE = 16 };  // cepstra 1 to 12, log energy, log centroid, flatness, log length
+
+    std::array<float, SIZE> values {};
+    bool silent = true;
+
+    // what the features were extracted from, a slice with other values needs new ones
+    IdxType start = 0;
+    IdxType stop = 0;
+    uint64_t version = 0;
+    bool analyzed = false;
+
+    auto matches(IdxType start, IdxType stop, uint64_t version) const -> bool {
+        return analyzed && this->start == start && this->stop == stop && this->version == version;
+    }
+
+    json_t* make_json_obj() const {
+        json_t* root = json_object();
+        json_t* json_values = json_array();
+        for (float value : values) {
+            json_array_append_new(json_values, json_real(value));
+        }
+        json_object_set_new(root, "values", json_values);
+        json_object_set_new(root, "silent", json_boolean(silent));
+        json_object_set_new(root, "start", json_real(start));
+        json_object_set_new(root, "stop", json_real(stop));
+        return root;
+    }
+
+    // version is not stored, the owner passes the current one of the audio the features were saved with
+    void load_json(json_t* root, uint64_t version) {
+        json_t* json_values = json_object_get(root, "values");
+        if (json_array_size(json_values) != SIZE)
+            return;
+        for (size_t idx = 0; idx < SIZE; idx++) {
+            values[idx] = json_real_value(json_array_get(json_values, idx));
+        }
+        silent = json_boolean_value(json_object_get(root, "silent"));
+        start = json_real_value(json_object_get(root, "start"));
+        stop = json_real_value(json_object_get(root, "stop"));
+        this->version = version;
+        analyzed = true;
+    }
+};
+
+struct FeatureExtractor {
+    enum { FFT_SIZE = 2048 };
+    enum { HOP = FFT_SIZE / 2 };
+    enum { MAX_WINDOWS = 16 };
+    enum { NUM_BANDS = 24 };
+
+    struct Request {
+        std::shared_ptr<const ClipAudio> audio;  // read on the worker, kept alive until the task is done
+        IdxType num_channels = 0;
+        IdxType frame_rate = 0;
+        IdxType start = 0;
+        IdxType stop = 0;
+        uint64_t version = 0;
+    };
+
+    static auto extract(const Request& request) -> SliceFeatures {
+        SliceFeatures result;
+        result.start = request.start;
+        result.stop = request.stop;
+        result.version = request.version;
+        result.analyzed = true;
+        if (request.num_channels == 0 || request.frame_rate == 0 || request.stop <= request.start)
+            return result;
+
+        rack::dsp::RealFFT fft(FFT_SIZE);
+        alignas(16) std::array<float, FFT_SIZE> frame;
+        alignas(16) std::array<float, FFT_SIZE> spectrum;
+        std::vector<double> power(FFT_SIZE / 2, 0.0);
+
+        // short slices are one zero padded window
+        const IdxType length = request.stop - request.start;
+        const IdxType num_windows = std::min<IdxType>((length + HOP - 1) / HOP, MAX_WINDOWS);
+        const float channel_gain = 1.f / request.num_channels;
+        double square = 0.0;
+        IdxType frames_read = 0;
+        for (IdxType w = 0; w < num_windows; w++) {
+            const IdxType begin = request.start + w * HOP;
+            for (IdxType i = 0; i < FFT_SIZE; i++) {
+                float sample = 0.f;
+                if (begin + i < request.stop) {
+                    for (IdxType cidx = 0; cidx < request.num_channels; cidx++) {
+                        sample += (float)request.audio->get_sample(cidx, begin + i);
+                    }
+                    sample *= channel_gain;
+                    square += sample * sample;
+                    frames_read += 1;
+                }
+                const float window = 0.5f * (1.f - std::cos(2.f * (float)M_PI * i / FFT_SIZE));
+                frame[i] = sample * window;
+            }
+            fft.rfft(frame.data(), spectrum.data());
+            // pffft packs DC and nyquist into the first pair, both are skipped
+            for (size_t k = 1; k < FFT_SIZE / 2; k++) {
+                const double re = spectrum[2 * k];
+                const double im = spectrum[2 * k + 1];
+                power[k] += re * re + im * im;
+            }
+        }
+        // under -80dB there is nothing to compare
+        if (frames_read == 0 || square / frames_read < 1e-8)
+            return result;
+        result.silent = false;
+
+        auto mel = [](double hz) { return 2595.0 * std::log10(1.0 + hz / 700.0); };
+        const double bin_hz = (double)request.frame_rate / FFT_SIZE;
+        const double low_mel = mel(40.0);
+        const double high_mel = mel(std::min(16000.0, request.frame_rate * 0.45));
+
+        // triangular mel bands centered on 1..NUM_BANDS between the edges 0 and NUM_BANDS + 1
+        std::array<double, NUM_BANDS> bands {};
+        double total = 0.0;
+        double weighted_hz = 0.0;
+        double log_sum = 0.0;
+        size_t num_bins = 0;
+        for (size_t k = 1; k < FFT_SIZE / 2; k++) {
+            const double pos = (mel(k * bin_hz) - low_mel) / (high_mel - low_mel) * (NUM_BANDS + 1);
+            if (pos <= 0.0 || pos >= NUM_BANDS + 1)
+                continue;
+            const size_t band = (size_t)pos;
+            const double frac = pos - band;
+            if (band >= 1)
+                bands[band - 1] += (1.0 - frac) * power[k];
+            if (band < NUM_BANDS)
+                bands[band] += frac * power[k];
+            total += power[k];
+            weighted_hz += k * bin_hz * power[k];
+            log_sum += std::log(std::max(power[k], 1e-12));
+            num_bins += 1;
+        }
+        if (num_bins == 0 || total <= 0.0)
+            return result;
+
+        std::array<double, NUM_BANDS> log_bands;
+        for (size_t b = 0; b < NUM_BANDS; b++) {
+            log_bands[b] = std::log(std::max(bands[b], 1e-12));
+        }
+        // DCT-II of the log band energies, c0 is the overall log energy
+        for (size_t c = 0; c <= SliceFeatures::NUM_CEPSTRA; c++) {
+            double sum = 0.0;
+            for (size_t b = 0; b < NUM_BANDS; b++) {
+                sum += log_bands[b] * std::cos(M_PI * c * (b + 0.5) / NUM_BANDS);
+            }
+            if (c == 0)
+                result.values[SliceFeatures::NUM_CEPSTRA] = sum / NUM_BANDS;
+            else
+                result.values[c - 1] = sum / NUM_BANDS;
+        }
+        result.values[13] = std::log2(weighted_hz / total);
+        result.values[14] = std::exp(log_sum / num_bins) / (total / num_bins);
+        result.values[15] = std::log2((double)length / request.frame_rate);
+        return result;
+    }
+
+  private:
+    std::atomic<bool> finished {false};
+
+  public:
+    using Slot = AnalysisSlot<SliceFeatures>;
+
+    ~FeatureExtractor() {
+        rage::WorkerPool::shared().cancel_owner(this);
+    }
+
+    // audio thread, at most one extraction per slot is queued at a time. the slot has to outlive the extractor
+    void analyze(const Request& request, Slot& slot) {
+        uint64_t ticket;
+        if (!slot.begin(ticket))
+            return;
+        Slot* target = &slot;
+        auto task = [this, request, target, ticket] {
+            target->finish(ticket, extract(request));
+            finished = true;
+        };
+        // a full queue leaves the slot unanalyzed, it is asked for again later
+        if (!rage::WorkerPool::shared().post(target, std::move(task), rage::WorkerPool::LOW, this))
+            slot.cancel_begin();
+    }
+
+    // audio thread, true when some slot may have a result to take since the last call
+    auto has_finished() -> bool {
+        return finished.exchange(false);
+    }
+};
+
+struct SimilarityIndex {
+    enum { LANES = SliceFeatures::SIZE / 4 };
+
+  private:
+    std::vector<size_t> positions;  // caller's position of every indexed entry
+    std::vector<rack::simd::float_4> rows;  // LANES scaled vectors per entry
+
+  public:
+    // indexes the analyzed, non silent entries of features, nullptr entries are skipped
+    void build(const std::vector<const SliceFeatures*>& features) {
+        positions.clear();
+        rows.clear();
+        std::array<double, SliceFeatures::SIZE> mean {};
+        std::array<double, SliceFeatures::SIZE> square {};
+        for (size_t pos = 0; pos < features.size(); pos++) {
+            const SliceFeatures* entry = features[pos];
+            if (!entry || !entry->analyzed || entry->silent)
+                continue;
+            positions.push_back(pos);
+            for (size_t f = 0; f < SliceFeatures::SIZE; f++) {
+                mean[f] += entry->values[f];
+                square[f] += (double)entry->values[f] * entry->values[f];
+            }
+        }
+        if (positions.empty())
+            return;
+
+        // features that do not vary between slices get no weight
+        std::array<float, SliceFeatures::SIZE> offset;
+        std::array<float, SliceFeatures::SIZE> scale;
+        for (size_t f = 0; f < SliceFeatures::SIZE; f++) {
+            mean[f] /= positions.size();
+            const double variance = square[f] / positions.size() - mean[f] * mean[f];
+            offset[f] = (float)mean[f];
+            scale[f] = variance > 1e-12 ? (float)(1.0 / std::sqrt(variance)) : 0.f;
+        }
+
+        rows.reserve(positions.size() * LANES);
+        for (size_t pos : positions) {
+            const SliceFeatures& entry = *features[pos];
+            for (size_t lane = 0; lane < LANES; lane++) {
+                rack::simd::float_4 row;
+                for (size_t i = 0; i < 4; i++) {
+                    const size_t f = lane * 4 + i;
+                    row[i] = (entry.values[f] - offset[f]) * scale[f];
+                }
+                rows.push_back(row);
+            }
+        }
+    }
+
+    auto size() const -> size_t {
+        return positions.size();
+    }
+
+    // positions of all indexed entries from the most to the least similar to anchor, anchor first.
+    // empty when anchor is not indexed
+    auto ranked(size_t anchor) const -> std::vector<size_t> {
+        std::vector<size_t> order;
+        auto found = std::lower_bound(positions.begin(), positions.end(), anchor);
+        if (found == positions.end() || *found != anchor)
+            return order;
+        const rack::simd::float_4* query = &rows[(found - positions.begin()) * LANES];
+
+        std::vector<std::pair<float, size_t>> distances;
+        distances.reserve(positions.size());
+        for (size_t entry = 0; entry < positions.size(); entry++) {
+            if (positions[entry] == anchor)
+                continue;
+            const rack::simd::float_4* row = &rows[entry * LANES];
+            rack::simd::float_4 sum = 0.f;
+            for (size_t lane = 0; lane < LANES; lane++) {
+                const rack::simd::float_4 diff = row[lane] - query[lane];
+                sum += diff * diff;
+            }
+            distances.emplace_back(sum[0] + sum[1] + sum[2] + sum[3], positions[entry]);
+        }
+        std::sort(distances.begin(), distances.end());
+
+        order.reserve(distances.size() + 1);
+        order.push_back(anchor);
+        for (const auto& distance : distances) {
+            order.push_back(distance.second);
+        }
+        return order;
+    }
+};
+
+// Ranks slices by similarity to an anchor slice on the worker pool. Slices are named by their slice table row,
+// which stays with the slice while positions shift as slices are added and deleted
+struct SimilarityRanker {
+    using Row = uint32_t;
+    enum { MAX_SLICES = 4096 };  // as many rows as the slice table reserves, more slices are left unranked
+
+    struct Ranked {
+        uint64_t id = 0;  // of the request this answers
+        Row anchor = 0;
+        std::vector<Row> rows;  // from the most to the least similar to anchor, anchor first
+    };
+
+  private:
+    struct Entry {
+        Row row = 0;
+        SliceFeatures features;
+    };
+
+    struct Request {
+        uint64_t id = 0;
+        Row anchor = 0;
+        std::vector<Entry> entries = std::vector<Entry>(MAX_SLICES);
+        size_t count = 0;
+    };
+
+    rage::TripleBuffer<Request> requested;
+    rage::TripleBuffer<Ranked> published;
+    uint64_t latest_id = 0;  // audio thread only
+    Row latest_anchor = 0;
+
+    void run() {
+        const Request& in = requested.read();
+        std::vector<const SliceFeatures*> features(in.count, nullptr);
+        size_t anchor = SIZE_MAX;
+        for (size_t pos = 0; pos < in.count; pos++) {
+            features[pos] = &in.entries[pos].features;
+            if (in.entries[pos].row == in.anchor)
+                anchor = pos;
+        }
+        SimilarityIndex index;
+        index.build(features);
+
+        Ranked& out = published.back();
+        out.id = in.id;
+        out.anchor = in.anchor;
+        out.rows.clear();
+        for (size_t pos : index.ranked(anchor)) {
+            out.rows.push_back(in.entries[pos].row);
+        }
+        published.publish();
+    }
+
+  public:
+    ~SimilarityRanker() {
+        rage::WorkerPool::shared().cancel_owner(this);
+    }
+
+    // audio thread, starts collecting the slices of the next request
+    void begin(Row anchor) {
+        Request& request = requested.back();
+        request.anchor = anchor;
+        request.count = 0;
+    }
+
+    // audio thread
+    void add(Row row, const SliceFeatures& features) {
+        Request& request = requested.back();
+        if (request.count == request.entries.size())
+            return;
+        Entry& entry = request.entries[request.count++];
+        entry.row = row;
+        entry.features = features;
+    }
+
+    // audio thread, false when the pool queue is full and the slices have to be handed over again
+    auto request() -> bool {
+        Request& request = requested.back();
+        request.id = ++latest_id;
+        latest_anchor = request.anchor;
+        requested.publish();
+        return rage::WorkerPool::shared().post(this, [this] { run(); }, rage::WorkerPool::LOW, this);
+    }
+
+    // audio thread, the last ranking that arrived
+    auto ranked() const -> const Ranked& {
+        return published.read();
+    }
+
+    // audio thread, the last request was answered
+    auto is_current() const -> bool {
+        return published.read().id == latest_id;
+    }
+
+    auto requested_anchor() const -> Row {
+        return latest_anchor;
+    }
+};
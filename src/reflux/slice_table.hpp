@@ -0,0 +1,142 @@
+#pragma once
+#include <stdint.h>
+
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+#include "pitch_analyzer.hpp"
+#include "slice_features.hpp"
+
+struct AudioSlice;
+
+/*
+Hot per slice state kept in contiguous arrays, one row per slice. A row stays with its slice for the slice's
+whole life (freed rows are reused), so reordering or deleting slices never moves any data.
+Range fields mirror the slice's knobs and are rewritten whenever they change; read position and playing flag
+live only here. The per sample loops only visit the active rows, i.e. slices that are playing or still have
+timer work queued, so idle slices cost nothing.
+All columns are reserved for RESERVED_ROWS rows up front, so adding slices up to that many never reallocates
+a column the UI may be reading from. Analysis slots are written by workers and live in deques, which never
+move a row once it exists.
+*/
+
+struct SliceTable {
+    using Row = uint32_t;
+    enum { RESERVED_ROWS = 4096 };
+
+    std::vector<double> start;
+    std::vector<double> stop;
+    std::vector<double> attack;
+    std::vector<double> release;
+    std::vector<double> read;
+    std::vector<uint8_t> playing;
+    std::vector<double> gain;  // auto gain playback is at, slews towards gain_target
+    std::vector<double> gain_target;  // auto gain measured for the row, 1 when off
+    std::vector<AudioSlice*> owner;  // cold data of the row, nullptr for free rows
+    std::deque<PitchAnalyzer::Slot> pitch_slot;
+    std::deque<FeatureExtractor::Slot> feature_slot;
+
+  private:
+    std::vector<Row> free_rows;
+    std::vector<Row> active;
+    std::vector<uint8_t> is_active;
+
+  public:
+    SliceTable() {
+        reserve(RESERVED_ROWS);
+    }
+
+    void reserve(size_t rows) {
+        start.reserve(rows);
+        stop.reserve(rows);
+        attack.reserve(rows);
+        release.reserve(rows);
+        read.reserve(rows);
+        playing.reserve(rows);
+        gain.reserve(rows);
+        gain_target.reserve(rows);
+        owner.reserve(rows);
+        free_rows.reserve(rows);
+        active.reserve(rows);
+        is_active.reserve(rows);
+    }
+
+    auto acquire(AudioSlice* slice) -> Row {
+        Row row;
+        if (!free_rows.empty()) {
+            row = free_rows.back();
+            free_rows.pop_back();
+        } else {
+            row = (Row)owner.size();
+            start.push_back(0);
+            stop.push_back(0);
+            attack.push_back(0);
+            release.push_back(0);
+            read.push_back(0);
+            playing.push_back(0);
+            gain.push_back(1.0);
+            gain_target.push_back(1.0);
+            owner.push_back(nullptr);
+            pitch_slot.emplace_back();
+            feature_slot.emplace_back();
+            is_active.push_back(0);
+        }
+        owner[row] = slice;
+        playing[row] = 0;
+        gain[row] = 1.0;
+        gain_target[row] = 1.0;
+        return row;
+    }
+
+    void release_row(Row row) {
+        owner[row] = nullptr;
+        playing[row] = 0;
+        pitch_slot[row].abandon();
+        feature_slot[row].abandon();
+        if (is_active[row]) {
+            is_active[row] = 0;
+            active.erase(std::find(active.begin(), active.end(), row));
+        }
+        free_rows.push_back(row);
+    }
+
+    void set_range(Row row, double start, double stop, double attack, double release) {
+        this->start[row] = start;
+        this->stop[row] = stop;
+        this->attack[row] = attack;
+        this->release[row] = release;
+    }
+
+    void set_playing(Row row, bool value) {
+        playing[row] = value;
+        if (value)
+            activate(row);
+    }
+
+    // queues a row for the per sample loops until visit reports it idle
+    void activate(Row row) {
+        if (is_active[row])
+            return;
+        is_active[row] = 1;
+        active.push_back(row);
+    }
+
+    auto active_rows() const -> const std::vector<Row>& {
+        return active;
+    }
+
+    // calls busy(row) for every active row and drops the rows it returns false for
+    template<class F>
+    void visit_active(F busy) {
+        size_t kept = 0;
+        for (size_t idx = 0; idx < active.size(); idx++) {
+            const Row row = active[idx];
+            if (busy(row))
+                active[kept++] = row;
+            else
+                is_active[row] = 0;
+        }
+        active.resize(kept);
+    }
+};
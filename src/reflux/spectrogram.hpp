@@ -0,0 +1,244 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <functional>
+#include <memory>
+#include <limits>
+#include <mutex>
+#include <stdint.h>
+#include <vector>
+
+#include "plugin.hpp"
+#include "src/shared/triple_buffer.hpp"
+#include "src/shared/worker_pool.hpp"
+
+/*
+Spectrogram of a clip, kept as one column of log spaced frequency rows every COLUMN_FRAMES frames.
+Columns are computed on the worker pool the first time a view needs them and then only for new audio, so
+recording extends the cache incrementally. Views are rendered from the cache into small RGBA images that the
+ui thread only has to upload.
+*/
+
+struct SpectrogramImage {
+    int width = 0;
+    int height = 0;
+    std::vector<uint8_t> rgba;
+};
+
+using SpectrogramSlot = rage::TripleBuffer<SpectrogramImage>;
+
+struct SpectrogramCache {
+    enum { FFT_SIZE = 1024 };
+    enum { NUM_BINS = FFT_SIZE / 2 };
+    enum { COLUMN_FRAMES = 512 };
+    enum { ROWS = 64 };
+    enum { MAX_COLUMNS_PER_POINT = 16 };
+
+    struct RenderArgs {
+        std::function<double(uintptr_t, uintptr_t)> get_sample = nullptr;
+        std::shared_ptr<const void> source;  // owns what get_sample reads
+        SpectrogramSlot* dst = nullptr;
+        uintptr_t num_channels = 0;
+        uintptr_t num_frames = 0;
+        double sample_rate = 0;
+        uintptr_t start = 0;
+        uintptr_t stop = 0;
+        uintptr_t points = 0;
+    };
+
+  private:
+    static constexpr float MIN_DB = -96.f;
+    static constexpr float MIN_FREQ = 40.f;
+
+    std::mutex mutex;
+    std::vector<uint8_t> cells;  // [column][row], 0 = MIN_DB, 255 = full scale
+    size_t computed_columns = 0;
+    size_t complete_columns = 0;  // columns whose whole window was available when computed
+    double sample_rate = 0;
+    // bins [row_first, row_last) of each row, low rows narrower than a bin repeat it
+    std::array<int, ROWS> row_first {};
+    std::array<int, ROWS> row_last {};
+    std::atomic<uint64_t> dirty_frame {std::numeric_limits<uint64_t>::max()};
+
+    void configure(double sample_rate) {
+        this->sample_rate = sample_rate;
+        const float nyquist = (float)sample_rate / 2;
+        const float ratio = std::pow(nyquist / MIN_FREQ, 1.f / ROWS);
+        float freq = MIN_FREQ;
+        for (int row = 0; row < ROWS; row++) {
+            const float first_bin = freq / nyquist * NUM_BINS;
+            const float last_bin = freq * ratio / nyquist * NUM_BINS;
+            row_first[row] = clamp((int)std::round(first_bin), 1, (int)NUM_BINS - 1);
+            row_last[row] = clamp((int)std::round(last_bin), row_first[row] + 1, (int)NUM_BINS);
+            freq *= ratio;
+        }
+        cells.clear();
+        computed_columns = complete_columns = 0;
+    }
+
+    void compute_column(
+        const RenderArgs& args,
+        size_t column,
+        rack::dsp::RealFFT& fft,
+        float* frame,
+        float* spectrum,
+        float* power,
+        const float* window
+    ) {
+        using rack::simd::float_4;
+        const uintptr_t begin = column * COLUMN_FRAMES;
+        const float channel_gain = 1.f / std::max<uintptr_t>(args.num_channels, 1);
+        for (size_t i = 0; i < FFT_SIZE; i++) {
+            float sum = 0.f;
+            if (begin + i < args.num_frames) {
+                for (uintptr_t cidx = 0; cidx < args.num_channels; cidx++) {
+                    sum += (float)args.get_sample(cidx, begin + i);
+                }
+            }
+            frame[i] = sum * channel_gain * window[i];
+        }
+        fft.rfft(frame, spectrum);
+
+        // |X|^2 of four bins at a time, bin k is (spectrum[2k], spectrum[2k + 1])
+        for (size_t k = 0; k < NUM_BINS; k += 4) {
+            const float_4 a = float_4::load(&spectrum[2 * k]);
+            const float_4 b = float_4::load(&spectrum[2 * k + 4]);
+            const float_4 a2 = a * a;
+            const float_4 b2 = b * b;
+            power[k] = a2[0] + a2[1];
+            power[k + 1] = a2[2] + a2[3];
+            power[k + 2] = b2[0] + b2[1];
+            power[k + 3] = b2[2] + b2[3];
+        }
+        power[0] = spectrum[0] * spectrum[0];  // packed dc / nyquist
+
+        alignas(16) float row_power[ROWS];
+        for (int row = 0; row < ROWS; row++) {
+            float peak = 0.f;
+            for (int k = row_first[row]; k < row_last[row]; k++) {
+                peak = std::max(peak, power[k]);
+            }
+            row_power[row] = peak;
+        }
+
+        // a full scale sine through the hann window peaks at (FFT_SIZE / 4)^2
+        const float_4 norm = 1.f / ((FFT_SIZE / 4.f) * (FFT_SIZE / 4.f));
+        const float_4 scale = 255.f / -MIN_DB;
+        uint8_t* out = &cells[column * ROWS];
+        for (int row = 0; row < ROWS; row += 4) {
+            const float_4 db = 10.f * rack::simd::log10(float_4::load(&row_power[row]) * norm + 1e-12f);
+            const float_4 level = rack::simd::fmin(rack::simd::fmax((db - MIN_DB) * scale, 0.f), 255.f);
+            for (int i = 0; i < 4; i++) {
+                out[row + i] = (uint8_t)level[i];
+            }
+        }
+    }
+
+    // computes the columns that are missing or were invalidated, call with the mutex held
+    void update(const RenderArgs& args) {
+        if (args.sample_rate != sample_rate)
+            configure(args.sample_rate);
+
+        const uint64_t dirty = dirty_frame.exchange(std::numeric_limits<uint64_t>::max());
+        if (dirty != std::numeric_limits<uint64_t>::max())
+            complete_columns = std::min<size_t>(complete_columns, dirty / COLUMN_FRAMES);
+        computed_columns = std::min(computed_columns, complete_columns);
+
+        const size_t num_columns = (args.num_frames + COLUMN_FRAMES - 1) / COLUMN_FRAMES;
+        if (computed_columns >= num_columns && num_columns * ROWS == cells.size())
+            return;
+        cells.resize(num_columns * ROWS);
+
+        rack::dsp::RealFFT fft(FFT_SIZE);
+        alignas(16) std::array<float, FFT_SIZE> frame;
+        alignas(16) std::array<float, FFT_SIZE> spectrum;
+        alignas(16) std::array<float, NUM_BINS> power;
+        std::array<float, FFT_SIZE> window;
+        for (size_t i = 0; i < FFT_SIZE; i++) {
+            window[i] = 0.5f * (1.f - std::cos(2.f * (float)M_PI * i / FFT_SIZE));
+        }
+
+        for (size_t column = computed_columns; column < num_columns; column++) {
+            compute_column(args, column, fft, frame.data(), spectrum.data(), power.data(), window.data());
+        }
+        computed_columns = num_columns;
+        // windows that ran past the end are recomputed once more audio arrives
+        const uintptr_t full = args.num_frames >= FFT_SIZE ? (args.num_frames - FFT_SIZE) / COLUMN_FRAMES + 1 : 0;
+        complete_columns = std::min<size_t>(full, num_columns);
+    }
+
+    static void heat_color(float level, uint8_t* rgba) {
+        // black, blue, magenta, orange, yellow
+        static const float stops[5][3] = {{0, 0, 0}, {20, 30, 140}, {170, 40, 150}, {250, 130, 30}, {255, 240, 120}};
+        const float pos = clamp(level, 0.f, 1.f) * 4.f;
+        const int idx = std::min((int)pos, 3);
+        const float frac = pos - idx;
+        for (int c = 0; c < 3; c++) {
+            rgba[c] = (uint8_t)(stops[idx][c] + (stops[idx + 1][c] - stops[idx][c]) * frac);
+        }
+        rgba[3] = 255;
+    }
+
+    void render(const RenderArgs& args) {
+        std::lock_guard<std::mutex> lock(mutex);
+        update(args);
+
+        SpectrogramImage& image = args.dst->back();
+        image.width = (int)std::max<uintptr_t>(args.points, 1);
+        image.height = ROWS;
+        image.rgba.resize((size_t)image.width * image.height * 4);
+
+        const size_t num_columns = computed_columns;
+        const double step = (double)(args.stop - args.start) / image.width;
+        std::array<uint8_t, ROWS> levels;
+        for (int x = 0; x < image.width; x++) {
+            const size_t first = (size_t)((args.start + x * step) / COLUMN_FRAMES);
+            const size_t last = std::max(first + 1, (size_t)((args.start + (x + 1) * step) / COLUMN_FRAMES));
+            // sample a bounded number of columns per point so zoomed out views stay cheap
+            const size_t stride = std::max<size_t>(1, (last - first) / MAX_COLUMNS_PER_POINT);
+
+            levels.fill(0);
+            for (size_t column = first; column < last && column < num_columns; column += stride) {
+                const uint8_t* cell = &cells[column * ROWS];
+                for (int row = 0; row < ROWS; row++) {
+                    levels[row] = std::max(levels[row], cell[row]);
+                }
+            }
+            for (int row = 0; row < ROWS; row++) {
+                // high frequencies on top
+                uint8_t* pixel = &image.rgba[((size_t)(ROWS - 1 - row) * image.width + x) * 4];
+                heat_color(levels[row] / 255.f, pixel);
+            }
+        }
+        args.dst->publish();
+    }
+
+  public:
+    SpectrogramCache() = default;
+
+    // copies start out empty and are filled on the next request
+    SpectrogramCache(const SpectrogramCache&) {}
+
+    SpectrogramCache& operator=(const SpectrogramCache&) {
+        invalidate_from(0);
+        return *this;
+    }
+
+    // marks audio from frame on as changed, cheap enough for the audio thread
+    void invalidate_from(uint64_t frame) {
+        uint64_t current = dirty_frame.load(std::memory_order_relaxed);
+        while (frame < current && !dirty_frame.compare_exchange_weak(current, frame)) {
+        }
+    }
+
+    void request(const RenderArgs& args) {
+        rage::WorkerPool::shared().submit(args.dst, [this, args] { render(args); }, rage::WorkerPool::NORMAL, this);
+    }
+
+    // waits out every render that reads this cache
+    void cancel_all() {
+        rage::WorkerPool::shared().cancel_owner(this);
+    }
+};
@@ -0,0 +1,278 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <memory>
+#include <vector>
+
+#include "plugin.hpp"
+#include "src/shared/worker_pool.hpp"
+
+/*
+References:
+    - https://en.wikipedia.org/wiki/Short-time_Fourier_transform (weighted overlap-add)
+    - Mark Dolson, "The phase vocoder: a tutorial" (freeze by accumulating the measured bin frequencies)
+
+Every HOP input frames a new analysis frame is scheduled. Its work is split into steps per channel (forward
+fft, the spectral op over MODIFY_SLICES ranges of bins, inverse fft + overlap-add) which are spread evenly
+across the following hop. A sample runs at most one step, so the most any sample pays is one 1024 point fft,
+and the bin ranges keep the per bin trigonometry of the op to a slice of the spectrum. The extra hop of
+latency gives the steps time to land before their output is read.
+*/
+
+struct SpectralProcessor {
+    enum Mode { OFF = 0, FREEZE, SMEAR, NUM_MODES };
+    enum { FFT_SIZE = 1024 };
+    enum { HOP = FFT_SIZE / 4 };
+    enum { NUM_BINS = FFT_SIZE / 2 + 1 };
+    enum { RING_SIZE = 2 * FFT_SIZE };
+    enum { MAX_CHANNELS = 2 };
+    enum { MODIFY_SLICES = 8 };
+    enum { STEPS_PER_CHANNEL = MODIFY_SLICES + 2 };
+
+  private:
+    struct Channel {
+        alignas(16) std::array<float, FFT_SIZE> frame;
+        alignas(16) std::array<float, FFT_SIZE> spectrum;
+        std::array<float, RING_SIZE> input;
+        std::array<float, RING_SIZE> output;
+        std::array<float, NUM_BINS> smear_mag;
+        std::array<float, NUM_BINS> last_phase;
+        std::array<float, NUM_BINS> frozen_mag;
+        std::array<float, NUM_BINS> frozen_advance;
+        std::array<float, NUM_BINS> synth_phase;
+        bool has_last_phase;
+    };
+
+    rack::dsp::RealFFT fft {FFT_SIZE};
+    std::array<float, FFT_SIZE> window;
+    std::array<Channel, MAX_CHANNELS> channels;
+    uint64_t time = 0;
+    uint64_t frame_end = 0;
+    int next_step = STEPS_PER_CHANNEL * MAX_CHANNELS;
+    bool frozen = false;
+    bool capture = false;
+    Mode frame_mode = OFF;
+
+    static auto wrap(uint64_t t) -> size_t {
+        return (size_t)(t & (RING_SIZE - 1));
+    }
+
+    void analyze(Channel& ch) {
+        const uint64_t begin = frame_end - FFT_SIZE;
+        for (size_t i = 0; i < FFT_SIZE; i++) {
+            ch.frame[i] = ch.input[wrap(begin + i)] * window[i];
+        }
+        fft.rfft(ch.frame.data(), ch.spectrum.data());
+    }
+
+    // bin k is stored at spectrum[2k], spectrum[2k + 1]; dc and nyquist are packed into spectrum[0], spectrum[1].
+    // slice picks one of MODIFY_SLICES ranges of the bins between them, the last one also finishes the frame
+    void modify(Channel& ch, int slice) {
+        const size_t bins = NUM_BINS - 2;
+        const size_t first = 1 + bins * slice / MODIFY_SLICES;
+        const size_t last = 1 + bins * (slice + 1) / MODIFY_SLICES;
+        for (size_t k = first; k < last; k++) {
+            const float re = ch.spectrum[2 * k];
+            const float im = ch.spectrum[2 * k + 1];
+            const float mag = std::sqrt(re * re + im * im);
+            const float phase = std::atan2(im, re);
+            // before the first frame a bin is taken to advance at its center frequency
+            if (!ch.has_last_phase)
+                ch.last_phase[k] = phase - 2.f * (float)M_PI * k * HOP / FFT_SIZE;
+
+            float out_mag = mag;
+            float out_phase = phase;
+
+            if (frame_mode == FREEZE) {
+                if (capture) {
+                    ch.frozen_mag[k] = mag;
+                    ch.frozen_advance[k] = phase - ch.last_phase[k];
+                    ch.synth_phase[k] = phase;
+                }
+                ch.synth_phase[k] = std::fmod(ch.synth_phase[k] + ch.frozen_advance[k], 2.f * (float)M_PI);
+                out_mag = ch.frozen_mag[k];
+                out_phase = ch.synth_phase[k];
+            } else if (frame_mode == SMEAR) {
+                ch.smear_mag[k] = smear * ch.smear_mag[k] + (1.f - smear) * mag;
+                out_mag = ch.smear_mag[k];
+            }
+
+            ch.last_phase[k] = phase;
+            ch.spectrum[2 * k] = out_mag * std::cos(out_phase);
+            ch.spectrum[2 * k + 1] = out_mag * std::sin(out_phase);
+        }
+        if (slice + 1 < MODIFY_SLICES)
+            return;
+        ch.has_last_phase = true;
+
+        if (frame_mode == FREEZE) {
+            if (capture) {
+                ch.frozen_mag[0] = ch.spectrum[0];
+                ch.frozen_mag[NUM_BINS - 1] = ch.spectrum[1];
+            }
+            ch.spectrum[0] = ch.frozen_mag[0];
+            ch.spectrum[1] = ch.frozen_mag[NUM_BINS - 1];
+        }
+    }
+
+    void synthesize(Channel& ch) {
+        fft.irfft(ch.spectrum.data(), ch.frame.data());
+        fft.scale(ch.frame.data());
+        // written one hop past the frame end, the read head reaches it only after every step has run
+        const uint64_t begin = frame_end + HOP;
+        // hann analysis * hann synthesis at 75% overlap sums to 1.5
+        const float ola_gain = 1.f / 1.5f;
+        for (size_t i = 0; i < FFT_SIZE; i++) {
+            ch.output[wrap(begin + i)] += ch.frame[i] * window[i] * ola_gain;
+        }
+    }
+
+    void run_step(int step) {
+        Channel& ch = channels[step / STEPS_PER_CHANNEL];
+        const int channel_step = step % STEPS_PER_CHANNEL;
+        if (channel_step == 0)
+            analyze(ch);
+        else if (channel_step <= MODIFY_SLICES)
+            modify(ch, channel_step - 1);
+        else
+            synthesize(ch);
+    }
+
+  public:
+    Mode mode = OFF;
+    float smear = 0.9f;
+
+    SpectralProcessor() {
+        for (size_t i = 0; i < FFT_SIZE; i++) {
+            window[i] = 0.5f * (1.f - std::cos(2.f * (float)M_PI * i / FFT_SIZE));
+        }
+        reset();
+    }
+
+    void reset() {
+        for (auto& ch : channels) {
+            ch.input.fill(0.f);
+            ch.output.fill(0.f);
+            ch.smear_mag.fill(0.f);
+            ch.last_phase.fill(0.f);
+            ch.has_last_phase = false;
+        }
+        time = 0;
+        frame_end = 0;
+        next_step = STEPS_PER_CHANNEL * MAX_CHANNELS;
+        frozen = false;
+    }
+
+    // re-captures the spectrum at the read head the next time freeze runs
+    void unfreeze() {
+        frozen = false;
+    }
+
+    auto latency() const -> size_t {
+        return FFT_SIZE + HOP;
+    }
+
+    void process(std::vector<double>& frame) {
+        const size_t num_channels = std::min<size_t>(frame.size(), MAX_CHANNELS);
+        const size_t t = wrap(time);
+
+        for (size_t c = 0; c < num_channels; c++) {
+            channels[c].input[t] = (float)frame[c];
+            frame[c] = channels[c].output[t];
+            channels[c].output[t] = 0.f;
+        }
+        time += 1;
+
+        // spread the pending steps of the current frame evenly across the hop
+        const uint64_t hop_pos = time - frame_end;
+        const int total_steps = STEPS_PER_CHANNEL * (int)num_channels;
+        while (next_step < total_steps && hop_pos * total_steps >= (uint64_t)next_step * HOP) {
+            run_step(next_step++);
+        }
+
+        if (time % HOP == 0 && time >= FFT_SIZE) {
+            // the first frozen frame captures the spectrum, later ones only resynthesize it
+            capture = mode == FREEZE && !frozen;
+            frozen = mode == FREEZE;
+            frame_mode = mode;
+            frame_end = time;
+            next_step = 0;
+        }
+    }
+};
+
+// Owning handle to a lazily created spectral stage, copies start out empty.
+// The processor is made on the worker pool the first time the stage is switched on and kept from then on,
+// stopping or switching off only clears its state, so the audio thread never allocates or frees it.
+struct SpectralStage {
+  private:
+    std::unique_ptr<SpectralProcessor> m_processor;  // audio thread
+    std::atomic<SpectralProcessor*> m_prepared {nullptr};  // made on the pool, taken over by process
+    std::atomic<bool> m_requested {false};
+    bool m_restart = false;
+
+    void request_processor() {
+        if (m_requested.exchange(true))
+            return;
+        auto task = [this] { m_prepared.store(new SpectralProcessor()); };
+        if (!rage::WorkerPool::shared().post(this, task, rage::WorkerPool::HIGH))
+            m_requested = false;
+    }
+
+  public:
+    SpectralProcessor::Mode mode = SpectralProcessor::OFF;
+    float smear = 0.9f;
+
+    SpectralStage() = default;
+
+    SpectralStage(const SpectralStage& other) : mode(other.mode), smear(other.smear) {}
+
+    SpectralStage& operator=(const SpectralStage& other) {
+        m_restart = true;
+        mode = other.mode;
+        smear = other.smear;
+        return *this;
+    }
+
+    ~SpectralStage() {
+        rage::WorkerPool::shared().cancel(this);
+        delete m_prepared.load();
+    }
+
+    // the next voice starts from silence
+    void release() {
+        m_restart = true;
+    }
+
+    void unfreeze() {
+        if (m_processor)
+            m_processor->unfreeze();
+    }
+
+    auto process(std::vector<double> frame) -> std::vector<double> {
+        if (mode == SpectralProcessor::OFF) {
+            m_restart = true;
+            return frame;
+        }
+
+        // passes the frame through untouched until the pool has made the processor
+        if (!m_processor) {
+            m_processor.reset(m_prepared.exchange(nullptr));
+            if (!m_processor) {
+                request_processor();
+                return frame;
+            }
+            m_restart = false;
+        }
+        if (m_restart) {
+            m_processor->reset();
+            m_restart = false;
+        }
+
+        m_processor->mode = mode;
+        m_processor->smear = smear;
+        m_processor->process(frame);
+        return frame;
+    }
+};
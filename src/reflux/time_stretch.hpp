@@ -0,0 +1,131 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <functional>
+#include <vector>
+
+/*
+References:
+    - Curtis Roads, "Microsound" (synchronous granular synthesis)
+    - https://en.wikipedia.org/wiki/Audio_time_stretching_and_pitch_scaling
+
+Overlapping hann windowed grains are spawned at the read head every half grain and play back at
+the pitch ratio, so the read head speed only controls duration. With 50% overlap the windows sum to one,
+and at most MAX_GRAINS grains are ever mixed, which keeps the per voice cost fixed.
+Each grain keeps the direction of the read head it was spawned at. A grain running past the start or stop of the
+range is folded back into it, like ping-pong playback, so it plays out its whole window instead of being cut.
+*/
+
+using GrainSampleGetter = std::function<double(double, double)>;
+
+struct GrainStretcher {
+    enum { MAX_GRAINS = 4 };
+    enum { OVERLAP = 2 };
+
+    struct Grain {
+        double pos = 0.0;  // unfolded, see fold
+        double step = 0.0;
+        double age = 0.0;
+        bool active = false;
+    };
+
+  private:
+    std::array<Grain, MAX_GRAINS> grains;
+    std::vector<double> frame;
+    double grain_frames = 0.0;
+    double inverse_grain_frames = 0.0;
+    double pitch_ratio = 1.0;
+    double spawn_countdown = 0.0;
+
+    static auto read_smooth(const GrainSampleGetter& get_sample, size_t channel_idx, double pos) -> double {
+        const double less = std::floor(pos);
+        const double frac = pos - less;
+        const double less_sample = get_sample(channel_idx, less);
+        if (frac == 0.0)
+            return less_sample;
+        return less_sample + (get_sample(channel_idx, less + 1.0) - less_sample) * frac;
+    }
+
+    // pos reflected back and forth between first and last
+    static auto fold(double pos, double first, double last) -> double {
+        const double span = last - first;
+        if (span <= 0.0)
+            return first;
+        double offset = std::fmod(pos - first, 2.0 * span);
+        if (offset < 0.0)
+            offset += 2.0 * span;
+        return offset <= span ? first + offset : first + 2.0 * span - offset;
+    }
+
+    void spawn(double pos, double step) {
+        Grain* slot = &grains[0];
+        for (auto& grain : grains) {
+            if (!grain.active) {
+                slot = &grain;
+                break;
+            }
+            // steal the oldest grain if every slot is busy
+            if (grain.age > slot->age)
+                slot = &grain;
+        }
+        slot->pos = pos;
+        slot->step = step;
+        slot->age = 0.0;
+        slot->active = true;
+    }
+
+  public:
+    void configure(double grain_frames, double pitch_ratio) {
+        this->grain_frames = std::max(grain_frames, 2.0);
+        this->inverse_grain_frames = 1.0 / this->grain_frames;
+        this->pitch_ratio = pitch_ratio;
+    }
+
+    void reset() {
+        for (auto& grain : grains) {
+            grain.active = false;
+        }
+        spawn_countdown = 0.0;
+    }
+
+    // direction is the signed speed of the read head, frames [start, stop) are read
+    auto process(
+        const GrainSampleGetter& get_sample,
+        size_t num_channels,
+        double read,
+        double direction,
+        double start,
+        double stop
+    ) -> const std::vector<double>& {
+        if (frame.size() != num_channels)
+            frame.resize(num_channels);
+        std::fill(frame.begin(), frame.end(), 0.0);
+
+        spawn_countdown -= 1.0;
+        if (spawn_countdown <= 0.0) {
+            spawn(read, direction < 0 ? -pitch_ratio : pitch_ratio);
+            spawn_countdown += grain_frames / OVERLAP;
+        }
+
+        // read_smooth also reads the frame after pos
+        const double last = std::max(start, stop - 1.0);
+
+        for (auto& grain : grains) {
+            if (!grain.active)
+                continue;
+
+            const double pos = fold(grain.pos, start, last);
+            const double window = 0.5 * (1.0 - std::cos(2.0 * M_PI * grain.age * inverse_grain_frames));
+            for (size_t channel_idx = 0; channel_idx < num_channels; channel_idx++) {
+                frame[channel_idx] += window * read_smooth(get_sample, channel_idx, pos);
+            }
+
+            grain.pos += grain.step;
+            grain.age += 1.0;
+            grain.active = grain.age < grain_frames;
+        }
+
+        return frame;
+    }
+};
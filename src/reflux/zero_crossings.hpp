@@ -0,0 +1,152 @@
+#pragma once
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include "src/shared/triple_buffer.hpp"
+#include "src/shared/worker_pool.hpp"
+
+/*
+Sorted frames where the channel mix of a clip changes sign, built on the worker pool next to the peak data.
+Snapping a frame is a binary search. Appended audio only extends the index, overwritten audio re-scans from
+the first changed frame. Crossings closer than MIN_SPACING frames to the previous one are skipped, which
+bounds the index on noisy material without making snapping noticeably coarser.
+The audio thread reads its own copy of the index from a triple buffer, other threads share a snapshot.
+*/
+
+struct ZeroCrossingIndex {
+    enum { MIN_SPACING = 16 };
+
+    using Frames = std::vector<uint32_t>;
+    using FrameGetter = std::function<double(uintptr_t, uintptr_t)>;
+
+  private:
+    std::shared_ptr<const Frames> published = std::make_shared<const Frames>();
+    rage::TripleBuffer<Frames> realtime;  // read by the audio thread only
+    std::atomic<uint64_t> dirty_frame {0};
+    Frames scanned;  // worker only, the index the next build extends
+    uint64_t scanned_frames = 0;  // worker only
+
+    auto snapshot() const -> std::shared_ptr<const Frames> {
+        return std::atomic_load(&published);
+    }
+
+    static auto snap_in(const Frames& frames, double frame, double max_distance, int direction) -> double {
+        if (frames.empty() || frame < 0)
+            return frame;
+
+        const double limit = std::numeric_limits<uint32_t>::max();
+        double best = frame;
+        double best_distance = max_distance;
+        if (direction >= 0) {
+            // first crossing at or after frame
+            auto after = std::lower_bound(frames.begin(), frames.end(), (uint32_t)std::min(std::ceil(frame), limit));
+            if (after != frames.end() && *after - frame <= best_distance) {
+                best_distance = *after - frame;
+                best = *after;
+            }
+        }
+        if (direction <= 0) {
+            // last crossing at or before frame
+            auto before = std::upper_bound(frames.begin(), frames.end(), (uint32_t)std::min(std::floor(frame), limit));
+            if (before != frames.begin() && frame - *(before - 1) <= best_distance)
+                best = *(before - 1);
+        }
+        return best;
+    }
+
+    void build(const FrameGetter& get_sample, uintptr_t num_channels, uintptr_t num_frames) {
+        const uint64_t dirty = dirty_frame.exchange(std::numeric_limits<uint64_t>::max());
+        const uint64_t from = std::min(scanned_frames, dirty);
+        if (from >= num_frames && dirty == std::numeric_limits<uint64_t>::max())
+            return;
+
+        // keep the crossings before the first changed frame, scan the rest
+        Frames* frames = &scanned;
+        frames->erase(std::lower_bound(frames->begin(), frames->end(), (uint32_t)from), frames->end());
+
+        auto mix = [&](uintptr_t fidx) {
+            double sum = 0.0;
+            for (uintptr_t cidx = 0; cidx < num_channels; cidx++) {
+                sum += get_sample(cidx, fidx);
+            }
+            return sum;
+        };
+
+        uintptr_t fidx = from > 0 ? from - 1 : 0;
+        double previous = num_frames > 0 ? mix(fidx) : 0.0;
+        for (fidx += 1; fidx < num_frames; fidx++) {
+            const double current = mix(fidx);
+            if ((previous < 0.0) != (current < 0.0)) {
+                // the frame of the pair closer to zero
+                const uint32_t crossing = (uint32_t)(std::abs(previous) < std::abs(current) ? fidx - 1 : fidx);
+                if (frames->empty() || crossing >= frames->back() + MIN_SPACING)
+                    frames->push_back(crossing);
+            }
+            previous = current;
+        }
+
+        scanned_frames = num_frames;
+        // the back slot keeps its capacity, so copying into it only allocates while the index grows
+        realtime.back() = scanned;
+        realtime.publish();
+        std::atomic_store(&published, std::make_shared<const Frames>(scanned));
+    }
+
+  public:
+    ZeroCrossingIndex() = default;
+
+    // copies start out empty and are rebuilt on the next request
+    ZeroCrossingIndex(const ZeroCrossingIndex&) {}
+
+    ZeroCrossingIndex& operator=(const ZeroCrossingIndex&) {
+        invalidate_from(0);
+        return *this;
+    }
+
+    // marks audio from frame on as changed, cheap enough for the audio thread
+    void invalidate_from(uint64_t frame) {
+        uint64_t current = dirty_frame.load(std::memory_order_relaxed);
+        while (frame < current && !dirty_frame.compare_exchange_weak(current, frame)) {
+        }
+    }
+
+    // scans new or changed audio of source (anything with get_sample(channel, frame)) in the background and keeps
+    // it alive until the build is done. audio thread safe, copies only the pointer. when the pool queue is full the
+    // changes wait for the next request
+    template<class Source>
+    void request(std::shared_ptr<const Source> source, uintptr_t num_channels, uintptr_t num_frames) {
+        auto task = [this, source, num_channels, num_frames] {
+            const Source* audio = source.get();
+            auto get_sample = [audio](uintptr_t cidx, uintptr_t fidx) { return audio->get_sample(cidx, fidx); };
+            build(get_sample, num_channels, num_frames);
+        };
+        rage::WorkerPool::shared().post(this, std::move(task), rage::WorkerPool::LOW, this);
+    }
+
+    void cancel() {
+        rage::WorkerPool::shared().cancel_owner(this);
+    }
+
+    auto size() const -> size_t {
+        return snapshot()->size();
+    }
+
+    // Nearest crossing within max_distance of frame, or frame itself when there is none.
+    // A positive direction only looks at or after frame and a negative one at or before it, so knob drags
+    // in small steps still move on to the next crossing instead of snapping back. Not for the audio thread
+    auto snap(double frame, double max_distance, int direction = 0) const -> double {
+        return snap_in(*snapshot(), frame, max_distance, direction);
+    }
+
+    // snap for the audio thread, never allocates or locks
+    auto snap_realtime(double frame, double max_distance, int direction = 0) const -> double {
+        return snap_in(realtime.read(), frame, max_distance, direction);
+    }
+};
@@ -0,0 +1,86 @@
+#pragma once
+#include <cmath>
+
+/*
+References:
+    - Andrew Simper, "Linear Trapezoidal Integrated State Variable Filter":
+      https://cytomic.com/files/dsp/SvfLinearTrapOptimised2.pdf
+    - Vadim Zavalishin, "The Art of VA Filter Design" (TPT / zero delay feedback)
+
+A single state update yields the lowpass, bandpass and highpass responses at the same time.
+Cutoff changes only recompute a handful of multiplies so the filter can be modulated at audio rate.
+*/
+
+namespace rage {
+
+// 5th order pade approximation of tan(x), accurate well past x = 1.4 (~0.45 * nyquist)
+inline auto fast_tan(double x) -> double {
+    const double x2 = x * x;
+    return x * (945.0 - 105.0 * x2 + x2 * x2) / (945.0 - 420.0 * x2 + 15.0 * x2 * x2);
+}
+
+struct SVFOutput {
+    double lowpass;
+    double bandpass;
+    double highpass;
+};
+
+struct SVFilter {
+  private:
+    // integrator states
+    double ic1eq = 0.0;
+    double ic2eq = 0.0;
+
+    // coefficients
+    double g = 0.0;
+    double k = 1.0;
+    double a1 = 1.0;
+    double a2 = 0.0;
+    double a3 = 0.0;
+
+    void update_coefficients() {
+        a1 = 1.0 / (1.0 + g * (g + k));
+        a2 = g * a1;
+        a3 = g * a2;
+    }
+
+  public:
+    SVFilter() = default;
+
+    SVFilter(double fc, double Q) {
+        set(fc, Q);
+    }
+
+    // fc is the cutoff normalized to the sample rate (freq / sample_rate)
+    void set(double fc, double Q) {
+        k = 1.0 / Q;
+        set_fc(fc);
+    }
+
+    void set_fc(double fc) {
+        fc = fc < 0.0 ? 0.0 : fc > 0.49 ? 0.49 : fc;
+        g = fast_tan(M_PI * fc);
+        update_coefficients();
+    }
+
+    void set_Q(double Q) {
+        k = 1.0 / Q;
+        update_coefficients();
+    }
+
+    void reset() {
+        ic1eq = ic2eq = 0.0;
+    }
+
+    auto process(double v0) -> SVFOutput {
+        const double v3 = v0 - ic2eq;
+        const double v1 = a1 * ic1eq + a2 * v3;
+        const double v2 = ic2eq + a2 * ic1eq + a3 * v3;
+        ic1eq = 2.0 * v1 - ic1eq;
+        ic2eq = 2.0 * v2 - ic2eq;
+        // bandpass is scaled by k for unity gain at the cutoff, so lowpass + bandpass + highpass == input
+        return {v2, k * v1, v0 - k * v1 - v2};
+    }
+};
+
+}  // namespace rage
@@ -0,0 +1,63 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <stdint.h>
+
+/*
+Single writer / single reader triple buffer.
+The writer fills back() and publishes it by swapping it with the middle slot, the reader swaps the middle
+slot into the front only when something new was published. Neither side ever waits on the other, and the
+reader always sees a complete snapshot. Every publish is stamped with an increasing epoch.
+*/
+
+namespace rage {
+
+template<typename T>
+struct TripleBuffer {
+  private:
+    enum : uint8_t { INDEX_MASK = 0x3, FRESH = 0x4 };
+
+    std::array<T, 3> slots;
+    std::array<uint64_t, 3> epochs {};
+    mutable std::atomic<uint8_t> middle {1};
+    mutable uint8_t front = 0;  // owned by the reader
+    uint8_t back_idx = 2;  // owned by the writer
+    uint64_t write_epoch = 0;
+
+  public:
+    TripleBuffer() = default;
+
+    // copies start out empty, the data is rebuilt by the owner
+    TripleBuffer(const TripleBuffer&) {}
+
+    TripleBuffer& operator=(const TripleBuffer&) {
+        return *this;
+    }
+
+    // writer side
+    auto back() -> T& {
+        return slots[back_idx];
+    }
+
+    void publish() {
+        epochs[back_idx] = ++write_epoch;
+        const uint8_t old = middle.exchange(back_idx | FRESH, std::memory_order_acq_rel);
+        back_idx = old & INDEX_MASK;
+    }
+
+    // reader side, picks up the latest published snapshot if there is one
+    auto read() const -> const T& {
+        if (middle.load(std::memory_order_relaxed) & FRESH) {
+            const uint8_t old = middle.exchange(front, std::memory_order_acq_rel);
+            front = old & INDEX_MASK;
+        }
+        return slots[front];
+    }
+
+    // epoch of the snapshot last returned by read(), 0 until the first publish arrives
+    auto epoch() const -> uint64_t {
+        return epochs[front];
+    }
+};
+
+}  // namespace rage
@@ -0,0 +1,505 @@
+#pragma once
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#if defined(ARCH_WIN)
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #ifndef WIN32_LEAN_AND_MEAN
+        #define WIN32_LEAN_AND_MEAN
+    #endif
+    #include <windows.h>
+#elif defined(ARCH_MAC)
+    #include <pthread.h>
+#elif defined(ARCH_LIN)
+    #include <sys/resource.h>
+    #include <sys/syscall.h>
+    #include <unistd.h>
+#endif
+
+/*
+Process wide pool of low priority threads shared by every module instance.
+Tasks are keyed by their target: submitting for a key that is still queued replaces the queued task, so
+only the newest request for a target ever runs, and a key never runs on two threads at once.
+Owners (usually the object that holds the targets) can drop all their work before they go away.
+Cancelling also raises a flag the running task can poll through cancelled() to stop early.
+
+The audio thread never submits directly. It posts into a bounded lock free queue of inline tasks that the
+workers move into the keyed queue, so handing work over takes no lock and no allocation. Posting wakes a
+worker only when one is idle, idle workers otherwise sleep. A wake up that slips in just before a worker
+starts waiting is caught by a long backstop timeout, so an idle pool wakes up a few times a second at most.
+*/
+
+namespace rage {
+
+// Move only void() callable stored inline, so queueing one from the audio thread never allocates
+struct InplaceTask {
+    enum { CAPACITY = 256 };
+
+  private:
+    typename std::aligned_storage<CAPACITY, alignof(std::max_align_t)>::type storage;
+    void (*invoke_fn)(void*) = nullptr;
+    void (*move_fn)(void*, void*) = nullptr;  // move constructs the first from the second, destroys the second
+    void (*destroy_fn)(void*) = nullptr;
+
+    template<class F>
+    static void invoke_impl(void* f) {
+        (*static_cast<F*>(f))();
+    }
+
+    template<class F>
+    static void move_impl(void* dst, void* src) {
+        new (dst) F(std::move(*static_cast<F*>(src)));
+        static_cast<F*>(src)->~F();
+    }
+
+    template<class F>
+    static void destroy_impl(void* f) {
+        static_cast<F*>(f)->~F();
+    }
+
+    void take(InplaceTask& other) {
+        if (!other.move_fn)
+            return;
+        other.move_fn(&storage, &other.storage);
+        invoke_fn = other.invoke_fn;
+        move_fn = other.move_fn;
+        destroy_fn = other.destroy_fn;
+        other.invoke_fn = nullptr;
+        other.move_fn = nullptr;
+        other.destroy_fn = nullptr;
+    }
+
+  public:
+    InplaceTask() = default;
+
+    template<
+        class F,
+        class = typename std::enable_if<!std::is_same<typename std::decay<F>::type, InplaceTask>::value>::type>
+    InplaceTask(F&& f) {  // NOLINT
+        emplace(std::forward<F>(f));
+    }
+
+    InplaceTask(InplaceTask&& other) {
+        take(other);
+    }
+
+    InplaceTask& operator=(InplaceTask&& other) {
+        if (this != &other) {
+            reset();
+            take(other);
+        }
+        return *this;
+    }
+
+    InplaceTask(const InplaceTask&) = delete;
+    InplaceTask& operator=(const InplaceTask&) = delete;
+
+    ~InplaceTask() {
+        reset();
+    }
+
+    template<class F>
+    void emplace(F&& f) {
+        using Fn = typename std::decay<F>::type;
+        static_assert(sizeof(Fn) <= CAPACITY, "task captures too much to be stored inline");
+        static_assert(alignof(Fn) <= alignof(std::max_align_t), "task is over aligned");
+        reset();
+        new (&storage) Fn(std::forward<F>(f));
+        invoke_fn = &invoke_impl<Fn>;
+        move_fn = &move_impl<Fn>;
+        destroy_fn = &destroy_impl<Fn>;
+    }
+
+    void reset() {
+        if (destroy_fn)
+            destroy_fn(&storage);
+        invoke_fn = nullptr;
+        move_fn = nullptr;
+        destroy_fn = nullptr;
+    }
+
+    explicit operator bool() const {
+        return invoke_fn != nullptr;
+    }
+
+    void operator()() {
+        invoke_fn(&storage);
+    }
+};
+
+struct WorkerPool {
+    enum Priority { HIGH = 0, NORMAL, LOW };
+    enum { QUEUE_SIZE = 1024 };  // power of two
+    enum { IDLE_WAIT_MS = 250 };  // backstop for a missed wake up
+
+    using Key = const void*;
+    using Task = std::function<void()>;
+
+  private:
+    struct Pending {
+        InplaceTask task;
+        Priority priority;
+        Key owner;
+        uint64_t order;
+    };
+
+    struct Running {
+        Key key = nullptr;
+        Key owner = nullptr;
+        std::atomic<bool> cancelled {false};
+    };
+
+    // one slot of the posting queue, a bounded multi producer queue after Dmitry Vyukov
+    struct Request {
+        enum Kind { SUBMIT, CANCEL };
+        std::atomic<size_t> sequence {0};
+        Kind kind = SUBMIT;
+        Key key = nullptr;
+        Key owner = nullptr;
+        Priority priority = NORMAL;
+        InplaceTask task;
+    };
+
+    std::vector<std::thread> workers;
+    std::unique_ptr<Running[]> running;
+    size_t num_running = 0;
+    std::unordered_map<Key, Pending> pending;
+    std::mutex mutex;
+    std::condition_variable work_cv;
+    std::condition_variable done_cv;
+    uint64_t next_order = 0;
+    bool stopping = false;
+
+    std::unique_ptr<Request[]> requests;
+    std::atomic<size_t> enqueue_pos {0};
+    size_t dequeue_pos = 0;  // under mutex
+    std::atomic<size_t> num_idle {0};
+
+    static auto current_cancelled() -> const std::atomic<bool>*& {
+        static thread_local const std::atomic<bool>* flag = nullptr;
+        return flag;
+    }
+
+    static void lower_thread_priority() {
+#if defined(ARCH_WIN)
+        SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_BELOW_NORMAL);
+#elif defined(ARCH_MAC)
+        pthread_set_qos_class_self_np(QOS_CLASS_UTILITY, 0);
+#elif defined(ARCH_LIN)
+        setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 10);
+#endif
+    }
+
+    auto is_running(Key key) const -> bool {
+        for (size_t idx = 0; idx < num_running; idx++) {
+            if (running[idx].key == key)
+                return true;
+        }
+        return false;
+    }
+
+    auto is_running_owner(Key owner) const -> bool {
+        for (size_t idx = 0; idx < num_running; idx++) {
+            if (running[idx].key && running[idx].owner == owner)
+                return true;
+        }
+        return false;
+    }
+
+    // claims a free queue slot, nullptr when the queue is full. the slot is handed to the workers by commit
+    auto claim(size_t& pos) -> Request* {
+        pos = enqueue_pos.load(std::memory_order_relaxed);
+        while (true) {
+            Request& request = requests[pos & (QUEUE_SIZE - 1)];
+            const size_t sequence = request.sequence.load(std::memory_order_acquire);
+            const intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+            if (diff == 0) {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    return &request;
+            } else if (diff < 0) {
+                return nullptr;
+            } else {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // hands the slot to the workers and wakes one if they are all idle
+    void commit(Request* request, size_t pos) {
+        request->sequence.store(pos + 1, std::memory_order_release);
+        // pairs with the fence in run, either the worker sees the request or this sees the worker
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (num_idle.load(std::memory_order_relaxed) > 0)
+            work_cv.notify_one();
+    }
+
+    // under mutex
+    auto has_posted() const -> bool {
+        const Request& request = requests[dequeue_pos & (QUEUE_SIZE - 1)];
+        return request.sequence.load(std::memory_order_acquire) == dequeue_pos + 1;
+    }
+
+    void enqueue(Key key, InplaceTask task, Priority priority, Key owner, std::vector<InplaceTask>& dropped) {
+        auto it = pending.find(key);
+        if (it != pending.end()) {
+            dropped.push_back(std::move(it->second.task));
+            it->second.task = std::move(task);
+            it->second.priority = std::min(it->second.priority, priority);
+            it->second.owner = owner;
+        } else {
+            Pending& job = pending[key];
+            job.task = std::move(task);
+            job.priority = priority;
+            job.owner = owner;
+            job.order = next_order++;
+        }
+    }
+
+    // drops the queued task of key and flags a running one. dropped tasks are destroyed by the caller once
+    // the lock is released, their captures may call back into the pool
+    void drop(Key key, std::vector<InplaceTask>& dropped) {
+        auto it = pending.find(key);
+        if (it != pending.end()) {
+            dropped.push_back(std::move(it->second.task));
+            pending.erase(it);
+        }
+        for (size_t idx = 0; idx < num_running; idx++) {
+            if (running[idx].key == key)
+                running[idx].cancelled = true;
+        }
+    }
+
+    // moves everything posted so far into the keyed queue, in posting order
+    void drain(std::vector<InplaceTask>& dropped) {
+        while (true) {
+            Request& request = requests[dequeue_pos & (QUEUE_SIZE - 1)];
+            const size_t sequence = request.sequence.load(std::memory_order_acquire);
+            if ((intptr_t)sequence - (intptr_t)(dequeue_pos + 1) < 0)
+                return;
+            if (request.kind == Request::SUBMIT)
+                enqueue(request.key, std::move(request.task), request.priority, request.owner, dropped);
+            else
+                drop(request.key, dropped);
+            request.task.reset();
+            request.sequence.store(dequeue_pos + QUEUE_SIZE, std::memory_order_release);
+            dequeue_pos += 1;
+        }
+    }
+
+    // highest priority, then oldest, skipping keys that are already being worked on
+    auto next_pending() -> std::unordered_map<Key, Pending>::iterator {
+        auto best = pending.end();
+        for (auto it = pending.begin(); it != pending.end(); ++it) {
+            if (is_running(it->first))
+                continue;
+            if (best == pending.end() || it->second.priority < best->second.priority ||
+                (it->second.priority == best->second.priority && it->second.order < best->second.order))
+                best = it;
+        }
+        return best;
+    }
+
+    void run(size_t worker_idx) {
+        lower_thread_priority();
+        Running& slot = running[worker_idx];
+        current_cancelled() = &slot.cancelled;
+        std::vector<InplaceTask> dropped;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping) {
+            drain(dropped);
+            if (!dropped.empty()) {
+                lock.unlock();
+                dropped.clear();
+                lock.lock();
+                continue;
+            }
+
+            auto it = next_pending();
+            if (it == pending.end()) {
+                num_idle.fetch_add(1);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (!has_posted())
+                    work_cv.wait_for(lock, std::chrono::milliseconds(IDLE_WAIT_MS));
+                num_idle.fetch_sub(1);
+                continue;
+            }
+
+            const Key key = it->first;
+            InplaceTask task = std::move(it->second.task);
+            slot.key = key;
+            slot.owner = it->second.owner;
+            slot.cancelled = false;
+            pending.erase(it);
+
+            lock.unlock();
+            task();
+            task.reset();
+            lock.lock();
+
+            slot.key = nullptr;
+            slot.owner = nullptr;
+            done_cv.notify_all();
+            // a newer task for the same key may have been waiting on this one
+            work_cv.notify_all();
+        }
+    }
+
+  public:
+    explicit WorkerPool(size_t num_threads) :
+        running(new Running[num_threads]),
+        num_running(num_threads),
+        requests(new Request[QUEUE_SIZE]) {
+        for (size_t idx = 0; idx < QUEUE_SIZE; idx++) {
+            requests[idx].sequence.store(idx, std::memory_order_relaxed);
+        }
+        for (size_t idx = 0; idx < num_threads; idx++) {
+            workers.emplace_back([this, idx] { run(idx); });
+        }
+    }
+
+    ~WorkerPool() {
+        std::vector<InplaceTask> dropped;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            drain(dropped);
+            for (auto& entry : pending) {
+                dropped.push_back(std::move(entry.second.task));
+            }
+            pending.clear();
+        }
+        work_cv.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    static auto shared() -> WorkerPool& {
+        static WorkerPool pool(std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency() / 2, 4)));
+        return pool;
+    }
+
+    // true inside a task once it was cancelled, long tasks poll this and return early
+    static auto cancelled() -> bool {
+        const std::atomic<bool>* flag = current_cancelled();
+        return flag && flag->load(std::memory_order_relaxed);
+    }
+
+    // replaces any queued task for key, a queued task keeps its place in line but takes the higher priority
+    void submit(Key key, Task task, Priority priority = NORMAL, Key owner = nullptr) {
+        std::vector<InplaceTask> dropped;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            drain(dropped);
+            enqueue(key, InplaceTask(std::move(task)), priority, owner, dropped);
+        }
+        work_cv.notify_one();
+    }
+
+    // Same as submit for the audio thread: lock and allocation free. False when the queue is full, f is then
+    // left untouched so the caller can try again later
+    template<class F>
+    auto post(Key key, F&& f, Priority priority = NORMAL, Key owner = nullptr) -> bool {
+        size_t pos;
+        Request* request = claim(pos);
+        if (!request)
+            return false;
+        request->kind = Request::SUBMIT;
+        request->key = key;
+        request->owner = owner;
+        request->priority = priority;
+        request->task.emplace(std::forward<F>(f));
+        commit(request, pos);
+        return true;
+    }
+
+    // drops the queued task for key and flags a running one, without waiting for it. audio thread safe
+    auto post_cancel(Key key) -> bool {
+        size_t pos;
+        Request* request = claim(pos);
+        if (!request)
+            return false;
+        request->kind = Request::CANCEL;
+        request->key = key;
+        request->owner = nullptr;
+        commit(request, pos);
+        return true;
+    }
+
+    // Lets go of garbage on a worker, so freeing a big buffer (or running a destructor that waits on the pool)
+    // never happens on the audio thread. garbage is only moved from when this returns true
+    template<class T>
+    auto retire(std::shared_ptr<T>& garbage, Key owner = nullptr) -> bool {
+        struct Release {
+            std::shared_ptr<const void> garbage;
+
+            void operator()() {
+                garbage.reset();
+            }
+        };
+        if (!garbage)
+            return true;
+        size_t pos;
+        Request* request = claim(pos);
+        if (!request)
+            return false;
+        request->kind = Request::SUBMIT;
+        request->key = garbage.get();
+        request->owner = owner;
+        request->priority = LOW;
+        request->task.emplace(Release {std::move(garbage)});
+        commit(request, pos);
+        return true;
+    }
+
+    // drops the queued task for key, flags a running one and waits for it to finish
+    void cancel(Key key) {
+        std::vector<InplaceTask> dropped;
+        std::unique_lock<std::mutex> lock(mutex);
+        drain(dropped);
+        drop(key, dropped);
+        done_cv.wait(lock, [&] { return !is_running(key); });
+        lock.unlock();
+        dropped.clear();
+    }
+
+    // same as cancel for every task submitted by owner
+    void cancel_owner(Key owner) {
+        std::vector<InplaceTask> dropped;
+        std::unique_lock<std::mutex> lock(mutex);
+        drain(dropped);
+        for (auto it = pending.begin(); it != pending.end();) {
+            if (it->second.owner == owner) {
+                dropped.push_back(std::move(it->second.task));
+                it = pending.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        for (size_t idx = 0; idx < num_running; idx++) {
+            if (running[idx].key && running[idx].owner == owner)
+                running[idx].cancelled = true;
+        }
+        done_cv.wait(lock, [&] { return !is_running_owner(owner); });
+        lock.unlock();
+        dropped.clear();
+    }
+};
+
+}  // namespace rage